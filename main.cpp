@@ -7,36 +7,45 @@
  * Organization:
  * 1. Data Types - Definitions for basic data types, such as side, price, etc.
  * 2. Message Types - Message structures with normalized types to handle each operation.
- * 3. Order Book - Order book made up of separate sets of buy and sell levels ordered by price where each level has a queue of orders.
- * 4. Matching Engine - Matchine engine dispatches events to the order book and handles trade events.
- * 5. Command Processor - Reads and dispatches commands to the matching engine.
- * 6. Main - Make and run the command processor with a matching engine using stdin and stdout streams.
- * 7. Unit Tests - Tests matching engine with various inputs.
+ * 3. Instrumentation - Timing, latency histograms, and counters that are cheap enough to always leave enabled.
+ * 4. Order Book - Order book made up of separate sets of buy and sell levels ordered by price where each level has a queue of orders.
+ * 5. Market Data - Publishes top of book, level updates, and trades to a shared-memory ring buffer for co-located consumers.
+ * 6. Matching Engine - Matchine engine dispatches events to the order book and handles trade events.
+ * 7. Command Processor - Reads and dispatches commands to the matching engine.
+ * 8. Main - Make and run the command processor with a matching engine using stdin and stdout streams.
+ * 9. Unit Tests - Tests matching engine with various inputs.
+ * 10. Benchmarks - Microbenchmarks of each book operation across book depths, level densities, and book backends.
  *
  * Improvements:
  * 1. Fix-sized OrderID - Use a fixed-size array internally for OrderID to avoid string allocations (requires an upper bound in order ID length in the spec).
  * 2. Threading - Read and parse input from one thread and run matching engine in a separate thread.
  * 3. Intrusive Container - Use Boost intrusive containers for list and set to store objects themselves in containers instead of dynamically allocated copies.
- * 4. Memory Pool - Allocate orders, levels, etc. using a memory pool.
- * 5. Uncross Book - Add an uncross method to Book that calculates all trades for a crossed book, such as during an auction.
- * 6. Unordered Prices - Use unordered_set in addition to set to hold pointers to levels by price for O(1) lookup.
+ * 4. Unordered Prices - Use unordered_set in addition to set to hold pointers to levels by price for O(1) lookup.
  */
 #include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <functional>
 #include <iterator>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <queue>
+#include <random>
 #include <set>
 #include <stdexcept>
 #include <string>
@@ -46,6 +55,25 @@
 #include <utility>
 #include <vector>
 
+// POSIX
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__x86_64__) or defined(__i386__)
+    #include <x86intrin.h> // __rdtsc
+#endif
+
 // Define DEBUG macro to enable more verbose logging and checks within IF_DEBUG.
 //#define DEBUG
 #ifdef DEBUG
@@ -54,6 +82,28 @@
     #define IF_DEBUG(x)
 #endif
 
+// Define TRACE macro to record events at probe points on the hot path with TRACE_EVENT (see Tracer).
+//#define TRACE
+#ifdef TRACE
+    #define TRACE_EVENT(event, arg) trace_event(TraceEvent::event, arg)
+#else
+    #define TRACE_EVENT(event, arg)
+#endif
+
+// Define COUNT_ALLOCS macro to replace the global operator new and delete to count heap allocations (see AllocCounter).
+//#define COUNT_ALLOCS
+
+// Define PRICE_BITS or QTY_BITS as 32 to store prices in 32-bit ticks or quantities in 32 bits when all products fit,
+// which shrinks orders, levels, and index entries and doubles the lanes of the vectorized qty sums (default 64).
+//#define PRICE_BITS 32
+//#define QTY_BITS 32
+#ifndef PRICE_BITS
+    #define PRICE_BITS 64
+#endif
+#ifndef QTY_BITS
+    #define QTY_BITS 64
+#endif
+
 
 /*
  * 1. Data Types - Definitions for basic data types, such as side, price, etc.
@@ -119,6 +169,7 @@ enum class TIF : char
 {
     GFD = '0', // Good For Day: Order will stay in the order book until it's been all traded
     IOC = '3', // Immediate Or Cancel: If order can't be traded immediately, it will be cancelled right away. If only partially traded, non-traded part is cancelled.
+    FOK = '4', // Fill Or Kill: If order can't be fully traded immediately, it will be cancelled right away without trading.
     Invalid = '?',
 };
 
@@ -138,6 +189,12 @@ std::ostream & operator<<(std::ostream & os, TIF tif)
             break;
         }
 
+        case TIF::FOK:
+        {
+            os << "FOK";
+            break;
+        }
+
         case TIF::Invalid:
         {
             os << "INVALID";
@@ -159,6 +216,10 @@ std::istream & operator>>(std::istream & is, TIF & tif)
     {
         tif = TIF::IOC;
     }
+    else if (str == "FOK")
+    {
+        tif = TIF::FOK;
+    }
     else
     {
         tif = TIF::Invalid;
@@ -167,13 +228,57 @@ std::istream & operator>>(std::istream & is, TIF & tif)
 }
 
 
+// Unsigned integer type with the given number of bits, which configures the width of prices and quantities.
+template <int Bits>
+struct UnsignedInt;
+
+template <>
+struct UnsignedInt<32>
+{
+    using type = std::uint32_t;
+};
+
+template <>
+struct UnsignedInt<64>
+{
+    using type = std::uint64_t;
+};
+
+// Read an unsigned integer that must fit in T, failing the stream with a zero value if it is negative or too large,
+// since reading into an unsigned type directly wraps negative numbers and reading into a wider one would truncate.
+template <typename T>
+std::istream & read_unsigned(std::istream & is, T & value)
+{
+    value = 0;
+    unsigned long long wide_value = 0;
+    if ((is >> std::ws).peek() == '-')
+    {
+        is.setstate(std::ios_base::failbit);
+    }
+    else if (is >> wide_value)
+    {
+        if (wide_value > std::numeric_limits<T>::max())
+        {
+            is.setstate(std::ios_base::failbit);
+        }
+        else
+        {
+            value = static_cast<T>(wide_value);
+        }
+    }
+    return is;
+}
+
+
 // Price data type that wraps unsigned integer.
 // Not simply a typedef so that we have strong type-checking and can more easily add features, such as support decimal prices.
 class Price
 {
 public:
-    // Underlying storage type.
-    using value_type = std::uint64_t;
+    // Underlying storage type (see PRICE_BITS).
+    using value_type = UnsignedInt<PRICE_BITS>::type;
+
+    static Price max() noexcept { return Price{std::numeric_limits<value_type>::max()}; }
 
     // Ctors
     Price() = default;
@@ -198,6 +303,7 @@ public:
     // Arithmetic ops
     Price & operator+=(Price rhs)
     {
+        assert(value_ <= std::numeric_limits<value_type>::max() - rhs.value_); // Must fit in value_type.
         value_ += rhs.value_;
         return *this;
     }
@@ -223,25 +329,184 @@ private:
     value_type value_ = 0;
 };
 
+// Decimal format of the prices of an instrument, such as 101.25 with scale 2 and tick_size 25 (0.25).
+// Text prices have at most scale decimal places and must be a multiple of the tick size, and each Price is the
+// integer number of ticks, so the levels of any instrument stay densely indexed by price.
+// Attached to a stream with price_format(), and prices on a stream without a format are plain integer ticks.
+struct PriceFormat
+{
+    static constexpr unsigned max_scale = 18; // So 10^scale fits in 64 bits.
+
+    unsigned scale = 0; // Number of decimal places.
+    std::uint64_t tick_size = 1; // In units of the last decimal place.
+
+    static std::uint64_t pow10(unsigned exponent) noexcept
+    {
+        std::uint64_t value = 1;
+        for (; exponent != 0; --exponent)
+        {
+            value *= 10;
+        }
+        return value;
+    }
+};
+
+int price_format_index()
+{
+    static int const index = std::ios_base::xalloc();
+    return index;
+}
+
+// Get the price format attached to a stream, or nullptr if prices are integer ticks.
+PriceFormat const * price_format(std::ios_base & ios)
+{
+    return static_cast<PriceFormat const *>(ios.pword(price_format_index()));
+}
+
+// Attach the price format to a stream, which must outlive the stream's use of it.
+void price_format(std::ios_base & ios, PriceFormat const * format)
+{
+    ios.pword(price_format_index()) = const_cast<PriceFormat *>(format);
+}
+
+// Read a decimal number with at most scale decimal places (any more must be zeros) as an integer in units of the
+// last decimal place without floating point, such as 101.25 as 10125 with scale 2,
+// failing the stream with a zero value if it has too many decimal places or does not fit in 64 bits.
+std::istream & read_decimal(std::istream & is, unsigned scale, std::uint64_t & value)
+{
+    value = 0;
+    std::uint64_t integer = 0;
+    if (not read_unsigned(is, integer))
+    {
+        return is;
+    }
+
+    std::uint64_t fraction = 0;
+    unsigned digits = 0;
+    bool is_exact = true;
+    if (is.good() and is.peek() == '.')
+    {
+        is.get();
+        while (std::isdigit(is.peek()))
+        {
+            auto const digit = static_cast<std::uint64_t>(is.get() - '0');
+            if (digits != scale)
+            {
+                fraction = fraction * 10 + digit;
+                ++digits;
+            }
+            else
+            {
+                is_exact = is_exact and digit == 0;
+            }
+        }
+    }
+
+    auto const unit = PriceFormat::pow10(scale);
+    fraction *= PriceFormat::pow10(scale - digits);
+    if (not is_exact or integer > (std::numeric_limits<std::uint64_t>::max() - fraction) / unit)
+    {
+        is.setstate(std::ios_base::failbit);
+        return is;
+    }
+    value = integer * unit + fraction;
+    return is;
+}
+
 std::ostream & operator<<(std::ostream & os, Price price)
 {
-    return os << price.value();
+    auto const format = price_format(os);
+    if (not format)
+    {
+        return os << price.value();
+    }
+
+    std::uint64_t const scaled = price.value() * format->tick_size;
+    if (format->scale == 0)
+    {
+        return os << scaled;
+    }
+    auto const unit = PriceFormat::pow10(format->scale);
+    char digits[PriceFormat::max_scale];
+    auto fraction = scaled % unit;
+    for (auto index = format->scale; index != 0; --index)
+    {
+        digits[index - 1] = static_cast<char>('0' + fraction % 10);
+        fraction /= 10;
+    }
+    return (os << scaled / unit << '.').write(digits, format->scale);
 }
 
+// Read a price in integer ticks, or as a decimal if the stream has a price format,
+// failing the stream with a zero price if it is off the tick grid or too many ticks for Price::value_type,
+// so the command processor rejects that message at ingest and resumes at the next line.
 std::istream & operator>>(std::istream & is, Price & price)
 {
     Price::value_type value{};
-    is >> value;
+    auto const format = price_format(is);
+    if (not format)
+    {
+        read_unsigned(is, value);
+    }
+    else
+    {
+        std::uint64_t scaled = 0;
+        if (read_decimal(is, format->scale, scaled))
+        {
+            if (scaled % format->tick_size != 0 or scaled / format->tick_size > std::numeric_limits<Price::value_type>::max())
+            {
+                is.setstate(std::ios_base::failbit);
+            }
+            else
+            {
+                value = static_cast<Price::value_type>(scaled / format->tick_size);
+            }
+        }
+    }
     price.value(value);
     return is;
 }
 
 
+// Side of the book as a compile-time parameter, so code specialized for each side compares prices and orders its
+// levels without branching on the side.
+template <Side Side_V>
+struct BookSide
+{
+    static_assert(Side_V == Side::Buy or Side_V == Side::Sell, "Book side must be buy or sell");
+
+    static constexpr Side side = Side_V;
+    static constexpr Side opposite = Side_V == Side::Buy ? Side::Sell : Side::Buy;
+
+    // True if lhs is a better price than rhs on this side, which is higher for buys and lower for sells.
+    static bool is_better(Price lhs, Price rhs) noexcept
+    {
+        return Side_V == Side::Buy ? lhs > rhs : lhs < rhs;
+    }
+
+    // True if an order on this side at order_price can trade with an opposite level at level_price.
+    static bool crosses(Price order_price, Price level_price) noexcept
+    {
+        return not is_better(level_price, order_price);
+    }
+
+    // Price worse than price by ticks on this side, saturating at the ends of the price range instead of wrapping.
+    static Price worse_by(Price price, std::uint64_t ticks) noexcept
+    {
+        if (Side_V == Side::Buy)
+        {
+            return price.value() > ticks ? price - Price{static_cast<Price::value_type>(ticks)} : Price{};
+        }
+        return ticks < (Price::max() - price).value() ? price + Price{static_cast<Price::value_type>(ticks)} : Price::max();
+    }
+};
+
+
 class Qty
 {
 public:
-    // Underlying storage type.
-    using value_type = std::uint64_t;
+    // Underlying storage type (see QTY_BITS).
+    using value_type = UnsignedInt<QTY_BITS>::type;
 
     // Ctors
     Qty() = default;
@@ -266,6 +531,7 @@ public:
     // Arithmetic ops
     Qty & operator+=(Qty rhs)
     {
+        assert(value_ <= std::numeric_limits<value_type>::max() - rhs.value_); // Must fit in value_type.
         value_ += rhs.value_;
         return *this;
     }
@@ -299,7 +565,7 @@ std::ostream & operator<<(std::ostream & os, Qty qty)
 std::istream & operator>>(std::istream & is, Qty & qty)
 {
     Qty::value_type value{};
-    is >> value;
+    read_unsigned(is, value);
     qty.value(value);
     return is;
 }
@@ -328,12 +594,12 @@ public:
     bool empty() const noexcept { return value_.empty(); }
 
     // Comparison ops
-    bool operator==(OrderID rhs) const { return value_ == rhs.value_; }
-    bool operator!=(OrderID rhs) const { return not (*this == rhs); }
-    bool operator< (OrderID rhs) const { return value_ < rhs.value_; }
-    bool operator> (OrderID rhs) const { return rhs < *this; }
-    bool operator<=(OrderID rhs) const { return not (*this > rhs); }
-    bool operator>=(OrderID rhs) const { return not (*this < rhs); }
+    bool operator==(OrderID const & rhs) const { return value_ == rhs.value_; }
+    bool operator!=(OrderID const & rhs) const { return not (*this == rhs); }
+    bool operator< (OrderID const & rhs) const { return value_ < rhs.value_; }
+    bool operator> (OrderID const & rhs) const { return rhs < *this; }
+    bool operator<=(OrderID const & rhs) const { return not (*this > rhs); }
+    bool operator>=(OrderID const & rhs) const { return not (*this < rhs); }
 
 private:
     value_type value_ = {};
@@ -369,12 +635,78 @@ struct hash<OrderID>
  * 2. Message Types - Message structures with normalized types to handle each operation.
  */
 
+// Skip blanks on the current line and return true if no fields are left on it.
+// Allows messages to end with optional fields since the stream otherwise reads across lines.
+bool is_end_of_line(std::istream & is)
+{
+    while (is.peek() == ' ' or is.peek() == '\t' or is.peek() == '\r')
+    {
+        is.get();
+    }
+    return is.peek() == '\n' or is.peek() == std::char_traits<char>::eof();
+}
+
+// Read the optional fields at the end of an order as keyword and value pairs:
+// MIN min_qty - Kill the order if less than min_qty can trade immediately.
+// DISPLAY display_qty - Iceberg order that only shows display_qty at a time in the book, holding the rest in reserve.
+// OWNER owner - Owner (session) tag of the order, so all its orders can be cancelled at once with CANCEL_ALL.
+// An unknown keyword invalidates the order and skips the rest of the line.
+template <typename AddOrder_T>
+std::istream & read_optional_fields(std::istream & is, AddOrder_T & msg)
+{
+    thread_local static std::string keyword{8, '\0'};
+    while (is and not is_end_of_line(is))
+    {
+        is >> keyword;
+        if (keyword == "MIN")
+        {
+            is >> msg.min_qty;
+        }
+        else if (keyword == "DISPLAY")
+        {
+            is >> msg.display_qty;
+        }
+        else if (keyword == "OWNER")
+        {
+            is >> msg.owner;
+        }
+        else
+        {
+            msg.tif = TIF::Invalid;
+            is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            break;
+        }
+    }
+    return is;
+}
+
+template <typename AddOrder_T>
+std::ostream & write_optional_fields(std::ostream & os, AddOrder_T const & msg)
+{
+    if (not msg.min_qty.is_zero())
+    {
+        os << " MIN " << msg.min_qty;
+    }
+    if (not msg.display_qty.is_zero())
+    {
+        os << " DISPLAY " << msg.display_qty;
+    }
+    if (not msg.owner.empty())
+    {
+        os << " OWNER " << msg.owner;
+    }
+    return os;
+}
+
 struct BuyOrder
 {
     TIF tif;
     Price price;
     Qty qty;
     OrderID order_id;
+    Qty min_qty; // Optional
+    Qty display_qty; // Optional
+    OrderID owner; // Optional
 
     bool is_invalid() const
     {
@@ -382,6 +714,8 @@ struct BuyOrder
             or price.is_zero()
             or qty.is_zero()
             or order_id.empty()
+            or min_qty > qty
+            or display_qty > qty
             ;
     }
     bool is_valid() const { return not is_invalid(); }
@@ -389,21 +723,23 @@ struct BuyOrder
 
 std::ostream & operator<<(std::ostream & os, BuyOrder const & msg)
 {
-    return os << "BUY "
+    os << "BUY "
         << msg.tif
         << ' ' << msg.price
         << ' ' << msg.qty
         << ' ' << msg.order_id
         ;
+    return write_optional_fields(os, msg);
 }
 
 std::istream & operator>>(std::istream & is, BuyOrder & msg)
 {
-    return is >> msg.tif
+    is >> msg.tif
         >> msg.price
         >> msg.qty
         >> msg.order_id
         ;
+    return read_optional_fields(is, msg);
 }
 
 
@@ -413,6 +749,9 @@ struct SellOrder
     Price price;
     Qty qty;
     OrderID order_id;
+    Qty min_qty; // Optional
+    Qty display_qty; // Optional
+    OrderID owner; // Optional
 
     bool is_invalid() const
     {
@@ -420,6 +759,8 @@ struct SellOrder
             or price.is_zero()
             or qty.is_zero()
             or order_id.empty()
+            or min_qty > qty
+            or display_qty > qty
             ;
     }
     bool is_valid() const { return not is_invalid(); }
@@ -427,1209 +768,6492 @@ struct SellOrder
 
 std::ostream & operator<<(std::ostream & os, SellOrder const & msg)
 {
-    return os << "SELL "
+    os << "SELL "
         << msg.tif
         << ' ' << msg.price
         << ' ' << msg.qty
         << ' ' << msg.order_id
         ;
+    return write_optional_fields(os, msg);
 }
 
 std::istream & operator>>(std::istream & is, SellOrder & msg)
 {
-    return is >> msg.tif
+    is >> msg.tif
         >> msg.price
         >> msg.qty
         >> msg.order_id
         ;
+    return read_optional_fields(is, msg);
 }
 
 
-struct CancelOrder
+// Market order that trades immediately with the best opposite orders and never rests in the book.
+// The optional band in ticks protects it from trading too far from the best price (unprotected if zero).
+struct MarketOrder
 {
+    Side side;
+    Qty qty;
     OrderID order_id;
+    std::uint64_t band_ticks; // Optional
 
     bool is_invalid() const
     {
-        return order_id.empty();
+        return side == Side::Invalid
+            or qty.is_zero()
+            or order_id.empty()
+            ;
     }
     bool is_valid() const { return not is_invalid(); }
 };
 
-std::ostream & operator<<(std::ostream & os, CancelOrder const & msg)
+std::ostream & operator<<(std::ostream & os, MarketOrder const & msg)
 {
-    return os << "CANCEL "
-        << msg.order_id
+    os << "MARKET "
+        << msg.side
+        << ' ' << msg.qty
+        << ' ' << msg.order_id
         ;
+    if (msg.band_ticks != 0)
+    {
+        os << ' ' << msg.band_ticks;
+    }
+    return os;
 }
 
-std::istream & operator>>(std::istream & is, CancelOrder & msg)
+std::istream & operator>>(std::istream & is, MarketOrder & msg)
 {
-    return is >> msg.order_id;
+    is >> msg.side
+        >> msg.qty
+        >> msg.order_id
+        ;
+    if (not is_end_of_line(is))
+    {
+        read_unsigned(is, msg.band_ticks);
+    }
+    return is;
 }
 
 
-struct ModifyOrder
+// Stop order that rests in the trigger book until the last trade price reaches its stop price.
+// It then becomes a market order or, if the optional limit price is set, a GFD limit order (stop-limit order).
+struct StopOrder
 {
-    OrderID order_id;
     Side side;
-    Price price;
+    Price stop_price;
     Qty qty;
+    OrderID order_id;
+    Price limit_price; // Optional
 
     bool is_invalid() const
     {
-        return order_id.empty()
-            or side == Side::Invalid
-            or price.is_zero()
+        return side == Side::Invalid
+            or stop_price.is_zero()
             or qty.is_zero()
+            or order_id.empty()
             ;
     }
     bool is_valid() const { return not is_invalid(); }
 };
 
-std::ostream & operator<<(std::ostream & os, ModifyOrder const & msg)
+std::ostream & operator<<(std::ostream & os, StopOrder const & msg)
 {
-    return os << "MODIFY "
-        << msg.order_id
-        << ' ' << msg.side
-        << ' ' << msg.price
+    os << "STOP "
+        << msg.side
+        << ' ' << msg.stop_price
         << ' ' << msg.qty
+        << ' ' << msg.order_id
         ;
+    if (not msg.limit_price.is_zero())
+    {
+        os << ' ' << msg.limit_price;
+    }
+    return os;
 }
 
-std::istream & operator>>(std::istream & is, ModifyOrder & msg)
+std::istream & operator>>(std::istream & is, StopOrder & msg)
 {
-    return is >> msg.order_id
-        >> msg.side
-        >> msg.price
+    is >> msg.side
+        >> msg.stop_price
         >> msg.qty
+        >> msg.order_id
         ;
+    if (not is_end_of_line(is))
+    {
+        is >> msg.limit_price;
+    }
+    return is;
 }
 
 
-struct PrintBook
+struct CancelOrder
 {
-    bool is_invalid() const { return false; }
+    OrderID order_id;
+
+    bool is_invalid() const
+    {
+        return order_id.empty();
+    }
     bool is_valid() const { return not is_invalid(); }
 };
 
-std::ostream & operator<<(std::ostream & os, PrintBook const &)
+std::ostream & operator<<(std::ostream & os, CancelOrder const & msg)
 {
-    return os << "PRINT";
+    return os << "CANCEL "
+        << msg.order_id
+        ;
 }
 
-std::istream & operator>>(std::istream & is, PrintBook & msg)
+std::istream & operator>>(std::istream & is, CancelOrder & msg)
 {
-    return is;
+    return is >> msg.order_id;
 }
 
 
-// Clear all orders from book. Not required, but useful to have.
-struct ClearBook
+// Two-sided quote from a market maker that replaces both legs at once.
+// The legs rest as GFD orders with the quote ID plus ".B" or ".S" as their order IDs, and a leg with zero qty is pulled.
+// Orders other than quotes may not use order IDs of that form, so they never collide with a quote leg.
+struct Quote
 {
-    bool is_invalid() const { return false; }
+    OrderID quote_id;
+    Price bid_price;
+    Qty bid_qty;
+    Price ask_price;
+    Qty ask_qty;
+
+    bool is_invalid() const
+    {
+        return quote_id.empty()
+            or (not bid_qty.is_zero() and bid_price.is_zero())
+            or (not ask_qty.is_zero() and ask_price.is_zero())
+            or (not bid_qty.is_zero() and not ask_qty.is_zero() and bid_price >= ask_price)
+            ;
+    }
     bool is_valid() const { return not is_invalid(); }
 };
 
-std::ostream & operator<<(std::ostream & os, ClearBook const &)
+std::ostream & operator<<(std::ostream & os, Quote const & msg)
 {
-    return os << "CLEAR";
+    return os << "QUOTE "
+        << msg.quote_id
+        << ' ' << msg.bid_price
+        << ' ' << msg.bid_qty
+        << ' ' << msg.ask_price
+        << ' ' << msg.ask_qty
+        ;
 }
 
-std::istream & operator>>(std::istream & is, ClearBook & msg)
+std::istream & operator>>(std::istream & is, Quote & msg)
 {
-    return is;
+    return is >> msg.quote_id
+        >> msg.bid_price
+        >> msg.bid_qty
+        >> msg.ask_price
+        >> msg.ask_qty
+        ;
 }
 
 
-/*
- * 3. Order Book - Order book made up of separate sets of buy and sell levels ordered by price where each level has a queue of orders.
- */
+// Batch of quotes from one market maker, such as requoting many options series at once, applied in one engine call:
+// MASS_QUOTE count followed by count entries of quote_id bid_price bid_qty ask_price ask_qty (on any number of lines).
+// The fields are stored by column, so all entries are validated together in one branch-free pass
+// that the compiler can vectorize (such as with -O3 and SSE4.2 or later for the 64-bit compares),
+// and an invalid entry is skipped without rejecting the others.
+struct MassQuote
+{
+    static constexpr std::size_t max_entries = 4096;
 
-// Forward decl
-class Level;
-class Book;
+    std::vector<OrderID> quote_ids;
+    std::vector<Price> bid_prices;
+    std::vector<Qty> bid_qtys;
+    std::vector<Price> ask_prices;
+    std::vector<Qty> ask_qtys;
 
-class Order
-{
-public:
-    Order(OrderID order_id, Qty qty)
-        : order_id_{std::move(order_id)}
-        , qty_{qty}
+    std::size_t size() const noexcept { return quote_ids.size(); }
+
+    bool is_invalid() const
     {
+        return quote_ids.empty();
     }
+    bool is_valid() const { return not is_invalid(); }
 
-    OrderID const & order_id() const noexcept { return order_id_; }
-
-    Qty qty() const noexcept { return qty_; }
-    Order & qty(Qty q) { qty_ = q; return *this; }
-
-    // Comparison ops
-    bool operator==(Order const & rhs) const { return order_id_ == rhs.order_id_; }
-    bool operator!=(Order const & rhs) const { return not (*this == rhs); }
+    // Set valid[i] to 1 if entry i is a valid quote (see Quote::is_invalid) or 0 if not.
+    void validate(std::vector<std::uint8_t> & valid) const
+    {
+        auto const count = size();
+        valid.resize(count);
+        auto const is_valid = valid.data();
+        for (std::size_t index = 0; index != count; ++index)
+        {
+            is_valid[index] = not quote_ids[index].empty();
+        }
 
-private:
-    OrderID order_id_;
-    Qty qty_;
+        // Use non-short-circuit operators on plain values, so the loop has no branches.
+        auto const bid_price = bid_prices.data();
+        auto const bid_qty = bid_qtys.data();
+        auto const ask_price = ask_prices.data();
+        auto const ask_qty = ask_qtys.data();
+        for (std::size_t index = 0; index != count; ++index)
+        {
+            bool const has_bid = bid_qty[index].value() != 0;
+            bool const has_ask = ask_qty[index].value() != 0;
+            bool const is_bid_priced = bid_price[index].value() != 0;
+            bool const is_ask_priced = ask_price[index].value() != 0;
+            bool const is_uncrossed = bid_price[index].value() < ask_price[index].value();
+            is_valid[index] &= static_cast<std::uint8_t>((not has_bid | is_bid_priced) & (not has_ask | is_ask_priced)
+                & (not (has_bid & has_ask) | is_uncrossed));
+        }
+    }
+};
 
-    // Level in which this order resides and iterator pointing to this order.
-    // Level and Book use these to quickly access this order instead of searching for it (O(1) instead of O(n)).
-    friend Level;
-    friend Book;
-    using Queue = std::list<Order>;
-    Level * level_ = nullptr;
-    Queue::iterator iterator_;
-};
-
-std::ostream & operator<<(std::ostream & os, Order const & order)
+std::ostream & operator<<(std::ostream & os, MassQuote const & msg)
 {
-    return os << order.order_id()
-        << ':' << order.qty()
+    os << "MASS_QUOTE "
+        << msg.size()
         ;
+    for (std::size_t index = 0; index != msg.size(); ++index)
+    {
+        os << ' ' << msg.quote_ids[index]
+            << ' ' << msg.bid_prices[index]
+            << ' ' << msg.bid_qtys[index]
+            << ' ' << msg.ask_prices[index]
+            << ' ' << msg.ask_qtys[index]
+            ;
+    }
+    return os;
 }
 
-
-class Level
+// Fails the stream to reject the whole batch if any entry is malformed, after skipping the rest of its fields,
+// so no field is handled as a command.
+std::istream & operator>>(std::istream & is, MassQuote & msg)
 {
-public:
-    explicit Level(Price price = Price{})
-        : price_{price}
+    std::size_t count = 0;
+    is >> count;
+    if (count > MassQuote::max_entries)
+    {
+        // Where the entries end is unknown, so only the rest of the line is skipped with the failed message.
+        is.setstate(std::ios_base::failbit);
+    }
+    if (not is)
     {
+        return is;
     }
 
-    Qty qty() const noexcept { return qty_; }
-    Price price() const { return price_; }
-    Order::Queue const & orders() const { return orders_; }
+    msg.quote_ids.resize(count);
+    msg.bid_prices.resize(count);
+    msg.bid_qtys.resize(count);
+    msg.ask_prices.resize(count);
+    msg.ask_qtys.resize(count);
+    std::size_t fields = 0; // Fields of the entries read so far.
+    auto read = [&is, &fields](auto & field)
+    {
+        if (is >> field)
+        {
+            ++fields;
+        }
+    };
+    for (std::size_t index = 0; index != count; ++index)
+    {
+        read(msg.quote_ids[index]);
+        read(msg.bid_prices[index]);
+        read(msg.bid_qtys[index]);
+        read(msg.ask_prices[index]);
+        read(msg.ask_qtys[index]);
+    }
+    if (not is)
+    {
+        msg.quote_ids.clear();
+        is.clear();
+        std::string field{};
+        while (fields != count * 5 and is >> field)
+        {
+            ++fields;
+        }
+        is.setstate(std::ios_base::failbit);
+    }
+    return is;
+}
 
-    bool empty() const noexcept { return orders_.empty(); }
-    std::size_t size() const noexcept { return orders_.size(); }
 
-    Order::Queue::iterator add(OrderID order_id, Qty qty)
+// Cancel all orders of an owner, optionally only those on one side and within a price range.
+// Book orders only, since stop orders have no owner.
+struct CancelAll
+{
+    OrderID owner;
+    Side side; // Optional, any side if not has_side
+    bool has_side;
+    Price min_price; // Optional
+    Price max_price; // Optional, no price range if zero
+
+    bool is_invalid() const
     {
-        // Append order to end of level and save this iterator to the order.
-        orders_.emplace_back(std::move(order_id), qty);
-        auto iter = --orders_.end();
-        iter->level_ = this;
-        iter->iterator_ = iter;
-        qty_ += qty;
-        return iter;
+        return owner.empty()
+            or (has_side and side == Side::Invalid)
+            or min_price > max_price
+            ;
     }
+    bool is_valid() const { return not is_invalid(); }
 
-    void cancel(Order & order)
+    // True if an order on side at price is to be cancelled.
+    bool matches(Side order_side, Price price) const
     {
-        // Erase order from this level using its saved iterator.
-        assert(order.level_ == this);
-        assert(&(*order.iterator_) == &order); // Must be the same order instance.
-        qty_ -= order.qty();
-        orders_.erase(order.iterator_);
+        return (not has_side or order_side == side)
+            and (max_price.is_zero() or (min_price <= price and price <= max_price));
     }
+};
 
-    // Modify order. The order loses its queue position by being pushed to the end.
-    void modify(Order & order, Qty qty)
+std::ostream & operator<<(std::ostream & os, CancelAll const & msg)
+{
+    os << "CANCEL_ALL "
+        << msg.owner
+        ;
+    if (msg.has_side)
+    {
+        os << ' ' << msg.side;
+    }
+    if (not msg.max_price.is_zero())
     {
-        modify_qty(order, qty);
+        os << ' ' << msg.min_price << ' ' << msg.max_price;
+    }
+    return os;
+}
 
-        // Transfer order to the back of the queue.
-        // Note: No elements are copied or moved, only the internal pointers of the list nodes are re-pointed, and
-        // no iterators become invalidated.
-        orders_.splice(orders_.end(), orders_, order.iterator_);
+std::istream & operator>>(std::istream & is, CancelAll & msg)
+{
+    is >> msg.owner;
 
-        auto iter = --orders_.end();
-        iter->iterator_ = iter;
+    // The side is optional before the price range, which starts with a digit.
+    if (not is_end_of_line(is) and not std::isdigit(is.peek()))
+    {
+        is >> msg.side;
+        msg.has_side = true;
     }
-
-    // Modify order qty. The order keeps its position in the queue.
-    void modify_qty(Order & order, Qty qty)
+    if (not is_end_of_line(is))
     {
-        // Modify level qty and assign new order qty.
-        assert(not qty.is_zero());
-        assert(order.level_ == this);
-        assert(&(*order.iterator_) == &order); // Must be the same order instance.
-        qty_ -= order.qty();
-        qty_ += qty;
-        order.qty(qty);
+        is >> msg.min_price;
     }
-
-    // Write all orders in this level.
-    void write_orders(std::ostream & os) const
+    if (not is_end_of_line(is))
     {
-        os << size() << ':' << qty() << " @ " << price() << ":[";
-        for (auto && order : orders())
-        {
-            os << order << ' ';
-        }
-        os << ']';
+        is >> msg.max_price;
     }
+    return is;
+}
 
-private:
-    Qty qty_ = Qty{};
-    Price price_ = Price{};
-    Order::Queue orders_ = {};
 
-    // Level set in which this level resides and iterator pointing to this level.
-    // Book uses these to quickly access this instead of searching for it (O(1) instead of O(log n)).
-    friend Book;
-    struct CompareLevel
+struct ModifyOrder
+{
+    OrderID order_id;
+    Side side;
+    Price price;
+    Qty qty;
+
+    bool is_invalid() const
     {
-        // Functor to compare between Level and Price types.
-        // Note: this is made an inner class because we need this definition for the Set type and members.
-        // Comparison is lhs > rhs for decreasing order.
+        return order_id.empty()
+            or side == Side::Invalid
+            or price.is_zero()
+            or qty.is_zero()
+            ;
+    }
+    bool is_valid() const { return not is_invalid(); }
+};
 
-        // Allow calling set functions without constructing an instance of key (heterogeneous lookup).
-        using is_transparent = void;
+std::ostream & operator<<(std::ostream & os, ModifyOrder const & msg)
+{
+    return os << "MODIFY "
+        << msg.order_id
+        << ' ' << msg.side
+        << ' ' << msg.price
+        << ' ' << msg.qty
+        ;
+}
 
-        bool operator()(Level const & lhs, Level const & rhs) const
-        {
-            return lhs.price() > rhs.price();
-        }
-        bool operator()(Price lhs, Level const & rhs) const
-        {
-            return lhs > rhs.price();
-        }
-        bool operator()(Level const & lhs, Price rhs) const
-        {
-            return lhs.price() > rhs;
-        }
-    };
-    using Set = std::set<Level, Level::CompareLevel>;
-    Set * levels_ = nullptr;
-    Set::iterator iterator_;
+std::istream & operator>>(std::istream & is, ModifyOrder & msg)
+{
+    return is >> msg.order_id
+        >> msg.side
+        >> msg.price
+        >> msg.qty
+        ;
+}
+
+
+struct PrintBook
+{
+    bool is_invalid() const { return false; }
+    bool is_valid() const { return not is_invalid(); }
 };
 
-std::ostream & operator<<(std::ostream & os, Level const & level)
+std::ostream & operator<<(std::ostream & os, PrintBook const &)
 {
-    return os << level.price() << ' ' << level.qty();
+    return os << "PRINT";
 }
 
+std::istream & operator>>(std::istream & is, PrintBook & msg)
+{
+    return is;
+}
 
-// Trade event from matching a passive order in the book with an incoming aggressive order.
-struct Trade
+
+// Clear all orders from book. Not required, but useful to have.
+struct ClearBook
 {
-    Price passive_price;
-    Order passive_order;
-    Price aggressive_price;
-    Order aggressive_order;
+    bool is_invalid() const { return false; }
+    bool is_valid() const { return not is_invalid(); }
 };
 
-std::ostream & operator<<(std::ostream & os, Trade const & trade)
+std::ostream & operator<<(std::ostream & os, ClearBook const &)
 {
-    return os << "TRADE "
-        << trade.passive_order.order_id()
-        << ' ' << trade.passive_price
-        << ' ' << trade.passive_order.qty()
-        << ' ' << trade.aggressive_order.order_id()
-        << ' ' << trade.aggressive_price
-        << ' ' << trade.aggressive_order.qty()
-        ;
+    return os << "CLEAR";
 }
 
-using Trades = std::vector<Trade>;
-
-std::ostream & operator<<(std::ostream & os, Trades const & trades)
+std::istream & operator>>(std::istream & is, ClearBook & msg)
 {
-    for (auto && trade : trades)
-    {
-        os << trade << std::endl;
-    }
-    return os;
+    return is;
 }
 
 
-class Book
+// Expire all GFD orders at the end of the day, reporting each expired order before clearing the book.
+struct ExpireOrders
 {
-public:
-    Level::Set const & buy_levels() const { return buy_levels_; }
-    Level::Set const & sell_levels() const { return sell_levels_; }
+    bool is_invalid() const { return false; }
+    bool is_valid() const { return not is_invalid(); }
+};
 
-    void add(Side side, OrderID const & order_id, Qty qty, Price price)
-    {
-        switch (side)
-        {
-            case Side::Buy:
-            {
-                add(order_id, qty, price, buy_levels_);
-                break;
-            }
+std::ostream & operator<<(std::ostream & os, ExpireOrders const &)
+{
+    return os << "EXPIRE";
+}
 
-            case Side::Sell:
-            {
-                add(order_id, qty, price, sell_levels_);
-                break;
-            }
+std::istream & operator>>(std::istream & is, ExpireOrders & msg)
+{
+    return is;
+}
 
-            case Side::Invalid:
-            {
-                break;
-            }
-        }
-    }
 
-    void cancel(OrderID const & order_id)
-    {
-        auto iter = orders_by_id_.find(order_id);
-        if (iter == orders_by_id_.end())
-        {
-            // Should not happen since implies erasing an order never added.
-            IF_DEBUG(
-                std::cerr << "Unable to cancel unknown order: " << order_id << std::endl;
-                //assert(false);
-            )
-            return; // Ignoring for now.
-        }
+// Start an auction call phase, in which orders rest in the book without matching until the book is uncrossed.
+struct StartAuction
+{
+    bool is_invalid() const { return false; }
+    bool is_valid() const { return not is_invalid(); }
+};
 
-        // Get order and level it's contained within.
-        // Erase order from the level.
-        // Erase the level if empty.
-        auto && order_iter = iter->second;
-        auto && order = *order_iter;
-        assert(order.level_);
-        auto && level = *order.level_;
-        level.cancel(order);
-        if (level.empty())
-        {
-            // Erase empty level using its internally held container and iter.
-            assert(level.levels_);
-            auto && levels = *level.levels_;
-            levels.erase(level.iterator_);
-        }
-        orders_by_id_.erase(iter);
-    }
+std::ostream & operator<<(std::ostream & os, StartAuction const &)
+{
+    return os << "AUCTION";
+}
 
-    void modify(Side side, OrderID const & order_id, Qty qty, Price price)
-    {
-        switch (side)
-        {
-            case Side::Buy:
-            {
-                modify(order_id, qty, price, buy_levels_);
-                break;
-            }
+std::istream & operator>>(std::istream & is, StartAuction & msg)
+{
+    return is;
+}
 
-            case Side::Sell:
-            {
-                modify(order_id, qty, price, sell_levels_);
-                break;
-            }
 
-            case Side::Invalid:
-            {
-                break;
-            }
-        }
-    }
+// Uncross the book at its equilibrium price and return to continuous matching.
+// The optional reference price breaks ties between equilibrium prices (the last trade price is used if not set).
+struct UncrossBook
+{
+    Price reference_price;
 
-    void clear()
+    bool is_invalid() const { return false; }
+    bool is_valid() const { return not is_invalid(); }
+};
+
+std::ostream & operator<<(std::ostream & os, UncrossBook const & msg)
+{
+    os << "UNCROSS";
+    if (not msg.reference_price.is_zero())
     {
-        buy_levels_.clear();
-        sell_levels_.clear();
-        orders_by_id_.clear();
+        os << ' ' << msg.reference_price;
     }
+    return os;
+}
 
-    // Match order with orders in this book.
-    // The matched passive orders are removed from the book, paired with the aggressive order, and saved in the output list of trades.
-    // Returns leaves_qty, the remaining quantity left after all matching (leaves_qty >= 0).
-    Qty match(Side side, OrderID const & order_id, Qty qty, Price price, Trades & trades)
+std::istream & operator>>(std::istream & is, UncrossBook & msg)
+{
+    if (not is_end_of_line(is))
     {
-        Qty leaves_qty = qty;
-        switch (side)
-        {
-            case Side::Buy:
-            {
-                // Match buy with sells.
-                // Sells are in decreasing order (highest price first), so iterate in reverse to start with lowest price.
-                leaves_qty = match(side, order_id, qty, price, sell_levels_.crbegin(), sell_levels_.crend(), trades,
-                    [](Price order_price, Price level_price) -> bool
-                    {
-                        return order_price >= level_price;
-                    });
-                break;
-            }
+        is >> msg.reference_price;
+    }
+    return is;
+}
 
-            case Side::Sell:
-            {
-                // Match sell with buys.
-                leaves_qty = match(side, order_id, qty, price, buy_levels_.cbegin(), buy_levels_.cend(), trades,
-                    [](Price order_price, Price level_price) -> bool
-                    {
-                        return order_price <= level_price;
-                    });
-                break;
-            }
 
-            case Side::Invalid:
-            {
-                break;
-            }
-        }
+// Print statistics of the matching engine.
+struct PrintStats
+{
+    bool is_invalid() const { return false; }
+    bool is_valid() const { return not is_invalid(); }
+};
 
-        fill_orders(trades);
-        return leaves_qty;
-    }
+std::ostream & operator<<(std::ostream & os, PrintStats const &)
+{
+    return os << "STATS";
+}
 
-    // Write all orders in the book.
-    void write_orders(std::ostream & os) const
-    {
-        os << "SELL:\n";
-        for (auto && level : sell_levels_)
-        {
-            level.write_orders(os);
-            os << '\n';
-        }
+std::istream & operator>>(std::istream & is, PrintStats & msg)
+{
+    return is;
+}
 
-        os << "BUY:\n";
-        for (auto && level : buy_levels_)
-        {
-            level.write_orders(os);
-            os << '\n';
-        }
 
-        os << std::endl;
-    }
+// Dump trace events to a file.
+struct DumpTrace
+{
+    std::string file_name;
 
-protected:
-    void add(OrderID const & order_id, Qty qty, Price price, Level::Set & levels)
-    {
-        if (orders_by_id_.count(order_id))
-        {
-            IF_DEBUG(
-                std::cerr << "Unable to add duplicate order: " << order_id << std::endl;
-                //assert(false);
-            )
-            return;
-        }
+    bool is_invalid() const { return file_name.empty(); }
+    bool is_valid() const { return not is_invalid(); }
+};
 
-        // Search for level with given price, inserting it if it does not exist using hint.
-        auto level_iter = levels.lower_bound(price);
-        if (level_iter == levels.end() or level_iter->price() != price)
-        {
-            level_iter = levels.emplace_hint(
-                  level_iter
-                , price
-                );
+std::ostream & operator<<(std::ostream & os, DumpTrace const & msg)
+{
+    return os << "TRACE "
+        << msg.file_name
+        ;
+}
 
-            // Note: const_cast required because std::set iter is const since could otherwise modify comparison order
-            // externally from the set. We do not modify the level price, so it is safe.
-            // Level saves its container and iterator to allow erasing using only the order ID.
-            Level & level = const_cast<Level &>(*level_iter);
-            level.levels_ = &levels;
-            level.iterator_ = level_iter;
-        }
+std::istream & operator>>(std::istream & is, DumpTrace & msg)
+{
+    return is >> msg.file_name;
+}
+
+
+/*
+ * 3. Instrumentation - Timing, latency histograms, and counters that are cheap enough to always leave enabled,
+ * and tracing of hot-path events that is enabled at compile time.
+ */
+
+// Nanoseconds since an arbitrary epoch from the monotonic clock, which is shared by all processes on the same host.
+std::uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time stamp counter (TSC), which is much cheaper to read than a clock, so used to time the hot path.
+// Falls back to nanoseconds on platforms without a TSC.
+inline std::uint64_t rdtsc()
+{
+#if defined(__x86_64__) or defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
 
-        // Add order to the level and map.
-        Level & level = const_cast<Level &>(*level_iter);
-        auto order_iter = level.add(order_id, qty);
-        orders_by_id_.emplace(order_id, order_iter);
+// Converts TSC ticks to nanoseconds using the ticks and nanoseconds that elapsed since construction,
+// which avoids a calibration delay at startup.
+class TscClock
+{
+public:
+    TscClock()
+        : start_tsc_{rdtsc()}
+        , start_ns_{now_ns()}
+    {
     }
 
-    void modify(OrderID const & order_id, Qty qty, Price price, Level::Set & levels)
+    double ns_per_tick() const
     {
-        auto iter = orders_by_id_.find(order_id);
-        if (iter == orders_by_id_.end())
-        {
-            // Should not happen since implies modifying an order never added.
-            IF_DEBUG(
-                std::cerr << "Unable to modify unknown order: " << order_id << std::endl;
-                //assert(false);
-            )
-            return; // Ignoring for now.
-        }
+        auto const ticks = rdtsc() - start_tsc_;
+        auto const ns = now_ns() - start_ns_;
+        return ticks == 0 ? 1.0 : static_cast<double>(ns) / static_cast<double>(ticks);
+    }
 
-        // Get order and level it's contained within.
-        // Note: A Level holds a pointer to the container it is within, so if level.levels_ != &levels,
-        // then the side was modified (e.g., &buy_levels_ != &sell_levels_).
-        auto && order_iter = iter->second;
-        auto && order = *order_iter;
-        assert(order.level_);
-        auto && level = *order.level_;
-        assert(level.levels_);
-        if (level.levels_ == &levels and level.price() == price)
-        {
-            if (qty == order.qty())
-            {
-                return; // No change.
-            }
+private:
+    std::uint64_t start_tsc_;
+    std::uint64_t start_ns_;
+};
 
-            // Modify qty such that order loses queue position.
-            // Should order lose position if new qty is less than original qty?
-            level.modify(order, qty);
-        }
-        else // New side or price
-        {
-//#define USE_CANCEL_ADD_FOR_MODIFY
-#ifdef USE_CANCEL_ADD_FOR_MODIFY
-            // If modifying the side or price, we effectively have a new order,
-            // so cancel old order and add new order.
-            cancel(order_id);
-            add(order_id, qty, price, levels);
-#else
-            // Transfer order to new price level using list::splice() since it does not invalidate iterators.
-            // This should be more efficient than cancel-add since the node is not reallocated.
-            auto new_levels = level.levels_;
-            if (level.levels_ != &levels)
-            {
-                new_levels = &levels;
-            }
 
-            // Search for level with given price, inserting it if it does not exist using hint.
-            auto level_iter = new_levels->lower_bound(price);
-            if (level_iter == new_levels->end() or level_iter->price() != price)
-            {
-                level_iter = new_levels->emplace_hint(
-                      level_iter
-                    , price
-                    );
-            }
+// Histogram with logarithmic buckets (similar to HdrHistogram) to record latencies in constant time and space.
+// Each power of 2 is divided into sub-buckets, so values are recorded with a relative error of at most 1 / sub_bucket_count.
+// Values less than 2 * sub_bucket_count are recorded exactly.
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned sub_bucket_bits = 4;
+    static constexpr std::size_t sub_bucket_count = 1 << sub_bucket_bits;
+    static constexpr std::size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count;
 
-            // Transfer order to end of new level, updating order and level internals.
-            Level & new_level = const_cast<Level &>(*level_iter);
-            new_level.levels_ = new_levels;
-            new_level.iterator_ = level_iter;
-            auto & new_orders = new_level.orders_;
-            new_orders.splice(new_orders.end(), level.orders_, order_iter);
-            order.level_ = &new_level;
-            //order.iterator_ = --new_orders.end(); // Not required since not invalidated by splice.
-            new_level.qty_ += qty;
+    void record(std::uint64_t value) noexcept
+    {
+        ++counts_[index(value)];
+        ++count_;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
 
-            // Update old level, removing it if empty. Finally, set new order qty.
-            if (level.empty())
-            {
-                level.levels_->erase(level.iterator_);
-            }
-            else
+    std::uint64_t count() const noexcept { return count_; }
+    std::uint64_t max() const noexcept { return max_; }
+    double mean() const noexcept { return count_ == 0 ? 0.0 : static_cast<double>(sum_) / static_cast<double>(count_); }
+
+    // Value at the given percentile in [0, 100], which is the highest value equivalent to the bucket's values.
+    std::uint64_t percentile(double percentile) const noexcept
+    {
+        auto const rank = static_cast<std::uint64_t>(percentile / 100.0 * static_cast<double>(count_) + 0.5);
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i != bucket_count; ++i)
+        {
+            total += counts_[i];
+            if (total >= rank and total != 0)
             {
-                level.qty_ -= order.qty();
+                return std::min(lowest_value(i + 1) - 1, max_);
             }
-            order.qty_ = qty;
-#endif // USE_CANCEL_ADD_FOR_MODIFY
         }
+        return max_;
     }
 
-    // Match order with orders in this level set.
-    // The book itself is not modified, only the list of trades is generated.
-    // The comparison function returns true if the order price matches the level price.
-    template <typename Iterator, typename MatchPredicate>
-    Qty match(
-          Side side
-        , OrderID const & order_id
-        , Qty qty
-        , Price price
-        , Iterator levels_begin
-        , Iterator levels_end
-        , Trades & trades
-        , MatchPredicate const & match_predicate
-        )
+    static std::size_t index(std::uint64_t value) noexcept
     {
-        Qty leaves_qty = qty;
-        for (Iterator iter = levels_begin; iter != levels_end; ++iter)
+        if (value < sub_bucket_count)
         {
-            auto && level = *iter;
-            if (not match_predicate(price, level.price()))
-            {
-                break;
-            }
+            return value;
+        }
+        unsigned const msb = 63 - __builtin_clzll(value);
+        unsigned const shift = msb - sub_bucket_bits;
+        return (shift + 1) * sub_bucket_count + ((value >> shift) & (sub_bucket_count - 1));
+    }
 
-            for (auto && order : level.orders())
-            {
-                // Prevent self-match.
-                // For example, if an order's side is modified, we do not want to match with itself
-                // if the pre-modified order is still in the book.
-                if (order_id == order.order_id())
-                {
-                    continue;
-                }
+    static std::uint64_t lowest_value(std::size_t index) noexcept
+    {
+        if (index < sub_bucket_count)
+        {
+            return index;
+        }
+        std::size_t const shift = index / sub_bucket_count - 1;
+        if (shift > 64 - sub_bucket_bits - 1)
+        {
+            return std::numeric_limits<std::uint64_t>::max(); // Past the last bucket.
+        }
+        return (sub_bucket_count + index % sub_bucket_count) << shift;
+    }
 
-                Qty const matched_qty = std::min(leaves_qty, order.qty());
+private:
+    std::uint64_t counts_[bucket_count] = {};
+    std::uint64_t count_ = 0;
+    std::uint64_t sum_ = 0;
+    std::uint64_t max_ = 0;
+};
 
-                // Save both passive and aggressive orders that matched.
-                // Save a copy of the passive order so we can access its level.
-                trades.emplace_back(Trade{
-                      level.price()
-                    , order
-                    , price
-                    , Order{order_id, matched_qty}
-                    });
 
-                leaves_qty -= matched_qty;
-                if (leaves_qty.is_zero())
-                {
-                    return leaves_qty;
-                }
-            }
-        }
-        return leaves_qty;
+// Number of heap allocations and frees and bytes allocated.
+struct AllocCount
+{
+    std::uint64_t allocs = 0;
+    std::uint64_t frees = 0;
+    std::uint64_t bytes = 0;
+
+    AllocCount & operator-=(AllocCount const & rhs) noexcept
+    {
+        allocs -= rhs.allocs;
+        frees -= rhs.frees;
+        bytes -= rhs.bytes;
+        return *this;
+    }
+    friend AllocCount operator-(AllocCount lhs, AllocCount const & rhs) noexcept
+    {
+        lhs -= rhs;
+        return lhs;
     }
+};
 
-    // Cancel fully filled orders and modify qty of partially filled orders.
-    void fill_orders(Trades & trades)
+// Counts heap allocations by the global operator new and delete (replaced below when the COUNT_ALLOCS macro is defined,
+// otherwise counts stay zero) on each thread, so counting requires no synchronization.
+// Take the difference of two counts to get the allocations in between.
+class AllocCounter
+{
+public:
+    static AllocCount const & count() noexcept { return count_; }
+
+    static void alloc(std::size_t size) noexcept
     {
-        for (auto && trade : trades)
-        {
-            auto leaves_qty = trade.passive_order.qty() - trade.aggressive_order.qty();
-            if (leaves_qty.is_zero())
-            {
-                cancel(trade.passive_order.order_id());
-            }
-            else
-            {
-                // Note: pass *iterator_ as the order to modify the level since passive_order itself is only a copy,
-                // not the order actually in the level.
-                auto && level = trade.passive_order.level_;
-                auto && order = *trade.passive_order.iterator_;
-                level->modify_qty(order, leaves_qty);
+        ++count_.allocs;
+        count_.bytes += size;
+    }
 
-                // Require the passive order's qty to always be equal to the aggressive order's qty for output.
-                trade.passive_order.qty(trade.aggressive_order.qty());
-            }
-        }
+    static void free() noexcept
+    {
+        ++count_.frees;
     }
 
 private:
-    Level::Set buy_levels_;
-    Level::Set sell_levels_;
-
-    // Maps order ID directly to its location in a level.
-    using OrdersByID = std::unordered_map<OrderID, Order::Queue::iterator>;
-    OrdersByID orders_by_id_;
+    static thread_local AllocCount count_;
 };
 
-std::ostream & operator<<(std::ostream & os, Book const & book)
+thread_local AllocCount AllocCounter::count_{};
+
+#ifdef COUNT_ALLOCS
+void * operator new(std::size_t size)
 {
-    os << "SELL:\n";
-    for (auto && level : book.sell_levels())
+    AllocCounter::alloc(size);
+    if (void * ptr = std::malloc(size == 0 ? 1 : size))
     {
-        os << level << '\n';
+        return ptr;
     }
+    throw std::bad_alloc{};
+}
 
-    os << "BUY:\n";
-    for (auto && level : book.buy_levels())
+void * operator new(std::size_t size, std::nothrow_t const &) noexcept
+{
+    AllocCounter::alloc(size);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void * ptr) noexcept
+{
+    if (ptr)
     {
-        os << level << '\n';
+        AllocCounter::free();
+        std::free(ptr);
     }
+}
 
-    return os.flush();
+void operator delete(void * ptr, std::nothrow_t const &) noexcept
+{
+    ::operator delete(ptr);
 }
 
-using BookPtr = std::shared_ptr<Book>;
+void operator delete(void * ptr, std::size_t) noexcept
+{
+    ::operator delete(ptr);
+}
 
+void * operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
 
-/*
- * 4. Matching Engine - Matchine engine dispatches events to the order book and handles trade events.
- */
+void operator delete[](void * ptr) noexcept
+{
+    ::operator delete(ptr);
+}
 
-class MatchingEngine
+void operator delete[](void * ptr, std::size_t) noexcept
+{
+    ::operator delete(ptr);
+}
+#endif
+
+
+// Trace events recorded at probe points on the hot path when the TRACE macro is defined.
+// Each stage of handling a command has a begin and end event, so the decoder can pair them into durations.
+enum class TraceEvent : std::uint16_t
+{
+    DispatchBegin, // CommandProcessor_T looks up and calls the handler for a command (arg: command number).
+    DispatchEnd,
+    ParseBegin, // CommandProcessor_T reads a message from the input stream.
+    ParseEnd,
+    EngineBegin, // MatchingEngine handles a message (arg: EngineStats::Type).
+    EngineEnd,
+    MatchBegin, // Book matches an order with the opposite side (arg: qty, then number of trades).
+    MatchEnd,
+    FillBegin, // Book fills the matched passive orders (arg: number of trades).
+    FillEnd,
+    PublishBegin, // MatchingEngine publishes market data.
+    PublishEnd,
+    OutputBegin, // Command processor writes trades (arg: number of trades).
+    OutputEnd,
+    Count,
+};
+
+char const * stage_name(std::size_t stage)
+{
+    static char const * const names[] = {"DISPATCH", "PARSE", "ENGINE", "MATCH", "FILL", "PUBLISH", "OUTPUT"};
+    return stage < sizeof(names) / sizeof(names[0]) ? names[stage] : "UNKNOWN";
+}
+
+struct TraceRecord
+{
+    std::uint64_t tsc;
+    std::uint64_t arg;
+    TraceEvent event;
+    std::uint16_t thread;
+    std::uint32_t reserved;
+};
+
+// Ring buffer of the most recent trace records of one thread.
+// Only the owning thread writes to it, so recording is lock-free and cheap. The count is atomic so that another thread
+// can dump the buffer, though any records being overwritten during the dump may be torn.
+class TraceBuffer
 {
 public:
-    MatchingEngine(BookPtr book)
-        : book_{std::move(book)}
+    static constexpr std::size_t capacity = 1 << 16;
+
+    explicit TraceBuffer(std::uint16_t thread)
+        : records_(capacity)
+        , thread_{thread}
     {
-        trades_.reserve(1024);
     }
 
-    BookPtr const & book() { return book_; }
-    Trades const & trades() const { return trades_; }
+    void record(TraceEvent event, std::uint64_t arg) noexcept
+    {
+        auto const count = count_.load(std::memory_order_relaxed);
+        records_[count & (capacity - 1)] = TraceRecord{rdtsc(), arg, event, thread_, 0};
+        count_.store(count + 1, std::memory_order_release);
+    }
 
-    void handle(BuyOrder const & msg)
+    // Append the records still in the buffer in the order they were recorded.
+    void copy(std::vector<TraceRecord> & records) const
     {
-        handle_add(Side::Buy, msg);
+        auto const count = count_.load(std::memory_order_acquire);
+        for (auto i = count > capacity ? count - capacity : 0; i != count; ++i)
+        {
+            records.push_back(records_[i & (capacity - 1)]);
+        }
     }
 
-    void handle(SellOrder const & msg)
+private:
+    std::vector<TraceRecord> records_;
+    std::atomic<std::uint64_t> count_{0};
+    std::uint16_t const thread_;
+};
+
+// Binary trace file: header followed by the records of all threads sorted by TSC.
+struct TraceFileHeader
+{
+    static constexpr std::uint64_t magic_value = 0x3165636172742d6d; // "m-trace1"
+
+    std::uint64_t magic;
+    double ns_per_tick;
+    std::uint64_t count;
+};
+
+// Owns the trace buffers of all threads, so they can be dumped together even after their threads exit.
+class Tracer
+{
+public:
+    static Tracer & instance()
     {
-        handle_add(Side::Sell, msg);
+        static Tracer tracer{};
+        return tracer;
     }
 
-    // Handle buys and sells the same by just passing in the side as a parameter.
-    template <typename AddOrder_T>
-    void handle_add(Side side, AddOrder_T const & msg)
+    // Buffer of the calling thread, which is created on first use.
+    TraceBuffer & buffer()
     {
-        trades_.clear();
-        Qty const leaves_qty = book_->match(side, msg.order_id, msg.qty, msg.price, trades_);
-        if (leaves_qty.is_zero())
+        thread_local TraceBuffer * buffer = nullptr;
+        if (not buffer)
         {
-            // Aggressive order is fully filled, so done.
-            return;
+            std::lock_guard<decltype(mutex_)> lock{mutex_};
+            buffers_.push_back(std::make_unique<TraceBuffer>(static_cast<std::uint16_t>(buffers_.size())));
+            buffer = buffers_.back().get();
         }
+        return *buffer;
+    }
 
-        switch (msg.tif)
+    void dump(std::ostream & os)
+    {
+        std::vector<TraceRecord> records{};
         {
-            case TIF::GFD:
+            std::lock_guard<decltype(mutex_)> lock{mutex_};
+            for (auto && buffer : buffers_)
             {
-                book_->add(side, msg.order_id, leaves_qty, msg.price);
-                break;
+                buffer->copy(records);
             }
-
-            case TIF::IOC:
+        }
+        std::stable_sort(records.begin(), records.end(),
+            [](TraceRecord const & lhs, TraceRecord const & rhs)
             {
-                // Do not add order to the book regardless of leaves_qty.
-                break;
-            }
+                return lhs.tsc < rhs.tsc;
+            });
 
-            case TIF::Invalid:
-            {
-                break;
-            }
+        TraceFileHeader const header{TraceFileHeader::magic_value, clock_.ns_per_tick(), records.size()};
+        os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        os.write(reinterpret_cast<char const *>(records.data()), records.size() * sizeof(TraceRecord));
+        os.flush();
+    }
+
+    void dump(std::string const & file_name)
+    {
+        std::ofstream os{file_name, std::ios::binary};
+        if (not os)
+        {
+            throw std::runtime_error{"Unable to open trace file " + file_name};
         }
+        dump(os);
     }
 
-    void handle(CancelOrder const & msg)
+private:
+    Tracer() = default;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers_;
+    TscClock clock_;
+};
+
+inline void trace_event(TraceEvent event, std::uint64_t arg)
+{
+    Tracer::instance().buffer().record(event, arg);
+}
+
+// Decode a binary trace file into a timeline of events (nanoseconds since the first event) followed by
+// the latency percentiles of each stage, pairing begin and end events of the same stage on the same thread.
+void decode_trace(std::istream & is, std::ostream & os)
+{
+    TraceFileHeader header{};
+    if (not is.read(reinterpret_cast<char *>(&header), sizeof(header)) or header.magic != TraceFileHeader::magic_value)
     {
-        book_->cancel(msg.order_id);
+        throw std::invalid_argument{"Invalid trace file"};
     }
 
-    void handle(ModifyOrder const & msg)
+    std::size_t const stage_count = static_cast<std::size_t>(TraceEvent::Count) / 2;
+    std::vector<LatencyHistogram> histograms(stage_count);
+    std::vector<std::vector<std::uint64_t>> begin_tscs{}; // Begin TSC of each stage by thread, 0 if none.
+    std::uint64_t first_tsc = 0;
+    auto to_ns = [&header](double ticks)
     {
-        // A modify may match if its price or side changed.
-        trades_.clear();
-        Qty const leaves_qty = book_->match(msg.side, msg.order_id, msg.qty, msg.price, trades_);
-        if (leaves_qty.is_zero())
+        return static_cast<std::uint64_t>(ticks * header.ns_per_tick + 0.5);
+    };
+
+    TraceRecord record{};
+    for (std::uint64_t i = 0; i != header.count and is.read(reinterpret_cast<char *>(&record), sizeof(record)); ++i)
+    {
+        if (i == 0)
         {
-            // Order is fully filled, but we must still cancel the original order since this is a modify.
-            book_->cancel(msg.order_id);
-            return;
+            first_tsc = record.tsc;
         }
 
-        // Modify the book (use leaves_qty in case of matching).
-        book_->modify(msg.side, msg.order_id, leaves_qty, msg.price);
+        auto const event = static_cast<std::size_t>(record.event);
+        auto const stage = event / 2;
+        bool const is_begin = event % 2 == 0;
+        os << to_ns(record.tsc - first_tsc)
+            << " T" << record.thread
+            << ' ' << stage_name(stage) << (is_begin ? "_BEGIN" : "_END")
+            << ' ' << record.arg
+            << '\n';
+
+        if (stage >= stage_count)
+        {
+            continue;
+        }
+        if (record.thread >= begin_tscs.size())
+        {
+            begin_tscs.resize(record.thread + 1, std::vector<std::uint64_t>(stage_count));
+        }
+        auto && begin_tsc = begin_tscs[record.thread][stage];
+        if (is_begin)
+        {
+            begin_tsc = record.tsc;
+        }
+        else if (begin_tsc != 0)
+        {
+            histograms[stage].record(record.tsc - begin_tsc);
+            begin_tsc = 0;
+        }
     }
 
-    void handle(ClearBook const &)
+    for (std::size_t stage = 0; stage != stage_count; ++stage)
     {
-        book_->clear();
+        auto && histogram = histograms[stage];
+        os << "STAGE " << stage_name(stage)
+            << " count " << histogram.count()
+            << " mean_ns " << to_ns(histogram.mean())
+            << " p50_ns " << to_ns(histogram.percentile(50.0))
+            << " p99_ns " << to_ns(histogram.percentile(99.0))
+            << " p999_ns " << to_ns(histogram.percentile(99.9))
+            << " max_ns " << to_ns(histogram.max())
+            << '\n';
     }
-
-private:
-    BookPtr book_;
-    Trades trades_;
-};
-
-using MatchingEnginePtr = std::shared_ptr<MatchingEngine>;
+    os.flush();
+}
 
 
 /*
- * 5. Command Processor - Reads and dispatches commands to the matching engine.
- * The command processor handles I/O by reading and parsing commands from an input stream,
- * normalizing and converting the lines into messages acceptable by the matching engine,
- * handling the messages with the matching engine,
- * and writing any results to an output stream.
+ * 4. Order Book - Order book made up of separate sets of buy and sell levels ordered by price where each level has a queue of orders.
  */
 
-// CommandProcessor_T handles all input processing and uses CRTP to statically handle messages in derived class.
-// Derived_T must implement handlers for each message type:
-// void handle(BuyOrder)
-// void handle(SellOrder)
-// void handle(CancelOrder)
-// void handle(ModifyOrder)
-// void handle(PrintBook)
-// void handle(ClearBook)
+// Huge pages to back the memory of books: none (the heap), transparent huge pages advised with madvise,
+// or explicit huge pages reserved by the system (vm.nr_hugepages) and mapped with MAP_HUGETLB.
+enum class HugePages : std::uint8_t
+{
+    None,
+    Transparent,
+    Explicit,
+    Invalid,
+};
 
-template <typename Derived_T>
-class CommandProcessor_T
+std::istream & operator>>(std::istream & is, HugePages & huge_pages)
+{
+    std::string str{};
+    is >> str;
+    if (str == "none")
+    {
+        huge_pages = HugePages::None;
+    }
+    else if (str == "thp")
+    {
+        huge_pages = HugePages::Transparent;
+    }
+    else if (str == "explicit")
+    {
+        huge_pages = HugePages::Explicit;
+    }
+    else
+    {
+        huge_pages = HugePages::Invalid;
+    }
+    return is;
+}
+
+// How the memory of books is backed, which applies to books made after setting it.
+struct MemoryOptions
+{
+    HugePages huge_pages = HugePages::None;
+    bool prefault = false; // Touch each page when allocated, so it is not faulted in on first use while matching.
+    bool lock = false; // Lock pages in RAM with mlock, so they are never paged out.
+};
+
+// Maps and prepares the memory behind books per the process-wide MemoryOptions.
+// Regions fall back to normal pages if huge pages are unavailable, such as if none are reserved for MAP_HUGETLB.
+class PageMapper
 {
 public:
-    CommandProcessor_T()
+    static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+
+    static PageMapper & instance()
     {
-        init_cmd_handlers();
+        static PageMapper mapper{};
+        return mapper;
     }
 
-    void run(std::istream & is)
+    // Set the options before making any book that should use them.
+    MemoryOptions const & options() const noexcept { return options_; }
+    void options(MemoryOptions const & options) noexcept { options_ = options; }
+
+    static std::size_t round_up(std::size_t size) noexcept
     {
-        std::string cmd{};
-        while (is >> cmd)
+        return (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+    }
+
+    // Map a region aligned to huge_page_size whose size must be a multiple of huge_page_size.
+    void * map(std::size_t size)
+    {
+        assert(size != 0 and size % huge_page_size == 0);
+        void * addr = MAP_FAILED;
+        bool huge = false;
+        if (options_.huge_pages == HugePages::Explicit)
         {
-            try
+            addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            huge = addr != MAP_FAILED;
+        }
+        if (addr == MAP_FAILED)
+        {
+            addr = map_aligned(size);
+            huge = options_.huge_pages == HugePages::Transparent and ::madvise(addr, size, MADV_HUGEPAGE) == 0;
+        }
+        (huge ? huge_bytes_ : normal_bytes_) += size;
+        prepare(addr, size);
+        return addr;
+    }
+
+    void unmap(void * addr, std::size_t size) noexcept
+    {
+        ::munmap(addr, size);
+    }
+
+    // Pre-fault and lock memory per the options, such as a chunk from the heap.
+    void prepare(void * addr, std::size_t size)
+    {
+        if (options_.prefault)
+        {
+            auto const page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+            auto const begin = static_cast<char volatile *>(addr);
+            for (auto byte = begin; byte < begin + size; byte += page_size)
             {
-                handle(cmd, is);
+                *byte = 0;
             }
-            catch (std::exception const & error)
+        }
+        if (options_.lock)
+        {
+            if (::mlock(addr, size) == 0)
             {
-                IF_DEBUG(std::cerr << error.what() << std::endl;)
+                locked_bytes_ += size;
+            }
+            else
+            {
+                ++lock_failures_;
             }
         }
     }
 
-protected:
-    void init_cmd_handlers()
+    void write_stats(std::ostream & os) const
     {
-        // Initialize mapping from command to handler function.
-        using std::placeholders::_1;
-        cmd_to_handler_["BUY"] = std::bind(&CommandProcessor_T::handle<BuyOrder>, this, _1);
-        cmd_to_handler_["SELL"] = std::bind(&CommandProcessor_T::handle<SellOrder>, this, _1);
-        cmd_to_handler_["CANCEL"] = std::bind(&CommandProcessor_T::handle<CancelOrder>, this, _1);
-        cmd_to_handler_["MODIFY"] = std::bind(&CommandProcessor_T::handle<ModifyOrder>, this, _1);
-        cmd_to_handler_["PRINT"] = std::bind(&CommandProcessor_T::handle<PrintBook>, this, _1);
-        cmd_to_handler_["CLEAR"] = std::bind(&CommandProcessor_T::handle<ClearBook>, this, _1);
+        os << "PAGES"
+            << " huge_bytes " << huge_bytes_
+            << " normal_bytes " << normal_bytes_
+            << " locked_bytes " << locked_bytes_
+            << " lock_failures " << lock_failures_
+            << '\n';
     }
 
-    void handle(std::string const & cmd, std::istream & is)
+private:
+    PageMapper() = default;
+
+    // Map normal pages aligned to huge_page_size, so transparent huge pages can back the whole region,
+    // by mapping a huge page more than needed and unmapping the unaligned ends.
+    static void * map_aligned(std::size_t size)
     {
-        // Lookup and call handler for the command.
-        assert(not cmd.empty());
-        auto iter = cmd_to_handler_.find(cmd);
-        if (iter == cmd_to_handler_.end())
+        auto const padded_size = size + huge_page_size;
+        void * addr = ::mmap(nullptr, padded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
         {
-            std::stringstream msg{};
-            msg << "Unknown command " << cmd;
-            throw std::invalid_argument{msg.str()};
+            throw std::bad_alloc{};
         }
-        auto && handler = iter->second;
-        handler(is);
-    }
-
-    template <typename Msg_T>
-    void handle(std::istream & is)
-    {
-        // Load each message type with input stream and dispatch it statically.
-        Msg_T msg{};
-        is >> msg;
-        if (msg.is_invalid())
+        auto const begin = reinterpret_cast<std::uintptr_t>(addr);
+        auto const aligned = (begin + huge_page_size - 1) & ~(huge_page_size - 1);
+        if (aligned != begin)
         {
-            throw std::invalid_argument{"Skipping invalid message"};
+            ::munmap(addr, aligned - begin);
         }
-        static_cast<Derived_T *>(this)->Derived_T::handle(msg);
+        if (aligned + size != begin + padded_size)
+        {
+            ::munmap(reinterpret_cast<void *>(aligned + size), begin + padded_size - (aligned + size));
+        }
+        return reinterpret_cast<void *>(aligned);
     }
 
-private:
-    using Handler = std::function<void (std::istream &)>;
-    using CmdToHandler = std::unordered_map<std::string, Handler>;
-    CmdToHandler cmd_to_handler_;
-};
+    MemoryOptions options_;
 
+    // Counters shared by the books of all threads.
+    std::atomic<std::uint64_t> huge_bytes_{0}; // Mapped on explicit huge pages or advised to use transparent ones.
+    std::atomic<std::uint64_t> normal_bytes_{0}; // Mapped on normal pages since huge pages were unavailable.
+    std::atomic<std::uint64_t> locked_bytes_{0};
+    std::atomic<std::uint64_t> lock_failures_{0}; // Such as from exceeding RLIMIT_MEMLOCK.
+};
 
-class CommandProcessor
-    : public CommandProcessor_T<CommandProcessor>
+// Chunks of memory, such as for nodes or orders, that stay allocated until the arena is destroyed.
+// With huge pages, chunks are carved from regions mapped by PageMapper so that many chunks share a huge page.
+// Otherwise, each chunk comes from the heap. Either way, chunks are pre-faulted and locked per the MemoryOptions.
+class PageArena
 {
 public:
-    CommandProcessor(MatchingEnginePtr matching_engine, std::ostream & os)
-        : CommandProcessor_T<CommandProcessor>()
-        , matching_engine_{std::move(matching_engine)}
-        , os_{os}
+    PageArena()
+        : huge_{PageMapper::instance().options().huge_pages != HugePages::None}
     {
     }
 
-    void handle(BuyOrder const & msg)
-    {
-        matching_engine_->handle(msg);
-        os_ << matching_engine_->trades();
-    }
+    PageArena(PageArena const &) = delete;
+    PageArena & operator=(PageArena const &) = delete;
 
-    void handle(SellOrder const & msg)
+    ~PageArena()
     {
-        matching_engine_->handle(msg);
-        os_ << matching_engine_->trades();
+        for (auto && region : regions_)
+        {
+            if (huge_)
+            {
+                PageMapper::instance().unmap(region.addr, region.size);
+            }
+            else
+            {
+                std::free(region.addr);
+            }
+        }
     }
 
-    void handle(CancelOrder const & msg)
-    {
-        matching_engine_->handle(msg);
-    }
+    // True if chunks are carved from huge page regions instead of the heap.
+    bool huge() const noexcept { return huge_; }
 
-    void handle(ModifyOrder const & msg)
+    // Allocate a chunk aligned to alignment, which must be a power of 2 no larger than a huge page.
+    void * allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
     {
-        matching_engine_->handle(msg);
-        os_ << matching_engine_->trades();
-    }
+        regions_.reserve(regions_.size() + 1); // Reserve first so a new region cannot leak.
+        if (not huge_)
+        {
+            void * chunk = nullptr;
+            if (posix_memalign(&chunk, std::max(alignment, sizeof(void *)), size) != 0)
+            {
+                throw std::bad_alloc{};
+            }
+            regions_.push_back(Region{chunk, size});
+            PageMapper::instance().prepare(chunk, size);
+            return chunk;
+        }
 
-    void handle(PrintBook const &)
-    {
-        os_ << *matching_engine_->book();
+        auto offset = (used_ + alignment - 1) & ~(alignment - 1);
+        if (regions_.empty() or offset + size > regions_.back().size)
+        {
+            auto const region_size = PageMapper::round_up(size);
+            regions_.push_back(Region{PageMapper::instance().map(region_size), region_size});
+            offset = 0;
+        }
+        used_ = offset + size;
+        return static_cast<char *>(regions_.back().addr) + offset;
     }
 
-    void handle(ClearBook const & msg)
+private:
+    struct Region
     {
-        matching_engine_->handle(msg);
-    }
+        void * addr;
+        std::size_t size;
+    };
 
-private:
-    MatchingEnginePtr matching_engine_;
-    std::ostream & os_;
+    bool huge_;
+    std::vector<Region> regions_; // Mapped regions or, without huge pages, heap chunks.
+    std::size_t used_ = 0; // Bytes used of the last region.
 };
 
-
-// Command processor that simply writes normalized messages.
-class CommandWriter
-    : public CommandProcessor_T<CommandWriter>
+// Pool of fixed-size memory blocks for container nodes, such as the nodes of the lists of orders and sets of levels.
+// Freed nodes are kept in a free list per size for reuse instead of returning them to the heap,
+// so once the book reaches its steady-state size, adding and removing orders requires no heap allocations.
+// Larger blocks, such as unordered_map buckets, come from the heap but are tracked by the pool to reuse after a reset.
+// With huge pages, chunks come from huge page regions and blocks of a huge page or more are mapped on their own.
+// The pool is also an arena: reset() releases everything allocated from it at once without visiting any node.
+// Not thread-safe: all containers using a pool must be used by one thread at a time.
+class NodePool
 {
 public:
-    CommandWriter(std::ostream & os)
-        : CommandProcessor_T<CommandWriter>()
-        , os_{os}
+    static constexpr std::size_t alignment = alignof(std::max_align_t);
+    static constexpr std::size_t max_node_size = 256;
+    static constexpr std::size_t chunk_size = 64 * 1024;
+
+    NodePool() = default;
+    NodePool(NodePool const &) = delete;
+    NodePool & operator=(NodePool const &) = delete;
+
+    ~NodePool()
     {
+        release_blocks(blocks_);
+        release_blocks(spare_blocks_);
     }
 
-    // Handle any message type (BuyOrder, CancelOrder, etc.) the same,
-    // just write to output stream.
-    template <typename Msg_T>
-    void handle(Msg_T const & msg)
+    // True if nodes of the given size are allocated from the pool (otherwise the caller should use allocate_block).
+    static constexpr bool is_pooled(std::size_t size) noexcept
     {
-        os_ << msg << std::endl;
+        return size <= max_node_size;
     }
 
-private:
-    std::ostream & os_;
-};
+    void * allocate(std::size_t size)
+    {
+        auto && free_list = free_lists_[size_class(size)];
+        if (free_list)
+        {
+            auto node = free_list;
+            free_list = node->next;
+            return node;
+        }
 
+        // Carve a new node from the current chunk, moving to the next chunk if it is used up.
+        // Chunks kept by reset() are reused before allocating new ones.
+        auto const node_size = (size_class(size) + 1) * alignment;
+        if (not chunk_ or chunk_used_ + node_size > chunk_size)
+        {
+            if (next_chunk_ == chunks_.size())
+            {
+                chunks_.push_back(static_cast<char *>(arena_.allocate(chunk_size)));
+            }
+            chunk_ = chunks_[next_chunk_++];
+            chunk_used_ = 0;
+        }
+        void * node = chunk_ + chunk_used_;
+        chunk_used_ += node_size;
+        return node;
+    }
 
-template <typename T>
-class ThreadsafeQueue
-{
-public:
-    using container_type = std::deque<T>;
-    ThreadsafeQueue() = default;
+    void deallocate(void * ptr, std::size_t size) noexcept
+    {
+        auto && free_list = free_lists_[size_class(size)];
+        auto node = static_cast<FreeNode *>(ptr);
+        node->next = free_list;
+        free_list = node;
+    }
 
-    void push(T value)
+    // Allocate a block of any size, linking it into the list of blocks so reset() can reclaim it.
+    // A block of the same size released by reset() is reused before allocating from the heap.
+    void * allocate_block(std::size_t size)
     {
-        std::unique_lock<decltype(mutex_)> lock{mutex_};
-        queue_.push_back(std::move(value));
-        lock.unlock();
-        cond_var_.notify_one();
+        Block * block = take_block(spare_blocks_, size);
+        if (not block)
+        {
+            block = new_block(size);
+        }
+        link_block(blocks_, *block);
+        return block + 1;
     }
 
-    void wait_and_pop(T & value)
+    void deallocate_block(void * ptr) noexcept
     {
-        std::unique_lock<decltype(mutex_)> lock{mutex_};
-        cond_var_.wait(lock,
-            [this]()
-            {
-                // TODO: need a done flag that producer can set so consumer can stop waiting when done too
-                //return not queue_.empty() or done; // must then check if empty/done when wait() returns though
-                return not queue_.empty();
-            });
-        value = queue_.front();
-        queue_.pop_front();
+        auto block = static_cast<Block *>(ptr) - 1;
+        unlink_block(blocks_, *block);
+        delete_block(block);
     }
 
-    bool try_pop(T & value)
+    // Allocate an array, such as a growing ring buffer, rounding its size up to a power of two.
+    // Small arrays are nodes, and freed larger arrays stay linked as blocks in a free list per size for reuse,
+    // so arrays that grow and shrink with the book require no heap allocations in steady state either.
+    void * allocate_array(std::size_t size)
     {
-        std::lock_guard<decltype(mutex_)> lock{mutex_};
-        if (queue_.empty())
+        assert(size != 0);
+        size = round_up_pow2(size);
+        if (is_pooled(size))
         {
-            return false;
+            return allocate(size);
         }
-        value = queue_.front();
-        queue_.pop_front();
-        return true;
+        auto && free_list = array_free_lists_[log2(size)];
+        if (free_list)
+        {
+            auto block = free_list;
+            free_list = block->next_free;
+            return block + 1;
+        }
+        return allocate_block(size);
     }
 
-    bool empty() const
+    void deallocate_array(void * ptr, std::size_t size) noexcept
     {
-        std::lock_guard<decltype(mutex_)> lock{mutex_};
-        return queue_.empty();
+        size = round_up_pow2(size);
+        if (is_pooled(size))
+        {
+            deallocate(ptr, size);
+            return;
+        }
+        auto block = static_cast<Block *>(ptr) - 1;
+        auto && free_list = array_free_lists_[log2(size)];
+        block->next_free = free_list;
+        free_list = block;
     }
 
-private:
-    container_type queue_;
-    mutable std::mutex mutex_;
-    std::condition_variable cond_var_;
-};
+    // Allocate chunks ahead for at least size bytes of nodes, so that carving the nodes later does not fault in memory.
+    void reserve(std::size_t size)
+    {
+        auto const spare_chunks = chunks_.size() - next_chunk_;
+        auto available = spare_chunks * chunk_size + (chunk_ ? chunk_size - chunk_used_ : 0);
+        for (; available < size; available += chunk_size)
+        {
+            chunks_.push_back(static_cast<char *>(arena_.allocate(chunk_size)));
+        }
+    }
 
-using Task = std::function<void ()>;
-using TaskQueue = ThreadsafeQueue<Task>;
-using TaskQueuePtr = std::shared_ptr<TaskQueue>;
+    // Release all nodes and blocks at once, keeping the chunks and blocks to reuse.
+    // Every container using the pool must be abandoned without destroying it and then reconstructed,
+    // and the nodes must not own other memory (such as a std::string beyond its inline capacity),
+    // which would otherwise leak.
+    // Costs O(blocks), where blocks are only the few bucket arrays, instead of O(nodes).
+    void reset() noexcept
+    {
+        while (blocks_)
+        {
+            auto && block = *blocks_;
+            unlink_block(blocks_, block);
+            link_block(spare_blocks_, block);
+        }
+        std::fill(std::begin(free_lists_), std::end(free_lists_), nullptr);
+        std::fill(std::begin(array_free_lists_), std::end(array_free_lists_), nullptr);
+        chunk_ = nullptr;
+        chunk_used_ = 0;
+        next_chunk_ = 0;
+    }
 
-// Queues commands in a task queue.
-class QueueingCommandProcessor
-    : public CommandProcessor_T<QueueingCommandProcessor>
-{
-public:
-    QueueingCommandProcessor(TaskQueuePtr task_queue, MatchingEnginePtr matching_engine, std::ostream & os)
-        : CommandProcessor_T<QueueingCommandProcessor>()
-        , task_queue_{std::move(task_queue)}
-        , matching_engine_{std::move(matching_engine)}
-        , os_{os}
+private:
+    struct FreeNode
     {
+        FreeNode * next;
+    };
+
+    // Header of a heap block, aligned so the block after it is aligned like a node.
+    struct alignas(alignment) Block
+    {
+        Block * prev;
+        Block * next;
+        Block * next_free; // Next freed array of the same size.
+        std::size_t size;
+    };
+
+    static constexpr std::size_t size_class(std::size_t size) noexcept
+    {
+        return (size + alignment - 1) / alignment - 1;
     }
 
-    void handle(BuyOrder const & msg)
+    static std::size_t log2(std::size_t size) noexcept
     {
-        task_queue_->push(
-            [this, msg=std::move(msg)]()
-            {
-                matching_engine_->handle(msg);
-                os_ << matching_engine_->trades();
-            });
+        return 63 - static_cast<std::size_t>(__builtin_clzll(size));
     }
 
-    void handle(SellOrder const & msg)
+    static std::size_t round_up_pow2(std::size_t size) noexcept
     {
-        task_queue_->push(
-            [this, msg=std::move(msg)]()
-            {
-                matching_engine_->handle(msg);
-                os_ << matching_engine_->trades();
-            });
+        return size <= 1 ? 1 : std::size_t{2} << log2(size - 1);
     }
 
-    void handle(CancelOrder const & msg)
+    static void link_block(Block * & blocks, Block & block) noexcept
     {
-        task_queue_->push(
-            [this, msg=std::move(msg)]()
-            {
-                matching_engine_->handle(msg);
-            });
+        block.prev = nullptr;
+        block.next = blocks;
+        if (blocks)
+        {
+            blocks->prev = &block;
+        }
+        blocks = &block;
     }
 
-    void handle(ModifyOrder const & msg)
+    static void unlink_block(Block * & blocks, Block & block) noexcept
     {
-        task_queue_->push(
-            [this, msg=std::move(msg)]()
-            {
-                matching_engine_->handle(msg);
-                os_ << matching_engine_->trades();
-            });
+        (block.prev ? block.prev->next : blocks) = block.next;
+        if (block.next)
+        {
+            block.next->prev = block.prev;
+        }
     }
 
-    void handle(PrintBook const &)
+    static Block * take_block(Block * & blocks, std::size_t size) noexcept
     {
-        task_queue_->push(
-            [this]()
+        for (auto block = blocks; block; block = block->next)
+        {
+            if (block->size == size)
             {
-                os_ << *matching_engine_->book();
-            });
+                unlink_block(blocks, *block);
+                return block;
+            }
+        }
+        return nullptr;
     }
 
-    void handle(ClearBook const & msg)
+    // Blocks of at least a huge page are mapped on their own when using huge pages, so they are unmapped when freed.
+    bool is_mapped(std::size_t size) const noexcept
     {
-        task_queue_->push(
-            [this, msg=std::move(msg)]()
-            {
-                matching_engine_->handle(msg);
-            });
+        return arena_.huge() and sizeof(Block) + size >= PageMapper::huge_page_size;
+    }
+
+    Block * new_block(std::size_t size)
+    {
+        void * addr = nullptr;
+        if (is_mapped(size))
+        {
+            addr = PageMapper::instance().map(PageMapper::round_up(sizeof(Block) + size));
+        }
+        else
+        {
+            addr = ::operator new(sizeof(Block) + size);
+            PageMapper::instance().prepare(addr, sizeof(Block) + size);
+        }
+        auto block = static_cast<Block *>(addr);
+        block->size = size;
+        return block;
+    }
+
+    void delete_block(Block * block) noexcept
+    {
+        if (is_mapped(block->size))
+        {
+            PageMapper::instance().unmap(block, PageMapper::round_up(sizeof(Block) + block->size));
+            return;
+        }
+        ::operator delete(block);
+    }
+
+    void release_blocks(Block * & blocks) noexcept
+    {
+        while (blocks)
+        {
+            auto block = blocks;
+            blocks = block->next;
+            delete_block(block);
+        }
+    }
+
+    PageArena arena_; // Memory of the chunks (declared first so it is destroyed after them).
+    FreeNode * free_lists_[max_node_size / alignment] = {};
+    Block * array_free_lists_[64] = {}; // Freed arrays indexed by log2 of their size.
+    std::vector<char *> chunks_;
+    char * chunk_ = nullptr; // Chunk that new nodes are carved from.
+    std::size_t chunk_used_ = 0;
+    std::size_t next_chunk_ = 0; // Index of the chunk to use after chunk_.
+    Block * blocks_ = nullptr; // Blocks in use.
+    Block * spare_blocks_ = nullptr; // Blocks released by reset() to reuse.
+};
+
+// Standard allocator that allocates single nodes from a NodePool, such as for list, set, and unordered_map nodes.
+// Arrays, such as unordered_map buckets, are allocated as heap blocks tracked by the pool.
+template <typename T>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+
+    explicit PoolAllocator(NodePool & pool) noexcept
+        : pool_{&pool}
+    {
+    }
+
+    template <typename U>
+    PoolAllocator(PoolAllocator<U> const & other) noexcept
+        : pool_{other.pool_}
+    {
+    }
+
+    T * allocate(std::size_t n)
+    {
+        if (n == 1 and NodePool::is_pooled(sizeof(T)))
+        {
+            return static_cast<T *>(pool_->allocate(sizeof(T)));
+        }
+        return static_cast<T *>(pool_->allocate_block(n * sizeof(T)));
+    }
+
+    void deallocate(T * ptr, std::size_t n) noexcept
+    {
+        if (n == 1 and NodePool::is_pooled(sizeof(T)))
+        {
+            pool_->deallocate(ptr, sizeof(T));
+            return;
+        }
+        pool_->deallocate_block(ptr);
     }
 
+    template <typename U>
+    bool operator==(PoolAllocator<U> const & rhs) const noexcept { return pool_ == rhs.pool_; }
+    template <typename U>
+    bool operator!=(PoolAllocator<U> const & rhs) const noexcept { return not (*this == rhs); }
+
 private:
-    TaskQueuePtr task_queue_;
-    MatchingEnginePtr matching_engine_;
-    std::ostream & os_;
+    template <typename U>
+    friend class PoolAllocator;
+
+    NodePool * pool_;
 };
 
 
-/*
- * 6. Main - Make and run the command processor with a matching engine using stdin and stdout streams.
- */
+// Forward decl
+class Order;
+class OrderTable;
+class Level;
+template <Side Side_V> class LevelSet;
+template <Side Side_V> class LevelLadder;
+template <Side Side_V> class LevelVector;
+class Book;
 
-// Disable synchronization between the C and C++ standard streams for faster I/O.
-static const int __ = []() {
-    std::ios::sync_with_stdio(false);
-    std::cin.tie(nullptr);
-    std::cout.tie(nullptr);
-    return 0;
-}();
+// Container of the levels of one side of the book, ordered from the best to the worst price of that side.
+//#define USE_LEVEL_LADDER
+//#define USE_LEVEL_VECTOR
+#if defined(USE_LEVEL_LADDER)
+template <Side Side_V> using Levels = LevelLadder<Side_V>;
+#elif defined(USE_LEVEL_VECTOR)
+template <Side Side_V> using Levels = LevelVector<Side_V>;
+#else
+template <Side Side_V> using Levels = LevelSet<Side_V>;
+#endif
 
-namespace {
-void run_test(MatchingEnginePtr const & matching_engine) __attribute__((unused));
-void run_all_tests();
-}
+// Orders of one owner in an intrusive doubly linked list through the cold data of the orders themselves,
+// so any order is unlinked in O(1) and all orders of the owner are visited without searching the book.
+struct OwnerOrders
+{
+    Order * head = nullptr;
+    Order * tail = nullptr;
+    std::size_t size = 0;
 
-int
-main(int argc, char * argv[])
+    void link(OrderTable & orders, Order & order);
+    void unlink(OrderTable & orders, Order & order);
+};
+
+// Hot data of an order, which is all that matching reads, so two orders share a cache line.
+// The cold data is an OrderInfo in the book's OrderTable at the same handle.
+class Order
 {
-    if (argc > 1 and std::string{argv[1]} == "--run-tests")
+public:
+    // Displayed qty.
+    Qty qty() const noexcept { return qty_; }
+    Order & qty(Qty q) { qty_ = q; return *this; }
+
+    // Iceberg orders display at most display_qty at a time and hold the rest as hidden qty (zero if not an iceberg).
+    Qty hidden_qty() const noexcept { return hidden_qty_; }
+    Qty total_qty() const noexcept { return qty_ + hidden_qty_; }
+
+    // Level in which this order resides if in the book.
+    Level const * level() const noexcept { return level_; }
+
+    // Index of this order and its cold data in the book's OrderTable.
+    std::uint32_t handle() const noexcept { return handle_; }
+
+private:
+    Qty qty_ = Qty{};
+    Qty hidden_qty_ = Qty{};
+
+    // Split total qty into displayed and hidden qty.
+    void total_qty(Qty qty, Qty display_qty)
     {
-        run_all_tests();
-        return EXIT_SUCCESS;
+        qty_ = display_qty.is_zero() ? qty : std::min(qty, display_qty);
+        hidden_qty_ = qty - qty_;
     }
 
-    auto book = std::make_shared<Book>();
-    auto matching_engine = std::make_shared<MatchingEngine>(book);
-    if (argc > 1 and std::string{argv[1]} == "--run-threads")
-    {
-        // Run with multiple threads.
-        auto task_queue = std::make_shared<TaskQueue>();
-        std::atomic<bool> is_producer_done{false};
-        QueueingCommandProcessor cmd_processor{task_queue, matching_engine, std::cout};
-        std::thread producer{
-            [&cmd_processor, &is_producer_done]()
-            {
-                cmd_processor.run(std::cin);
-                is_producer_done.store(true);
-            }};
+    // Level in which this order resides and position of this order in the level's queue.
+    // Level and Book use these to quickly access this order instead of searching for it (O(1) instead of O(n)).
+    friend Level;
+    friend Book;
+    friend OrderTable;
+    Level * level_ = nullptr;
+    std::uint32_t position_ = 0;
+    std::uint32_t handle_ = 0;
+};
 
-        std::thread consumer{
-            [task_queue, &is_producer_done]()
-            {
-                Task task{};
+static_assert(sizeof(Order) <= 32, "Hot order data must fit in half a cache line");
 
-                // Execute tasks while producer is running.
-                while (not is_producer_done)
-                {
-                    task_queue->wait_and_pop(task);
-                    task();
-                }
+// Cold data of an order, which is only read for output, queries, and owner lists.
+struct OrderInfo
+{
+    OrderID order_id;
+    Qty display_qty;
 
-                // Execute remaining tasks after producer is done.
-                while (task_queue->try_pop(task))
-                {
-                    task();
-                }
-            }};
+    // Owner of this order, if any, and its neighbors in the owner's list.
+    OwnerOrders * owner = nullptr;
+    Order * prev_owned = nullptr;
+    Order * next_owned = nullptr;
+};
 
-        producer.join();
-        consumer.join();
-    }
-    else
+// Orders of a book in two parallel tables indexed by the same handle: the hot Order records that matching reads
+// and the cold OrderInfo records, so matching never pulls order IDs into the cache.
+// Both tables grow by fixed-size chunks from a PageArena, so orders never move, and released handles are reused first.
+// Released cold records keep their order ID strings, so a reused handle copies its order ID into the memory of the last
+// one instead of allocating. Not thread-safe like NodePool.
+class OrderTable
+{
+public:
+    static constexpr std::size_t chunk_size = 1024; // Orders per chunk.
+
+    OrderTable() = default;
+    OrderTable(OrderTable const &) = delete;
+    OrderTable & operator=(OrderTable const &) = delete;
+
+    ~OrderTable()
     {
-        // Single threaded.
-        CommandProcessor cmd_processor{matching_engine, std::cout};
-        //CommandWriter cmd_processor{std::cout};
-        cmd_processor.run(std::cin);
-        //run_test(matching_engine);
+        clear();
     }
 
-    return EXIT_SUCCESS;
-}
+    // Allocate an order with its cold data.
+    Order & allocate(OrderID const & order_id, Qty display_qty)
+    {
+        std::uint32_t handle = 0;
+        if (not free_handles_.empty())
+        {
+            handle = free_handles_.back();
+            free_handles_.pop_back();
+        }
+        else
+        {
+            if (size_ == hot_chunks_.size() * chunk_size)
+            {
+                add_chunk();
+            }
+            handle = static_cast<std::uint32_t>(size_++);
+        }
+        auto && order = *new (&hot(handle)) Order{};
+        order.handle_ = handle;
+        if (handle < constructed_)
+        {
+            auto && info = cold(handle);
+            info.order_id.value(order_id.value());
+            info.display_qty = display_qty;
+            info.owner = nullptr;
+            info.prev_owned = nullptr;
+            info.next_owned = nullptr;
+        }
+        else
+        {
+            new (&cold(handle)) OrderInfo{order_id, display_qty};
+            ++constructed_;
+        }
+        return order;
+    }
 
+    // Release an order removed from its level, keeping its cold record to reuse.
+    void release(Order & order)
+    {
+        order.level_ = nullptr;
+        free_handles_.push_back(order.handle_);
+    }
 
-/*
- * 7. Unit Tests - Tests matching engine with various inputs.
- */
+    OrderInfo & info(Order const & order) noexcept { return cold(order.handle_); }
+    OrderInfo const & info(Order const & order) const noexcept { return cold(order.handle_); }
 
-namespace {
+    // Release all orders and destroy their cold records, freeing the memory of their order IDs.
+    void clear()
+    {
+        for (std::size_t handle = 0; handle != constructed_; ++handle)
+        {
+            cold(handle).~OrderInfo();
+        }
+        constructed_ = 0;
+        reset();
+    }
 
-void run_test(MatchingEnginePtr const & matching_engine)
-{
-    // Auto-generate orders to test the matching engine.
-    std::uint64_t order_id = 0;
-    for (std::uint64_t i = 0; i != 10; ++i)
+    // Allocate chunks ahead for count orders.
+    void reserve(std::size_t count)
     {
-        auto msg = BuyOrder{TIF::GFD, Price{100 * i + 100}, Qty{i + 1}, OrderID{"order_" + std::to_string(order_id++)}};
-        std::cout << msg << std::endl;
-        matching_engine->handle(msg);
-        std::cout << matching_engine->trades();
+        while (hot_chunks_.size() * chunk_size < count)
+        {
+            add_chunk();
+        }
     }
-    std::cout << *matching_engine->book() << std::endl;
 
-    for (std::uint64_t i = 0; i != 10; ++i)
+    // Release all orders at once, keeping the chunks and the cold records to reuse.
+    void reset() noexcept
     {
-        auto msg = SellOrder{TIF::GFD, Price{100 * i + 100}, Qty{i + 1}, OrderID{"order_" + std::to_string(order_id++)}};
-        std::cout << msg << std::endl;
-        matching_engine->handle(msg);
-        std::cout << matching_engine->trades();
+        size_ = 0;
+        free_handles_.clear();
     }
-    std::cout << *matching_engine->book() << std::endl;
 
+private:
+    Order & hot(std::size_t handle) noexcept { return hot_chunks_[handle / chunk_size][handle % chunk_size]; }
+    OrderInfo & cold(std::size_t handle) noexcept { return cold_chunks_[handle / chunk_size][handle % chunk_size]; }
+    OrderInfo const & cold(std::size_t handle) const noexcept
     {
-        auto msg = ModifyOrder{OrderID{"order_19"}, Side::Buy, Price{700}, Qty{18}};
-        std::cout << msg << std::endl;
-        matching_engine->handle(msg);
-        std::cout << *matching_engine->book() << std::endl;
-        std::cout << matching_engine->trades();
+        return cold_chunks_[handle / chunk_size][handle % chunk_size];
     }
+
+    void add_chunk()
     {
-        //auto msg = ModifyOrder{OrderID{"order_19"}, Side::Sell, Price{100}, Qty{37}};
-        //auto msg = ModifyOrder{OrderID{"order_19"}, Side::Buy, Price{1000}, Qty{18}};
-        auto msg = ModifyOrder{OrderID{"order_19"}, Side::Sell, Price{100}, Qty{18}};
-        std::cout << msg << std::endl;
-        matching_engine->handle(msg);
-        std::cout << *matching_engine->book() << std::endl;
-        std::cout << matching_engine->trades();
+        // Align hot chunks to cache lines, so no order straddles two lines.
+        hot_chunks_.push_back(static_cast<Order *>(arena_.allocate(chunk_size * sizeof(Order), 64)));
+        cold_chunks_.push_back(static_cast<OrderInfo *>(arena_.allocate(chunk_size * sizeof(OrderInfo),
+            alignof(OrderInfo))));
     }
+
+    PageArena arena_; // Memory of the chunks.
+    std::vector<Order *> hot_chunks_;
+    std::vector<OrderInfo *> cold_chunks_;
+    std::size_t size_ = 0; // Handles used so far, including released handles.
+    std::size_t constructed_ = 0; // Handles whose cold records are constructed, which may be more than size_ after reset().
+    std::vector<std::uint32_t> free_handles_;
+};
+
+void OwnerOrders::link(OrderTable & orders, Order & order)
+{
+    auto && info = orders.info(order);
+    info.owner = this;
+    info.prev_owned = tail;
+    info.next_owned = nullptr;
+    (tail ? orders.info(*tail).next_owned : head) = &order;
+    tail = &order;
+    ++size;
 }
 
-bool run_test_1();
-bool run_test_2();
-bool run_test_3();
-bool run_test_4();
-bool run_test_5();
+void OwnerOrders::unlink(OrderTable & orders, Order & order)
+{
+    auto && info = orders.info(order);
+    assert(info.owner == this);
+    (info.prev_owned ? orders.info(*info.prev_owned).next_owned : head) = info.next_owned;
+    (info.next_owned ? orders.info(*info.next_owned).prev_owned : tail) = info.prev_owned;
+    info.owner = nullptr;
+    --size;
+}
+
+
+
+
+class Level
+{
+public:
+    // Positions wrap around, which is harmless since only differences between positions in the queue are used.
+    using Position = std::uint32_t;
+
+    // Iterator over the orders of a level in time priority, skipping the holes of removed orders.
+    class OrderIterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Order;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Order const *;
+        using reference = Order const &;
+
+        OrderIterator(Level const & level, Position position)
+            : level_{&level}
+            , position_{position}
+        {
+        }
+
+        reference operator*() const { return *level_->order_at(position_); }
+        pointer operator->() const { return level_->order_at(position_); }
+
+        OrderIterator & operator++()
+        {
+            do
+            {
+                ++position_;
+            }
+            while (position_ != level_->tail_ and not level_->order_at(position_));
+            return *this;
+        }
+        OrderIterator operator++(int) { auto iter = *this; ++*this; return iter; }
+
+        bool operator==(OrderIterator const & rhs) const { return position_ == rhs.position_; }
+        bool operator!=(OrderIterator const & rhs) const { return not (*this == rhs); }
+
+    private:
+        Level const * level_;
+        Position position_;
+    };
+
+    // Orders of a level in time priority.
+    class Orders
+    {
+    public:
+        explicit Orders(Level const & level)
+            : level_{&level}
+        {
+        }
+
+        // Note: The first position is never a hole since holes at the front are removed.
+        OrderIterator begin() const { return OrderIterator{*level_, level_->head_}; }
+        OrderIterator end() const { return OrderIterator{*level_, level_->tail_}; }
+        OrderIterator cbegin() const { return begin(); }
+        OrderIterator cend() const { return end(); }
+        Order const & front() const { return *begin(); }
+
+    private:
+        Level const * level_;
+    };
+
+    Level(Price price, NodePool & pool)
+        : price_{price}
+        , pool_{&pool}
+    {
+    }
+
+    Level(Level const &) = delete;
+    Level & operator=(Level const &) = delete;
+
+    // The orders still in the level are released by the book.
+    ~Level()
+    {
+        if (orders_)
+        {
+            pool_->deallocate_array(orders_, capacity() * slot_size);
+        }
+    }
+
+    // Displayed qty, which excludes the hidden qty of iceberg orders.
+    Qty qty() const noexcept { return qty_; }
+    Qty hidden_qty() const noexcept { return hidden_qty_; }
+    Price price() const { return price_; }
+    Side side() const noexcept { return side_; }
+    Orders orders() const { return Orders{*this}; }
+    Order const & front() const { return *order_at(head_); }
+
+    bool empty() const noexcept { return size_ == 0; }
+    std::size_t size() const noexcept { return size_; }
+
+    // Orders are queued in a ring buffer of order handles with a parallel array of their displayed qty
+    // (struct of arrays), where each order is at a position that only grows.
+    // Removing an order leaves a hole (a null handle and zero qty), which is compacted later, so the positions of
+    // the other orders stay valid while the book fills them.
+    Position head() const noexcept { return head_; }
+    Position tail() const noexcept { return tail_; }
+    Order const * order_at(Position position) const noexcept { return orders_[position & mask_]; }
+
+    // Position after the last order needed to fill qty in time priority, found by summing the qty array alone,
+    // eight orders at a time, without touching the orders (holes have zero qty). Returns tail() if all orders fill.
+    Position fill_end(Qty qty) const noexcept
+    {
+        auto remaining = qty.value();
+        auto position = head_;
+        while (position != tail_)
+        {
+            // Sum each contiguous span of the ring separately.
+            std::size_t const index = position & mask_;
+            auto const span = std::min<std::size_t>(static_cast<Position>(tail_ - position), capacity() - index);
+            Qty::value_type const * qtys = qtys_ + index;
+            std::size_t offset = 0;
+            for (; offset + 8 <= span; offset += 8)
+            {
+                std::uint64_t sum = 0; // At least 64 bits so a sum of eight 32-bit qtys cannot overflow.
+                for (std::size_t lane = 0; lane != 8; ++lane)
+                {
+                    sum += qtys[offset + lane];
+                }
+                if (sum >= remaining)
+                {
+                    break;
+                }
+                remaining -= static_cast<Qty::value_type>(sum);
+            }
+            for (; offset != span; ++offset)
+            {
+                if (qtys[offset] >= remaining)
+                {
+                    return static_cast<Position>(position + offset + 1);
+                }
+                remaining -= qtys[offset];
+            }
+            position += static_cast<Position>(span);
+        }
+        return tail_;
+    }
+
+    // Append order with total qty to end of level, which is an iceberg order if display_qty is not zero.
+    void add(Order & order, Qty qty, Qty display_qty)
+    {
+        order.total_qty(qty, display_qty);
+        push_back(order);
+    }
+
+    // Remove order from the queue, leaving a hole unless it is at either end of the queue.
+    void remove(Order & order)
+    {
+        assert(order.level_ == this);
+        assert(order_at(order.position_) == &order); // Must be the same order instance.
+        qty_ -= order.qty();
+        hidden_qty_ -= order.hidden_qty();
+        orders_[order.position_ & mask_] = nullptr;
+        qtys_[order.position_ & mask_] = 0;
+        --size_;
+        while (head_ != tail_ and not order_at(head_))
+        {
+            ++head_;
+        }
+        while (tail_ != head_ and not order_at(tail_ - 1))
+        {
+            --tail_;
+        }
+    }
+
+    // Modify order total qty. The order loses its queue position by being pushed to the end.
+    void modify(Order & order, Qty qty, Qty display_qty)
+    {
+        remove(order);
+        order.total_qty(qty, display_qty);
+        push_back(order);
+    }
+
+    // Modify order total qty, splitting it into displayed and hidden qty. The order keeps its position in the queue.
+    void modify_total_qty(Order & order, Qty qty, Qty display_qty)
+    {
+        assert(not qty.is_zero());
+        assert(order.level_ == this);
+        qty_ -= order.qty();
+        hidden_qty_ -= order.hidden_qty();
+        order.total_qty(qty, display_qty);
+        qty_ += order.qty();
+        hidden_qty_ += order.hidden_qty();
+        qtys_[order.position_ & mask_] = order.qty().value();
+    }
+
+    // Replenish the displayed qty of an iceberg order from its hidden qty after its displayed qty fully filled.
+    // The order is queued at the end of the level like a new order, so nothing is reallocated.
+    void replenish(Order & order, Qty display_qty)
+    {
+        assert(not order.hidden_qty().is_zero());
+        remove(order);
+        order.total_qty(order.hidden_qty(), display_qty);
+        push_back(order);
+    }
+
+    // Modify order displayed qty. The order keeps its position in the queue.
+    void modify_qty(Order & order, Qty qty)
+    {
+        // Modify level qty and assign new order qty.
+        assert(not qty.is_zero());
+        assert(order.level_ == this);
+        assert(order_at(order.position_) == &order); // Must be the same order instance.
+        qty_ -= order.qty();
+        qty_ += qty;
+        order.qty(qty);
+        qtys_[order.position_ & mask_] = qty.value();
+    }
+
+    // Remove the holes in the queue if there are more holes than orders, which moves the orders still queued.
+    // Must not be called while the positions of orders are saved, such as in trades that are not yet filled.
+    void compact()
+    {
+        if (static_cast<Position>(tail_ - head_) - size_ <= size_)
+        {
+            return;
+        }
+        auto position = head_;
+        for (auto from = head_; from != tail_; ++from)
+        {
+            auto const order = orders_[from & mask_];
+            if (order)
+            {
+                orders_[position & mask_] = order;
+                qtys_[position & mask_] = qtys_[from & mask_];
+                order->position_ = position++;
+            }
+        }
+        tail_ = position;
+    }
+
+    // Write all orders in this level with their order IDs from the table.
+    void write_orders(std::ostream & os, OrderTable const & table) const
+    {
+        os << size() << ':' << qty() << " @ " << price() << ":[";
+        for (auto && order : orders())
+        {
+            os << table.info(order).order_id << ':' << order.qty() << ' ';
+        }
+        os << ']';
+    }
+
+private:
+    // Each slot is an order handle and its qty.
+    static constexpr std::size_t slot_size = sizeof(Order *) + sizeof(Qty::value_type);
+    static constexpr std::size_t min_capacity = 8;
+
+    std::size_t capacity() const noexcept { return mask_ + 1; }
+    Order * order_at(Position position) noexcept { return orders_[position & mask_]; }
+
+    // Queue order at the end of the level, growing the ring if full.
+    void push_back(Order & order)
+    {
+        if (static_cast<Position>(tail_ - head_) == capacity())
+        {
+            grow();
+        }
+        order.level_ = this;
+        order.position_ = tail_;
+        orders_[tail_ & mask_] = &order;
+        qtys_[tail_ & mask_] = order.qty().value();
+        ++tail_;
+        ++size_;
+        qty_ += order.qty();
+        hidden_qty_ += order.hidden_qty();
+    }
+
+    // Double the capacity of the ring, keeping each order at its position.
+    void grow()
+    {
+        auto const new_capacity = orders_ ? capacity() * 2 : min_capacity;
+        auto const new_orders = static_cast<Order **>(pool_->allocate_array(new_capacity * slot_size));
+        auto const new_qtys = reinterpret_cast<Qty::value_type *>(new_orders + new_capacity);
+        auto const new_mask = new_capacity - 1;
+        for (auto position = head_; position != tail_; ++position)
+        {
+            new_orders[position & new_mask] = orders_[position & mask_];
+            new_qtys[position & new_mask] = qtys_[position & mask_];
+        }
+        if (orders_)
+        {
+            pool_->deallocate_array(orders_, capacity() * slot_size);
+        }
+        orders_ = new_orders;
+        qtys_ = new_qtys;
+        mask_ = new_mask;
+    }
+
+    Qty qty_ = Qty{};
+    Qty hidden_qty_ = Qty{};
+    Price price_ = Price{};
+    NodePool * pool_;
+    Order ** orders_ = nullptr; // Order handles, followed by qtys_ in the same array.
+    Qty::value_type * qtys_ = nullptr;
+    std::size_t mask_ = static_cast<std::size_t>(-1); // Capacity - 1.
+    Position head_ = 0; // Position of the first order.
+    Position tail_ = 0; // Position after the last order.
+    Position size_ = 0; // Number of orders, excluding holes.
+
+    // Side of the levels in which this level resides and iterator pointing to this level (if in a LevelSet).
+    // Book uses these to quickly access this instead of searching for it (O(1) instead of O(log n)).
+    friend Book;
+    template <Side> friend class LevelSet;
+    template <Side> friend class LevelLadder;
+    template <Side> friend class LevelVector;
+    template <Side Side_V>
+    struct CompareLevel
+    {
+        // Functor to compare between Level and Price types.
+        // Note: this is made an inner class because we need this definition for the Set type and members.
+        // Comparison is lhs > rhs for decreasing order (buys) and lhs < rhs for increasing order (sells),
+        // so the best level is first on both sides.
+
+        // Allow calling set functions without constructing an instance of key (heterogeneous lookup).
+        using is_transparent = void;
+
+        bool operator()(Level const & lhs, Level const & rhs) const
+        {
+            return (*this)(lhs.price(), rhs.price());
+        }
+        bool operator()(Price lhs, Level const & rhs) const
+        {
+            return (*this)(lhs, rhs.price());
+        }
+        bool operator()(Level const & lhs, Price rhs) const
+        {
+            return (*this)(lhs.price(), rhs);
+        }
+        bool operator()(Price lhs, Price rhs) const
+        {
+            return BookSide<Side_V>::is_better(lhs, rhs);
+        }
+    };
+    template <Side Side_V>
+    using Set = std::set<Level, Level::CompareLevel<Side_V>, PoolAllocator<Level>>;
+    Side side_ = Side::Invalid;
+    Set<Side::Buy>::iterator iterator_;
+
+    // Iterators of std::set do not depend on its comparator (SCARY iterators), so one member holds the iterator of
+    // either side.
+    static_assert(std::is_same<Set<Side::Buy>::iterator, Set<Side::Sell>::iterator>::value,
+        "Level sets of both sides must have the same iterator type");
+};
+
+std::ostream & operator<<(std::ostream & os, Level const & level)
+{
+    return os << level.price() << ' ' << level.qty();
+}
+
+
+// Hierarchical bitmap with one bit per index, one summary bit per 64-bit word of bits, and one top word with one bit
+// per summary word, so the next or previous set bit is found with at most three ctz/clz instructions
+// regardless of how many bits are clear between them.
+class OccupancyBitmap
+{
+public:
+    static constexpr std::size_t size = 64 * 64 * 64;
+    static constexpr std::size_t npos = size;
+
+    bool none() const noexcept { return top_ == 0; }
+
+    void set(std::size_t index) noexcept
+    {
+        assert(index < size);
+        auto const word = index / 64;
+        words_[word] |= bit(index % 64);
+        summary_[word / 64] |= bit(word % 64);
+        top_ |= bit(word / 64);
+    }
+
+    void reset(std::size_t index) noexcept
+    {
+        assert(index < size);
+        auto const word = index / 64;
+        words_[word] &= ~bit(index % 64);
+        if (words_[word] == 0)
+        {
+            summary_[word / 64] &= ~bit(word % 64);
+            if (summary_[word / 64] == 0)
+            {
+                top_ &= ~bit(word / 64);
+            }
+        }
+    }
+
+    // Clear only the words with set bits.
+    void clear() noexcept
+    {
+        for (auto top = top_; top != 0; top &= top - 1)
+        {
+            auto const summary = lsb(top);
+            for (auto bits = summary_[summary]; bits != 0; bits &= bits - 1)
+            {
+                words_[summary * 64 + lsb(bits)] = 0;
+            }
+            summary_[summary] = 0;
+        }
+        top_ = 0;
+    }
+
+    // Lowest set index at or above index or npos if none.
+    std::size_t next(std::size_t index) const noexcept
+    {
+        if (index >= size)
+        {
+            return npos;
+        }
+        auto word = index / 64;
+        auto bits = words_[word] & at_or_above(index % 64);
+        if (bits == 0)
+        {
+            auto summary = word / 64;
+            auto summary_bits = summary_[summary] & at_or_above(word % 64 + 1);
+            if (summary_bits == 0)
+            {
+                auto const top_bits = top_ & at_or_above(summary + 1);
+                if (top_bits == 0)
+                {
+                    return npos;
+                }
+                summary = lsb(top_bits);
+                summary_bits = summary_[summary];
+            }
+            word = summary * 64 + lsb(summary_bits);
+            bits = words_[word];
+        }
+        return word * 64 + lsb(bits);
+    }
+
+    // Highest set index at or below index or npos if none.
+    std::size_t prev(std::size_t index) const noexcept
+    {
+        if (index >= size)
+        {
+            index = size - 1;
+        }
+        auto word = index / 64;
+        auto bits = words_[word] & at_or_below(index % 64);
+        if (bits == 0)
+        {
+            auto summary = word / 64;
+            auto summary_bits = word % 64 == 0 ? 0 : summary_[summary] & at_or_below(word % 64 - 1);
+            if (summary_bits == 0)
+            {
+                auto const top_bits = summary == 0 ? 0 : top_ & at_or_below(summary - 1);
+                if (top_bits == 0)
+                {
+                    return npos;
+                }
+                summary = msb(top_bits);
+                summary_bits = summary_[summary];
+            }
+            word = summary * 64 + msb(summary_bits);
+            bits = words_[word];
+        }
+        return word * 64 + msb(bits);
+    }
+
+private:
+    static std::uint64_t bit(std::size_t index) noexcept { return std::uint64_t{1} << index; }
+    static std::uint64_t at_or_above(std::size_t index) noexcept { return index < 64 ? ~std::uint64_t{0} << index : 0; }
+    static std::uint64_t at_or_below(std::size_t index) noexcept { return index < 63 ? bit(index + 1) - 1 : ~std::uint64_t{0}; }
+    static std::size_t lsb(std::uint64_t bits) noexcept { return static_cast<std::size_t>(__builtin_ctzll(bits)); }
+    static std::size_t msb(std::uint64_t bits) noexcept { return 63 - static_cast<std::size_t>(__builtin_clzll(bits)); }
+
+    std::uint64_t top_ = 0;
+    std::uint64_t summary_[size / 64 / 64] = {};
+    std::uint64_t words_[size / 64] = {};
+};
+
+
+#if defined(USE_LEVEL_LADDER)
+// Levels of one side in an array indexed by price (a price ladder) over a window of OccupancyBitmap::size prices,
+// so a level is found in O(1) without comparing prices, and the next worse level is found with the occupancy bitmap
+// in O(1) without scanning the empty prices in between, however sparse the book is.
+// The window moves to include a price outside of it if all levels still fit in it (O(levels), which is rare since
+// prices stay near each other), otherwise inserting the level throws std::length_error.
+// Levels are allocated from the pool like the nodes of a LevelSet.
+// Each side's ladder uses OccupancyBitmap::size pointers (2 MiB) and the bitmap (33 KiB) regardless of book size.
+template <Side Side_V>
+class LevelLadder
+{
+public:
+    static constexpr std::size_t npos = OccupancyBitmap::npos;
+
+    // Bidirectional iterator over the levels from the best to the worst price.
+    template <typename Level_T>
+    class Iterator
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = Level;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Level_T *;
+        using reference = Level_T &;
+
+        Iterator() = default;
+
+        Iterator(LevelLadder const & ladder, std::size_t index)
+            : ladder_{&ladder}
+            , index_{index}
+        {
+        }
+
+        reference operator*() const { return *ladder_->slots_[index_]; }
+        pointer operator->() const { return &**this; }
+
+        Iterator & operator++() { index_ = ladder_->worse(index_); return *this; }
+        Iterator & operator--() { index_ = index_ == npos ? ladder_->worst() : ladder_->better(index_); return *this; }
+        Iterator operator++(int) { auto iter = *this; ++*this; return iter; }
+        Iterator operator--(int) { auto iter = *this; --*this; return iter; }
+
+        bool operator==(Iterator const & rhs) const { return index_ == rhs.index_; }
+        bool operator!=(Iterator const & rhs) const { return not (*this == rhs); }
+
+    private:
+        LevelLadder const * ladder_ = nullptr;
+        std::size_t index_ = npos;
+    };
+    using iterator = Iterator<Level>;
+    using const_iterator = Iterator<Level const>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    static char const * name() { return "LevelLadder"; }
+
+    explicit LevelLadder(NodePool & pool)
+        : pool_{&pool}
+        , slots_(OccupancyBitmap::size, nullptr)
+    {
+    }
+
+    LevelLadder(LevelLadder const &) = delete;
+    LevelLadder & operator=(LevelLadder const &) = delete;
+
+    ~LevelLadder()
+    {
+        clear();
+    }
+
+    static constexpr Side side() noexcept { return Side_V; }
+    bool empty() const noexcept { return size_ == 0; }
+    std::size_t size() const noexcept { return size_; }
+
+    // Best level or nullptr if empty.
+    Level const * best() const { return empty() ? nullptr : slots_[best_index()]; }
+
+    iterator begin() { return iterator{*this, best_index()}; }
+    iterator end() { return iterator{*this, npos}; }
+    const_iterator begin() const { return const_iterator{*this, best_index()}; }
+    const_iterator end() const { return const_iterator{*this, npos}; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    // Worst level first.
+    const_reverse_iterator rbegin() const { return const_reverse_iterator{end()}; }
+    const_reverse_iterator rend() const { return const_reverse_iterator{begin()}; }
+
+    // First level at or worse than price and first level worse than price.
+    iterator lower_bound(Price price) { return iterator{*this, at_or_worse(price.value())}; }
+    iterator upper_bound(Price price) { return iterator{*this, worse_than(price.value())}; }
+    const_iterator lower_bound(Price price) const { return const_iterator{*this, at_or_worse(price.value())}; }
+    const_iterator upper_bound(Price price) const { return const_iterator{*this, worse_than(price.value())}; }
+
+    // Level with price, inserting it if it does not exist.
+    Level & insert(Price price, bool & is_created)
+    {
+        if (price.value() < base_ or price.value() - base_ >= OccupancyBitmap::size)
+        {
+            move_window(price.value());
+        }
+        auto const index = static_cast<std::size_t>(price.value() - base_);
+        auto && slot = slots_[index];
+        is_created = not slot;
+        if (is_created)
+        {
+            slot = new (PoolAllocator<Level>{*pool_}.allocate(1)) Level{price, *pool_};
+            slot->side_ = Side_V;
+            occupied_.set(index);
+            ++size_;
+        }
+        return *slot;
+    }
+
+    void erase(Level & level)
+    {
+        assert(level.side_ == Side_V);
+        auto const index = static_cast<std::size_t>(level.price().value() - base_);
+        assert(slots_[index] == &level);
+        slots_[index] = nullptr;
+        occupied_.reset(index);
+        --size_;
+        destroy(level);
+    }
+
+    void clear()
+    {
+        for (auto index = occupied_.next(0); index != npos; index = occupied_.next(index + 1))
+        {
+            destroy(*slots_[index]);
+            slots_[index] = nullptr;
+        }
+        occupied_.clear();
+        size_ = 0;
+    }
+
+    // Forget all levels without destroying them after the pool they were allocated from was reset.
+    // Only the occupied slots are cleared, so this is O(levels) instead of O(prices in the window).
+    void release()
+    {
+        for (auto index = occupied_.next(0); index != npos; index = occupied_.next(index + 1))
+        {
+            slots_[index] = nullptr;
+        }
+        occupied_.clear();
+        size_ = 0;
+    }
+
+private:
+    // Slots are allocated from the heap instead of the pool, so they are kept when the pool is reset.
+    using Slots = std::vector<Level *>;
+
+    // Occupied indexes from best to worst are in decreasing order for buys and increasing order for sells.
+    std::size_t best_index() const noexcept
+    {
+        return Side_V == Side::Buy ? occupied_.prev(npos) : occupied_.next(0);
+    }
+
+    std::size_t worst() const noexcept
+    {
+        return Side_V == Side::Buy ? occupied_.next(0) : occupied_.prev(npos);
+    }
+
+    std::size_t worse(std::size_t index) const noexcept
+    {
+        return Side_V == Side::Buy ? (index == 0 ? npos : occupied_.prev(index - 1)) : occupied_.next(index + 1);
+    }
+
+    std::size_t better(std::size_t index) const noexcept
+    {
+        return Side_V == Side::Buy ? occupied_.next(index + 1) : (index == 0 ? npos : occupied_.prev(index - 1));
+    }
+
+    std::size_t at_or_worse(Price::value_type price) const noexcept
+    {
+        if (price < base_)
+        {
+            return Side_V == Side::Buy ? npos : best_index();
+        }
+        if (price - base_ >= OccupancyBitmap::size)
+        {
+            return Side_V == Side::Buy ? best_index() : npos;
+        }
+        auto const index = static_cast<std::size_t>(price - base_);
+        return Side_V == Side::Buy ? occupied_.prev(index) : occupied_.next(index);
+    }
+
+    std::size_t worse_than(Price::value_type price) const noexcept
+    {
+        if (Side_V == Side::Buy)
+        {
+            return price == 0 ? npos : at_or_worse(price - 1);
+        }
+        return price == std::numeric_limits<Price::value_type>::max() ? npos : at_or_worse(price + 1);
+    }
+
+    // Move the window to include price, centering the levels and price in it.
+    void move_window(Price::value_type price)
+    {
+        Price::value_type const window = OccupancyBitmap::size;
+        if (empty())
+        {
+            base_ = price > window / 2 ? price - window / 2 : 0;
+            return;
+        }
+
+        auto const low = std::min(price, static_cast<Price::value_type>(base_ + occupied_.next(0)));
+        auto const high = std::max(price, static_cast<Price::value_type>(base_ + occupied_.prev(npos)));
+        if (high - low >= window)
+        {
+            throw std::length_error{"Price range of levels is too wide for the level ladder"};
+        }
+        auto const margin = (window - 1 - (high - low)) / 2;
+
+        std::vector<Level *> levels;
+        levels.reserve(size_);
+        for (auto index = occupied_.next(0); index != npos; index = occupied_.next(index + 1))
+        {
+            levels.push_back(slots_[index]);
+            slots_[index] = nullptr;
+        }
+        occupied_.clear();
+        base_ = low > margin ? low - margin : 0;
+        for (auto && level : levels)
+        {
+            auto const index = static_cast<std::size_t>(level->price().value() - base_);
+            slots_[index] = level;
+            occupied_.set(index);
+        }
+    }
+
+    void destroy(Level & level)
+    {
+        level.~Level();
+        PoolAllocator<Level>{*pool_}.deallocate(&level, 1);
+    }
+
+    NodePool * pool_;
+    Slots slots_;
+    OccupancyBitmap occupied_;
+    Price::value_type base_ = 0; // Price of the first slot.
+    std::size_t size_ = 0;
+};
+#elif defined(USE_LEVEL_VECTOR)
+// Levels of one side in a contiguous vector of (price, level) entries sorted from the worst to the best price,
+// so the best level is at the back. Adding or erasing a level at the top of the book, which is where most levels
+// come and go, is an O(1) push or pop, and a deeper level is found by a binary search over contiguous prices and
+// inserted or erased by moving the entries behind it. Best for shallow books, where no pointers are chased.
+// Levels are allocated from the pool, so their addresses stay valid when entries move.
+template <Side Side_V>
+class LevelVector
+{
+    struct Entry
+    {
+        Price price;
+        Level * level;
+    };
+    // Entries are allocated from the heap instead of the pool, so they are kept when the pool is reset.
+    using Entries = std::vector<Entry>;
+
+public:
+    // Bidirectional iterator over the levels from the best to the worst price.
+    template <typename Level_T>
+    class Iterator
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = Level;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Level_T *;
+        using reference = Level_T &;
+
+        Iterator() = default;
+
+        explicit Iterator(typename Entries::const_reverse_iterator iter)
+            : iter_{iter}
+        {
+        }
+
+        reference operator*() const { return *iter_->level; }
+        pointer operator->() const { return &**this; }
+
+        Iterator & operator++() { ++iter_; return *this; }
+        Iterator & operator--() { --iter_; return *this; }
+        Iterator operator++(int) { auto iter = *this; ++iter_; return iter; }
+        Iterator operator--(int) { auto iter = *this; --iter_; return iter; }
+
+        bool operator==(Iterator const & rhs) const { return iter_ == rhs.iter_; }
+        bool operator!=(Iterator const & rhs) const { return not (*this == rhs); }
+
+    private:
+        typename Entries::const_reverse_iterator iter_;
+    };
+    using iterator = Iterator<Level>;
+    using const_iterator = Iterator<Level const>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    static char const * name() { return "LevelVector"; }
+
+    explicit LevelVector(NodePool & pool)
+        : pool_{&pool}
+    {
+        entries_.reserve(64);
+    }
+
+    LevelVector(LevelVector const &) = delete;
+    LevelVector & operator=(LevelVector const &) = delete;
+
+    ~LevelVector()
+    {
+        clear();
+    }
+
+    static constexpr Side side() noexcept { return Side_V; }
+    bool empty() const noexcept { return entries_.empty(); }
+    std::size_t size() const noexcept { return entries_.size(); }
+
+    // Best level or nullptr if empty.
+    Level const * best() const { return empty() ? nullptr : entries_.back().level; }
+
+    iterator begin() { return iterator{entries_.crbegin()}; }
+    iterator end() { return iterator{entries_.crend()}; }
+    const_iterator begin() const { return const_iterator{entries_.crbegin()}; }
+    const_iterator end() const { return const_iterator{entries_.crend()}; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    // Worst level first.
+    const_reverse_iterator rbegin() const { return const_reverse_iterator{end()}; }
+    const_reverse_iterator rend() const { return const_reverse_iterator{begin()}; }
+
+    // First level at or worse than price and first level worse than price.
+    // The entries worse than price are a prefix of the vector, so the first of them from the back ends the prefix.
+    iterator lower_bound(Price price) { return iterator{typename Entries::const_reverse_iterator{first_better(price)}}; }
+    iterator upper_bound(Price price)
+    {
+        return iterator{typename Entries::const_reverse_iterator{first_at_or_better(price)}};
+    }
+    const_iterator lower_bound(Price price) const
+    {
+        return const_iterator{typename Entries::const_reverse_iterator{first_better(price)}};
+    }
+    const_iterator upper_bound(Price price) const
+    {
+        return const_iterator{typename Entries::const_reverse_iterator{first_at_or_better(price)}};
+    }
+
+    // Level with price, inserting it if it does not exist.
+    Level & insert(Price price, bool & is_created)
+    {
+        // Check the back first since most levels are added at the top of the book.
+        auto iter = entries_.empty() or BookSide<Side_V>::is_better(price, entries_.back().price)
+            ? entries_.cend()
+            : first_at_or_better(price);
+        is_created = iter == entries_.cend() or iter->price != price;
+        if (not is_created)
+        {
+            return *iter->level;
+        }
+
+        auto level = new (PoolAllocator<Level>{*pool_}.allocate(1)) Level{price, *pool_};
+        level->side_ = Side_V;
+        entries_.insert(iter, Entry{price, level});
+        return *level;
+    }
+
+    void erase(Level & level)
+    {
+        assert(level.side_ == Side_V);
+        if (entries_.back().level == &level)
+        {
+            entries_.pop_back();
+        }
+        else
+        {
+            auto iter = first_at_or_better(level.price());
+            assert(iter != entries_.cend() and iter->level == &level);
+            entries_.erase(iter);
+        }
+        destroy(level);
+    }
+
+    void clear()
+    {
+        for (auto && entry : entries_)
+        {
+            destroy(*entry.level);
+        }
+        entries_.clear();
+    }
+
+    // Forget all levels without destroying them after the pool they were allocated from was reset.
+    void release()
+    {
+        entries_.clear();
+    }
+
+private:
+    typename Entries::const_iterator first_at_or_better(Price price) const
+    {
+        return std::lower_bound(entries_.cbegin(), entries_.cend(), price,
+            [](Entry const & entry, Price price)
+            {
+                return BookSide<Side_V>::is_better(price, entry.price);
+            });
+    }
+
+    typename Entries::const_iterator first_better(Price price) const
+    {
+        return std::upper_bound(entries_.cbegin(), entries_.cend(), price,
+            [](Price price, Entry const & entry)
+            {
+                return BookSide<Side_V>::is_better(entry.price, price);
+            });
+    }
+
+    void destroy(Level & level)
+    {
+        level.~Level();
+        PoolAllocator<Level>{*pool_}.deallocate(&level, 1);
+    }
+
+    NodePool * pool_;
+    Entries entries_;
+};
+#else
+// Levels of one side in a balanced tree ordered by price with the best price first (highest buy or lowest sell).
+// Finding, adding, and erasing a level is O(log n), and the next worse level is one pointer chase away.
+template <Side Side_V>
+class LevelSet
+{
+    using Set = Level::Set<Side_V>;
+
+public:
+    // Bidirectional iterator over the levels from the best to the worst price.
+    template <typename Level_T>
+    class Iterator
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = Level;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Level_T *;
+        using reference = Level_T &;
+
+        Iterator() = default;
+
+        explicit Iterator(typename Set::const_iterator iter)
+            : iter_{iter}
+        {
+        }
+
+        // Note: const_cast required because std::set iter is const since could otherwise modify comparison order
+        // externally from the set. We do not modify the level price, so it is safe.
+        reference operator*() const { return const_cast<reference>(*iter_); }
+        pointer operator->() const { return &**this; }
+
+        Iterator & operator++() { ++iter_; return *this; }
+        Iterator & operator--() { --iter_; return *this; }
+        Iterator operator++(int) { auto iter = *this; ++iter_; return iter; }
+        Iterator operator--(int) { auto iter = *this; --iter_; return iter; }
+
+        bool operator==(Iterator const & rhs) const { return iter_ == rhs.iter_; }
+        bool operator!=(Iterator const & rhs) const { return not (*this == rhs); }
+
+    private:
+        typename Set::const_iterator iter_;
+    };
+    using iterator = Iterator<Level>;
+    using const_iterator = Iterator<Level const>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    static char const * name() { return "LevelSet"; }
+
+    explicit LevelSet(NodePool & pool)
+        : pool_{&pool}
+        , levels_{typename Set::allocator_type{pool}}
+    {
+    }
+
+    static constexpr Side side() noexcept { return Side_V; }
+    bool empty() const noexcept { return levels_.empty(); }
+    std::size_t size() const noexcept { return levels_.size(); }
+
+    // Best level or nullptr if empty.
+    Level const * best() const { return empty() ? nullptr : &*levels_.cbegin(); }
+
+    iterator begin() { return iterator{levels_.cbegin()}; }
+    iterator end() { return iterator{levels_.cend()}; }
+    const_iterator begin() const { return const_iterator{levels_.cbegin()}; }
+    const_iterator end() const { return const_iterator{levels_.cend()}; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    // Worst level first.
+    const_reverse_iterator rbegin() const { return const_reverse_iterator{end()}; }
+    const_reverse_iterator rend() const { return const_reverse_iterator{begin()}; }
+
+    // First level at or worse than price and first level worse than price.
+    iterator lower_bound(Price price) { return iterator{levels_.lower_bound(price)}; }
+    iterator upper_bound(Price price) { return iterator{levels_.upper_bound(price)}; }
+    const_iterator lower_bound(Price price) const { return const_iterator{levels_.lower_bound(price)}; }
+    const_iterator upper_bound(Price price) const { return const_iterator{levels_.upper_bound(price)}; }
+
+    // Level with price, inserting it if it does not exist using the search position as the hint.
+    Level & insert(Price price, bool & is_created)
+    {
+        auto level_iter = levels_.lower_bound(price);
+        is_created = level_iter == levels_.end() or level_iter->price() != price;
+        if (is_created)
+        {
+            level_iter = levels_.emplace_hint(level_iter, price, *pool_);
+
+            // Level saves its container and iterator to allow erasing using only the order ID.
+            auto && level = const_cast<Level &>(*level_iter);
+            level.side_ = Side_V;
+            level.iterator_ = level_iter;
+        }
+        return const_cast<Level &>(*level_iter);
+    }
+
+    void erase(Level & level)
+    {
+        assert(level.side_ == Side_V);
+        levels_.erase(level.iterator_);
+    }
+
+    void clear()
+    {
+        levels_.clear();
+    }
+
+    // Forget all levels without destroying them after the pool they were allocated from was reset.
+    // Note: Ending the lifetime of the set without calling its destructor is allowed since nothing depends on the
+    // side effects of the destructor, which would only free memory in the pool.
+    void release()
+    {
+        new (&levels_) Set{typename Set::allocator_type{*pool_}};
+    }
+
+private:
+    NodePool * pool_;
+    Set levels_;
+};
+#endif
+
+
+// One order of a trade with a copy of its order ID, so the trade can be written after the order is gone.
+class TradeOrder
+{
+public:
+    TradeOrder(OrderID order_id, Qty qty, Order const * order = nullptr)
+        : order_id_{std::move(order_id)}
+        , qty_{qty}
+        , order_{order}
+    {
+    }
+
+    OrderID const & order_id() const noexcept { return order_id_; }
+
+    Qty qty() const noexcept { return qty_; }
+    TradeOrder & qty(Qty q) { qty_ = q; return *this; }
+
+    // Reuse this trade order for another order, copying the order ID into the memory of the current one.
+    void assign(OrderID const & order_id, Qty qty, Order const * order = nullptr)
+    {
+        order_id_.value(order_id.value());
+        qty_ = qty;
+        order_ = order;
+    }
+
+    // Passive order in the book, which is only valid until the book fills the trade.
+    Order const * order() const noexcept { return order_; }
+
+private:
+    OrderID order_id_;
+    Qty qty_;
+    Order const * order_;
+};
+
+// Trade event from matching a passive order in the book with an incoming aggressive order.
+struct Trade
+{
+    Price passive_price;
+    TradeOrder passive_order;
+    Price aggressive_price;
+    TradeOrder aggressive_order;
+};
+
+std::ostream & operator<<(std::ostream & os, Trade const & trade)
+{
+    return os << "TRADE "
+        << trade.passive_order.order_id()
+        << ' ' << trade.passive_price
+        << ' ' << trade.passive_order.qty()
+        << ' ' << trade.aggressive_order.order_id()
+        << ' ' << trade.aggressive_price
+        << ' ' << trade.aggressive_order.qty()
+        ;
+}
+
+// Trades from handling a message. Clearing keeps the trades to reuse their order ID strings for the next trades,
+// so long order IDs are not allocated again for each trade.
+class Trades
+{
+public:
+    using iterator = std::vector<Trade>::iterator;
+    using const_iterator = std::vector<Trade>::const_iterator;
+
+    void add(Price passive_price, OrderID const & passive_order_id, Qty passive_qty, Order const * passive_order,
+        Price aggressive_price, OrderID const & aggressive_order_id, Qty aggressive_qty)
+    {
+        if (size_ == trades_.size())
+        {
+            trades_.push_back(Trade{
+                  passive_price
+                , TradeOrder{passive_order_id, passive_qty, passive_order}
+                , aggressive_price
+                , TradeOrder{aggressive_order_id, aggressive_qty}
+                });
+        }
+        else
+        {
+            auto && trade = trades_[size_];
+            trade.passive_price = passive_price;
+            trade.passive_order.assign(passive_order_id, passive_qty, passive_order);
+            trade.aggressive_price = aggressive_price;
+            trade.aggressive_order.assign(aggressive_order_id, aggressive_qty);
+        }
+        ++size_;
+    }
+
+    // Remove the trades from first to the end, keeping them for reuse.
+    void erase(iterator first, iterator last)
+    {
+        assert(last == end());
+        size_ = static_cast<std::size_t>(first - trades_.begin());
+    }
+
+    void clear() noexcept { size_ = 0; }
+    void reserve(std::size_t size) { trades_.reserve(size); }
+
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    Trade & operator[](std::size_t index) noexcept { return trades_[index]; }
+    Trade const & operator[](std::size_t index) const noexcept { return trades_[index]; }
+    Trade const & back() const noexcept { return trades_[size_ - 1]; }
+
+    iterator begin() noexcept { return trades_.begin(); }
+    iterator end() noexcept { return trades_.begin() + size_; }
+    const_iterator begin() const noexcept { return trades_.cbegin(); }
+    const_iterator end() const noexcept { return trades_.cbegin() + size_; }
+
+private:
+    std::vector<Trade> trades_;
+    std::size_t size_ = 0;
+};
+
+// Flushes once after all trades instead of after each trade.
+std::ostream & operator<<(std::ostream & os, Trades const & trades)
+{
+    for (auto && trade : trades)
+    {
+        os << trade << '\n';
+    }
+    if (not trades.empty())
+    {
+        os.flush();
+    }
+    return os;
+}
+
+
+// Level update event from adding, cancelling, modifying, or filling an order in a level.
+// The qty is the total qty of the level after the update, which is zero if the level was erased.
+struct LevelUpdate
+{
+    Side side;
+    Price price;
+    Qty qty;
+};
+
+std::ostream & operator<<(std::ostream & os, LevelUpdate const & update)
+{
+    return os << "LEVEL "
+        << update.side
+        << ' ' << update.price
+        << ' ' << update.qty
+        ;
+}
+
+using LevelUpdates = std::vector<LevelUpdate>;
+
+
+// Allocation of an aggressive order's qty among the passive orders of a level.
+enum class Allocation : char
+{
+    Fifo = 'F', // First In First Out: Orders fill in time priority.
+    ProRata = 'P', // Orders fill in proportion to their qty.
+    TopOrderProRata = 'T', // The first order in time priority fills first, then the rest fill pro-rata.
+    Invalid = '?',
+};
+
+std::ostream & operator<<(std::ostream & os, Allocation allocation)
+{
+    switch (allocation)
+    {
+        case Allocation::Fifo:
+        {
+            os << "FIFO";
+            break;
+        }
+
+        case Allocation::ProRata:
+        {
+            os << "PRO_RATA";
+            break;
+        }
+
+        case Allocation::TopOrderProRata:
+        {
+            os << "TOP_PRO_RATA";
+            break;
+        }
+
+        case Allocation::Invalid:
+        {
+            os << "INVALID";
+            break;
+        }
+    }
+    return os;
+}
+
+std::istream & operator>>(std::istream & is, Allocation & allocation)
+{
+    std::string str{};
+    is >> str;
+    if (str == "FIFO")
+    {
+        allocation = Allocation::Fifo;
+    }
+    else if (str == "PRO_RATA")
+    {
+        allocation = Allocation::ProRata;
+    }
+    else if (str == "TOP_PRO_RATA")
+    {
+        allocation = Allocation::TopOrderProRata;
+    }
+    else
+    {
+        allocation = Allocation::Invalid;
+    }
+    return is;
+}
+
+// Allocation policies match an aggressive order with the orders of one level, saving the trades.
+// Each policy implements:
+// static Qty match_level(Level const & level, OrderTable const & table, Order const * excluded_order, OrderID const & order_id, Price price, Qty leaves_qty, Trades & trades)
+// which returns the leaves_qty after matching, where excluded_order is the aggressive order itself if it rests
+// in the book (such as when modifying), which must not match with itself.
+// Policies that use the level qty set uses_level_qty, so the book only looks up the excluded order for them.
+// Order IDs are read from the table only for the orders that trade.
+
+struct FifoAllocation
+{
+    static constexpr bool uses_level_qty = false;
+
+    static Qty match_level(Level const & level, OrderTable const & table, Order const *, OrderID const & order_id,
+        Price price, Qty leaves_qty, Trades & trades)
+    {
+        // Find the orders that fill from the level's qty array first, so only the orders that trade are touched.
+        auto end = level.fill_end(leaves_qty);
+        for (auto position = level.head(); position != end; ++position)
+        {
+            auto const order_ptr = level.order_at(position);
+            if (not order_ptr)
+            {
+                continue; // Hole of a removed order.
+            }
+
+            // Prevent self-match.
+            // For example, if an order's side is modified, we do not want to match with itself
+            // if the pre-modified order is still in the book.
+            // Its qty was counted to find the end, so the orders after it may fill too.
+            auto && order = *order_ptr;
+            auto && passive_order_id = table.info(order).order_id;
+            if (order_id == passive_order_id)
+            {
+                end = level.tail();
+                continue;
+            }
+
+            Qty const matched_qty = std::min(leaves_qty, order.qty());
+
+            // Save both passive and aggressive orders that matched.
+            // Save the passive order so the book can fill it.
+            trades.add(level.price(), passive_order_id, order.qty(), &order, price, order_id, matched_qty);
+
+            leaves_qty -= matched_qty;
+            if (leaves_qty.is_zero())
+            {
+                break;
+            }
+        }
+        return leaves_qty;
+    }
+};
+
+struct ProRataAllocation
+{
+    static constexpr bool uses_level_qty = true;
+
+    static Qty match_level(Level const & level, OrderTable const & table, Order const * excluded_order,
+        OrderID const & order_id, Price price, Qty leaves_qty, Trades & trades)
+    {
+        return match_orders(level.price(), level.orders().cbegin(), level.orders().cend(),
+            level.qty() - excluded_qty(level, excluded_order), table, excluded_order, order_id, price, leaves_qty, trades);
+    }
+
+    // Displayed qty of the excluded order if it is in the level.
+    static Qty excluded_qty(Level const & level, Order const * excluded_order)
+    {
+        return excluded_order and excluded_order->level() == &level ? excluded_order->qty() : Qty{};
+    }
+
+    // Match orders in proportion to their qty, where total_qty is the sum of their qty (so the orders are not re-scanned).
+    // Each share is rounded down, and the remaining qty is then allocated one lot per order in time priority.
+    template <typename Iterator>
+    static Qty match_orders(Price level_price, Iterator begin, Iterator end, Qty total_qty, OrderTable const & table,
+        Order const * excluded_order, OrderID const & order_id, Price price, Qty leaves_qty, Trades & trades)
+    {
+        if (total_qty.is_zero() or leaves_qty.is_zero())
+        {
+            return leaves_qty;
+        }
+
+        Qty const fill_qty = std::min(leaves_qty, total_qty);
+        auto const first_trade = trades.size();
+        Qty allocated_qty{};
+        for (auto iter = begin; iter != end; ++iter)
+        {
+            auto && order = *iter;
+            if (&order == excluded_order)
+            {
+                continue;
+            }
+
+            // Use a wider type for the product to not overflow.
+            auto const share = static_cast<unsigned __int128>(order.qty().value()) * fill_qty.value() / total_qty.value();
+            Qty const matched_qty{static_cast<Qty::value_type>(share)};
+            trades.add(level_price, table.info(order).order_id, order.qty(), &order, price, order_id, matched_qty);
+            allocated_qty += matched_qty;
+        }
+
+        // The remaining qty is less than the number of orders, and each order's share is less than its qty unless all
+        // orders fill completely, so one more lot per order never overfills it.
+        for (auto index = first_trade; allocated_qty != fill_qty; ++index)
+        {
+            auto && aggressive_order = trades[index].aggressive_order;
+            aggressive_order.qty(aggressive_order.qty() + Qty{1});
+            allocated_qty += Qty{1};
+        }
+
+        // Remove orders allocated nothing.
+        trades.erase(
+            std::remove_if(trades.begin() + first_trade, trades.end(),
+                [](Trade const & trade)
+                {
+                    return trade.aggressive_order.qty().is_zero();
+                }),
+            trades.end());
+        return leaves_qty - fill_qty;
+    }
+};
+
+struct TopOrderProRataAllocation
+{
+    static constexpr bool uses_level_qty = true;
+
+    static Qty match_level(Level const & level, OrderTable const & table, Order const * excluded_order,
+        OrderID const & order_id, Price price, Qty leaves_qty, Trades & trades)
+    {
+        auto top_iter = level.orders().cbegin();
+        if (top_iter != level.orders().cend() and &*top_iter == excluded_order)
+        {
+            ++top_iter;
+        }
+        if (top_iter == level.orders().cend())
+        {
+            return leaves_qty;
+        }
+
+        auto && top_order = *top_iter;
+        Qty const matched_qty = std::min(leaves_qty, top_order.qty());
+        trades.add(level.price(), table.info(top_order).order_id, top_order.qty(), &top_order, price, order_id, matched_qty);
+        leaves_qty -= matched_qty;
+
+        Qty const total_qty = level.qty() - ProRataAllocation::excluded_qty(level, excluded_order) - top_order.qty();
+        return ProRataAllocation::match_orders(level.price(), std::next(top_iter), level.orders().cend(), total_qty,
+            table, excluded_order, order_id, price, leaves_qty, trades);
+    }
+};
+
+
+// Counters of changes to the book.
+struct BookStats
+{
+    std::uint64_t levels_created = 0;
+    std::uint64_t levels_erased = 0;
+    std::uint64_t rejects = 0; // Adding a duplicate order or cancelling or modifying an unknown order.
+    std::uint64_t peak_orders = 0; // Max number of orders in the book at once.
+};
+
+
+class Book
+{
+public:
+    explicit Book(Allocation allocation = Allocation::Fifo)
+        : allocation_{allocation}
+        , buy_levels_{pool_}
+        , sell_levels_{pool_}
+        , orders_by_id_{0, OrdersByID::hasher{}, OrdersByID::key_equal{}, OrdersByID::allocator_type{pool_}}
+        , owners_{0, Owners::hasher{}, Owners::key_equal{}, Owners::allocator_type{pool_}}
+    {
+        level_updates_.reserve(1024);
+        emptied_levels_.reserve(64);
+    }
+
+    // Levels of each side from the best price to the worst price.
+    Levels<Side::Buy> const & buy_levels() const { return buy_levels_; }
+    Levels<Side::Sell> const & sell_levels() const { return sell_levels_; }
+
+    // Best buy level (highest price) and best sell level (lowest price) or nullptr if there are no orders on that side.
+    Level const * best_buy() const { return buy_levels_.best(); }
+    Level const * best_sell() const { return sell_levels_.best(); }
+
+    // Levels updated since the last call to clear_level_updates() in the order they were updated.
+    LevelUpdates const & level_updates() const { return level_updates_; }
+    void clear_level_updates() { level_updates_.clear(); }
+
+    // Number of orders in the book.
+    std::size_t size() const noexcept { return orders_by_id_.size(); }
+
+    // Number of owners that have tagged orders since the book was last cleared.
+    std::size_t owner_count() const noexcept { return owners_.size(); }
+
+    BookStats const & stats() const noexcept { return stats_; }
+
+    Allocation allocation() const noexcept { return allocation_; }
+
+    // Allocate memory ahead for the given number of resting orders, so that adding them neither allocates nor,
+    // with MemoryOptions::prefault or lock, faults in memory (except for the memory of new levels and owners).
+    void reserve(std::size_t orders)
+    {
+        // Approximate size of a node of orders_by_id_: the value, the next pointer, and the cached hash.
+        std::size_t const order_node_size = sizeof(OrdersByID::value_type) + 2 * sizeof(void *);
+        orders_.reserve(orders);
+        orders_by_id_.reserve(orders);
+        pool_.reserve(orders * order_node_size);
+    }
+
+    // Add order, which is an iceberg order if display_qty is not zero and is tagged with owner if not empty.
+    template <Side Side_V>
+    void add(OrderID const & order_id, Qty qty, Price price, Qty display_qty = Qty{}, OrderID const & owner = OrderID{})
+    {
+        // Look up the owner only if the order is not a duplicate, so rejected orders never add owners.
+        OwnerOrders * owner_orders = nullptr;
+        if (not owner.empty() and not orders_by_id_.count(order_id))
+        {
+            has_heap_owner_ids_ = has_heap_owner_ids_ or is_heap_id(owner);
+            owner_orders = &owners_[owner];
+        }
+        add_order(order_id, qty, price, levels<Side_V>(), display_qty, owner_orders);
+    }
+
+    // Add order on a side known only at run time.
+    void add(Side side, OrderID const & order_id, Qty qty, Price price, Qty display_qty = Qty{},
+        OrderID const & owner = OrderID{})
+    {
+        switch (side)
+        {
+            case Side::Buy:
+            {
+                add<Side::Buy>(order_id, qty, price, display_qty, owner);
+                break;
+            }
+
+            case Side::Sell:
+            {
+                add<Side::Sell>(order_id, qty, price, display_qty, owner);
+                break;
+            }
+
+            case Side::Invalid:
+            {
+                break;
+            }
+        }
+    }
+
+    void cancel(OrderID const & order_id)
+    {
+        auto iter = orders_by_id_.find(order_id);
+        if (iter == orders_by_id_.end())
+        {
+            // Should not happen since implies erasing an order never added.
+            IF_DEBUG(
+                std::cerr << "Unable to cancel unknown order: " << order_id << std::endl;
+                //assert(false);
+            )
+            ++stats_.rejects;
+            return; // Ignoring for now.
+        }
+
+        // Get order and level it's contained within.
+        // Erase order from the level.
+        // Erase the level if empty.
+        auto && order = *iter->second;
+        assert(order.level_);
+        auto && level = *order.level_;
+        level.remove(order);
+        update(level);
+        if (level.empty())
+        {
+            // Erase empty level using its internally held container.
+            erase(level);
+        }
+        else
+        {
+            level.compact();
+        }
+        orders_by_id_.erase(iter);
+        release(order);
+    }
+
+    // Cancel all orders of owner for which predicate(side, price) is true, erasing emptied levels.
+    // Walks only the owner's list of orders, so the cost is O(orders of the owner), not O(orders in the book).
+    // Returns the number of orders cancelled.
+    template <typename Predicate>
+    std::size_t cancel_all(OrderID const & owner, Predicate const & predicate)
+    {
+        auto owner_iter = owners_.find(owner);
+        if (owner_iter == owners_.end())
+        {
+            return 0;
+        }
+
+        std::size_t cancelled = 0;
+        Order * next_order = owner_iter->second.head;
+        while (next_order)
+        {
+            // Save the next order first since cancelling unlinks the order and erases it.
+            auto && order = *next_order;
+            next_order = orders_.info(order).next_owned;
+
+            assert(order.level_);
+            auto && level = *order.level_;
+            if (not predicate(level.side(), level.price()))
+            {
+                continue;
+            }
+
+            orders_by_id_.erase(orders_.info(order).order_id);
+            level.remove(order);
+            release(order);
+            update(level);
+            if (level.empty())
+            {
+                erase(level);
+            }
+            else
+            {
+                level.compact();
+            }
+            ++cancelled;
+        }
+        return cancelled;
+    }
+
+    template <Side Side_V>
+    void modify(OrderID const & order_id, Qty qty, Price price)
+    {
+        auto iter = orders_by_id_.find(order_id);
+        if (iter == orders_by_id_.end())
+        {
+            // Should not happen since implies modifying an order never added.
+            IF_DEBUG(
+                std::cerr << "Unable to modify unknown order: " << order_id << std::endl;
+                //assert(false);
+            )
+            ++stats_.rejects;
+            return; // Ignoring for now.
+        }
+
+        modify_order(*iter->second, qty, price, levels<Side_V>());
+    }
+
+    void modify(Side side, OrderID const & order_id, Qty qty, Price price)
+    {
+        switch (side)
+        {
+            case Side::Buy:
+            {
+                modify<Side::Buy>(order_id, qty, price);
+                break;
+            }
+
+            case Side::Sell:
+            {
+                modify<Side::Sell>(order_id, qty, price);
+                break;
+            }
+
+            case Side::Invalid:
+            {
+                break;
+            }
+        }
+    }
+
+    // Order with the given ID or nullptr if it is not in the book.
+    Order const * find(OrderID const & order_id) const
+    {
+        auto iter = orders_by_id_.find(order_id);
+        return iter == orders_by_id_.end() ? nullptr : iter->second;
+    }
+
+    // Modify an order found with find() without looking it up again, which reuses its node like modify by ID.
+    template <Side Side_V>
+    void modify(Order const & order, Qty qty, Price price)
+    {
+        // Note: const_cast is safe since the order is in this book.
+        modify_order(const_cast<Order &>(order), qty, price, levels<Side_V>());
+    }
+
+    void modify(Order const & order, Side side, Qty qty, Price price)
+    {
+        switch (side)
+        {
+            case Side::Buy:
+            {
+                modify<Side::Buy>(order, qty, price);
+                break;
+            }
+
+            case Side::Sell:
+            {
+                modify<Side::Sell>(order, qty, price);
+                break;
+            }
+
+            case Side::Invalid:
+            {
+                break;
+            }
+        }
+    }
+
+    // Keep only the last update of each level from first_update on, in the order of the last updates,
+    // so a message that touches a level several times reports it once.
+    void coalesce_level_updates(std::size_t first_update)
+    {
+        auto const is_same_level = [](LevelUpdate const & lhs, LevelUpdate const & rhs)
+        {
+            return lhs.side == rhs.side and lhs.price == rhs.price;
+        };
+
+        // Fills update the same level consecutively, so first drop all but the last of each run of updates.
+        std::size_t size = first_update;
+        for (std::size_t index = first_update; index != level_updates_.size(); ++index)
+        {
+            if (size != first_update and is_same_level(level_updates_[size - 1], level_updates_[index]))
+            {
+                --size;
+            }
+            level_updates_[size++] = level_updates_[index];
+        }
+
+        // Then sort the remaining updates by level, keeping their time order within each level, and drop all but the
+        // last update of each level, such as a level left and re-entered, in O(n log n) for large batches.
+        update_indexes_.clear();
+        for (std::size_t index = first_update; index != size; ++index)
+        {
+            update_indexes_.push_back(index);
+        }
+        std::sort(update_indexes_.begin(), update_indexes_.end(),
+            [this](std::size_t lhs, std::size_t rhs)
+            {
+                auto && lhs_update = level_updates_[lhs];
+                auto && rhs_update = level_updates_[rhs];
+                if (lhs_update.side != rhs_update.side)
+                {
+                    return lhs_update.side < rhs_update.side;
+                }
+                if (lhs_update.price != rhs_update.price)
+                {
+                    return lhs_update.price < rhs_update.price;
+                }
+                return lhs < rhs;
+            });
+        for (std::size_t index = 0; index + 1 < update_indexes_.size(); ++index)
+        {
+            auto && update = level_updates_[update_indexes_[index]];
+            if (is_same_level(update, level_updates_[update_indexes_[index + 1]]))
+            {
+                update.side = Side::Invalid; // Superseded.
+            }
+        }
+        auto const begin = level_updates_.begin();
+        level_updates_.erase(
+            std::remove_if(begin + static_cast<std::ptrdiff_t>(first_update), begin + static_cast<std::ptrdiff_t>(size),
+                [](LevelUpdate const & update)
+                {
+                    return update.side == Side::Invalid;
+                }),
+            level_updates_.end());
+    }
+
+    // Remove all orders, such as at the end of the day when all GFD orders expire.
+    // All levels and index nodes are in the pool and all orders are in the order table, so the containers are
+    // abandoned and the pool and table are reset in O(1) instead of freeing each node (which is O(n) cache misses
+    // for millions of orders).
+    // The order table keeps the order IDs to reuse, but if any owner ID is too long for std::string's inline buffer,
+    // its heap memory must be freed, so the owners are cleared node by node first.
+    void clear()
+    {
+        stats_.levels_erased += buy_levels_.size() + sell_levels_.size();
+        if (has_heap_owner_ids_)
+        {
+            owners_.clear();
+            has_heap_owner_ids_ = false;
+        }
+
+        // Note: Ending the lifetime of the containers without calling their destructors is allowed since nothing
+        // depends on the side effects of the destructors, which would only free memory in the pool.
+        // The maps keep their bucket counts, so they reuse their bucket arrays instead of growing again.
+        auto const orders_bucket_count = orders_by_id_.bucket_count();
+        auto const owners_bucket_count = owners_.bucket_count();
+        pool_.reset();
+        orders_.reset();
+        buy_levels_.release();
+        sell_levels_.release();
+        new (&orders_by_id_) OrdersByID{orders_bucket_count, OrdersByID::hasher{}, OrdersByID::key_equal{},
+            OrdersByID::allocator_type{pool_}};
+        new (&owners_) Owners{owners_bucket_count, Owners::hasher{}, Owners::key_equal{}, Owners::allocator_type{pool_}};
+    }
+
+    // Write each order as expired, such as before clearing GFD orders at the end of the day, in one linear scan.
+    void write_expired(std::ostream & os) const
+    {
+        auto write_level = [this, &os](Level const & level)
+        {
+            for (auto && order : level.orders())
+            {
+                os << "EXPIRED " << orders_.info(order).order_id << ' ' << level.side() << ' ' << level.price() << ' '
+                    << order.total_qty() << '\n';
+            }
+        };
+        for_each_level_descending(sell_levels_, write_level);
+        for_each_level_descending(buy_levels_, write_level);
+        os.flush();
+    }
+
+    // Match order with orders in this book.
+    // The matched passive orders are filled in the book, paired with the aggressive order, and saved in the output list of trades.
+    // Returns leaves_qty, the remaining quantity left after all matching (leaves_qty >= 0).
+    template <Side Side_V>
+    Qty match(OrderID const & order_id, Qty qty, Price price, Trades & trades)
+    {
+        // Match with the opposite side, starting with its best price.
+        TRACE_EVENT(MatchBegin, qty.value());
+        constexpr Side passive_side = BookSide<Side_V>::opposite;
+        auto && passive_levels = levels<passive_side>();
+        Qty const leaves_qty = match_with_allocation<passive_side>(order_id, qty, price, passive_levels.begin(),
+            passive_levels.end(), trades,
+            [](Price order_price, Price level_price) -> bool
+            {
+                return BookSide<Side_V>::crosses(order_price, level_price);
+            });
+        TRACE_EVENT(MatchEnd, trades.size());
+        return leaves_qty;
+    }
+
+    Qty match(Side side, OrderID const & order_id, Qty qty, Price price, Trades & trades)
+    {
+        switch (side)
+        {
+            case Side::Buy:
+            {
+                return match<Side::Buy>(order_id, qty, price, trades);
+            }
+
+            case Side::Sell:
+            {
+                return match<Side::Sell>(order_id, qty, price, trades);
+            }
+
+            case Side::Invalid:
+            {
+                break;
+            }
+        }
+        return qty;
+    }
+
+    // Match market order with the best levels of the opposite side until its qty is filled.
+    // If band_ticks is not zero, only levels within band_ticks of the best price match (protected market order),
+    // which is found once by price so the levels are swept without comparing prices.
+    // Trades have the passive price as the aggressive price. Returns leaves_qty like match().
+    template <Side Side_V>
+    Qty match_market(OrderID const & order_id, Qty qty, std::uint64_t band_ticks, Trades & trades)
+    {
+        TRACE_EVENT(MatchBegin, qty.value());
+        constexpr Side passive_side = BookSide<Side_V>::opposite;
+        auto && passive_levels = levels<passive_side>();
+        auto levels_end = passive_levels.end();
+        if (band_ticks != 0 and not passive_levels.empty())
+        {
+            levels_end = passive_levels.upper_bound(
+                BookSide<passive_side>::worse_by(passive_levels.best()->price(), band_ticks));
+        }
+        Qty const leaves_qty = match_with_allocation<passive_side>(order_id, qty, Price{}, passive_levels.begin(),
+            levels_end, trades,
+            [](Price, Price) -> bool
+            {
+                return true;
+            });
+        TRACE_EVENT(MatchEnd, trades.size());
+        return leaves_qty;
+    }
+
+    Qty match_market(Side side, OrderID const & order_id, Qty qty, std::uint64_t band_ticks, Trades & trades)
+    {
+        switch (side)
+        {
+            case Side::Buy:
+            {
+                return match_market<Side::Buy>(order_id, qty, band_ticks, trades);
+            }
+
+            case Side::Sell:
+            {
+                return match_market<Side::Sell>(order_id, qty, band_ticks, trades);
+            }
+
+            case Side::Invalid:
+            {
+                break;
+            }
+        }
+        return qty;
+    }
+
+    // Qty of the opposite side that an order at price could match immediately, up to max_qty.
+    // Only sums the displayed and hidden qty of each crossing level without touching orders and stops once max_qty is reached,
+    // so it is O(crossing levels) at worst.
+    template <Side Side_V>
+    Qty executable_qty(Price price, Qty max_qty) const
+    {
+        Qty qty{};
+        auto && passive_levels = levels<BookSide<Side_V>::opposite>();
+        for (auto iter = passive_levels.cbegin(); iter != passive_levels.cend() and qty < max_qty; ++iter)
+        {
+            if (not BookSide<Side_V>::crosses(price, iter->price()))
+            {
+                break;
+            }
+            qty += iter->qty() + iter->hidden_qty();
+        }
+        return std::min(qty, max_qty);
+    }
+
+    Qty executable_qty(Side side, Price price, Qty max_qty) const
+    {
+        switch (side)
+        {
+            case Side::Buy:
+            {
+                return executable_qty<Side::Buy>(price, max_qty);
+            }
+
+            case Side::Sell:
+            {
+                return executable_qty<Side::Sell>(price, max_qty);
+            }
+
+            case Side::Invalid:
+            {
+                break;
+            }
+        }
+        return Qty{};
+    }
+
+    // Uncross the book at the equilibrium price, such as at the end of an auction call phase.
+    // The equilibrium price maximizes the executable qty, then minimizes the imbalance between the buy and sell qty
+    // executable at that price, then is closest to the reference price (or the middle of the crossed prices if zero).
+    // All trades execute at the equilibrium price in price-time priority on both sides, where each trade saves the
+    // sell order as the passive order and the buy order as the aggressive order.
+    // Iceberg orders take part with their total qty, including hidden qty.
+    // Returns the equilibrium price or zero if the book is not crossed.
+    Price uncross(Price reference_price, Trades & trades)
+    {
+        auto const buy_level = best_buy();
+        auto const sell_level = best_sell();
+        if (not buy_level or not sell_level or buy_level->price() < sell_level->price())
+        {
+            return Price{};
+        }
+
+        TRACE_EVENT(MatchBegin, 0);
+        Price const low_price = sell_level->price();
+        Price const high_price = buy_level->price();
+        if (reference_price.is_zero())
+        {
+            reference_price = Price{low_price.value() + (high_price.value() - low_price.value()) / 2};
+        }
+
+        // Only levels priced within [low_price, high_price] can execute.
+        // Total the buy qty that can execute, which is the buy qty at or above the lowest crossed price.
+        Qty buy_qty{};
+        auto buy_end = buy_levels_.cbegin();
+        for (; buy_end != buy_levels_.cend() and buy_end->price() >= low_price; ++buy_end)
+        {
+            buy_qty += buy_end->qty() + buy_end->hidden_qty();
+        }
+
+        // Sweep the crossed prices of both sides in increasing order, keeping the cumulative buy qty at or above the
+        // price and the cumulative sell qty at or below the price.
+        Price equilibrium_price{};
+        Qty equilibrium_qty{};
+        Qty equilibrium_imbalance{};
+        Price::value_type equilibrium_distance = 0;
+        Qty sell_qty{};
+        auto buy_iter = Levels<Side::Buy>::const_reverse_iterator{buy_end};
+        auto sell_iter = sell_levels_.cbegin();
+        while (true)
+        {
+            bool const has_buy = buy_iter != buy_levels_.rend();
+            bool const has_sell = sell_iter != sell_levels_.cend() and sell_iter->price() <= high_price;
+            if (not has_buy and not has_sell)
+            {
+                break;
+            }
+
+            Price const price = not has_sell or (has_buy and buy_iter->price() < sell_iter->price())
+                ? buy_iter->price()
+                : sell_iter->price();
+            if (has_sell and sell_iter->price() == price)
+            {
+                sell_qty += sell_iter->qty() + sell_iter->hidden_qty();
+                ++sell_iter;
+            }
+
+            Qty const qty = std::min(buy_qty, sell_qty);
+            Qty const imbalance = buy_qty > sell_qty ? buy_qty - sell_qty : sell_qty - buy_qty;
+            auto const distance = price > reference_price
+                ? price.value() - reference_price.value()
+                : reference_price.value() - price.value();
+            if (equilibrium_price.is_zero()
+                or qty > equilibrium_qty
+                or (qty == equilibrium_qty and imbalance < equilibrium_imbalance)
+                or (qty == equilibrium_qty and imbalance == equilibrium_imbalance and distance < equilibrium_distance))
+            {
+                equilibrium_price = price;
+                equilibrium_qty = qty;
+                equilibrium_imbalance = imbalance;
+                equilibrium_distance = distance;
+            }
+
+            // Buys at this price do not execute at any higher price.
+            if (has_buy and buy_iter->price() == price)
+            {
+                buy_qty -= buy_iter->qty() + buy_iter->hidden_qty();
+                ++buy_iter;
+            }
+        }
+
+        // Pair the orders of both sides in priority order until the equilibrium qty is exhausted.
+        Qty leaves_qty = equilibrium_qty;
+        auto buy_level_iter = buy_levels_.cbegin();
+        auto buy_order_iter = buy_level_iter->orders().cbegin();
+        Qty buy_leaves_qty = buy_order_iter->total_qty();
+        auto sell_level_iter = sell_levels_.cbegin();
+        auto sell_order_iter = sell_level_iter->orders().cbegin();
+        Qty sell_leaves_qty = sell_order_iter->total_qty();
+        while (not leaves_qty.is_zero())
+        {
+            Qty const matched_qty = std::min(leaves_qty, std::min(buy_leaves_qty, sell_leaves_qty));
+            trades.add(equilibrium_price, orders_.info(*sell_order_iter).order_id, matched_qty, nullptr,
+                equilibrium_price, orders_.info(*buy_order_iter).order_id, matched_qty);
+
+            leaves_qty -= matched_qty;
+            buy_leaves_qty -= matched_qty;
+            sell_leaves_qty -= matched_qty;
+            if (leaves_qty.is_zero())
+            {
+                break;
+            }
+            if (buy_leaves_qty.is_zero())
+            {
+                if (++buy_order_iter == buy_level_iter->orders().cend())
+                {
+                    ++buy_level_iter;
+                    buy_order_iter = buy_level_iter->orders().cbegin();
+                }
+                buy_leaves_qty = buy_order_iter->total_qty();
+            }
+            if (sell_leaves_qty.is_zero())
+            {
+                if (++sell_order_iter == sell_level_iter->orders().cend())
+                {
+                    ++sell_level_iter;
+                    sell_order_iter = sell_level_iter->orders().cbegin();
+                }
+                sell_leaves_qty = sell_order_iter->total_qty();
+            }
+        }
+        TRACE_EVENT(MatchEnd, trades.size());
+
+        // Fill the same orders, which are at the front of each side.
+        TRACE_EVENT(FillBegin, trades.size());
+        fill_front(buy_levels_, equilibrium_qty);
+        fill_front(sell_levels_, equilibrium_qty);
+        TRACE_EVENT(FillEnd, trades.size());
+        return equilibrium_price;
+    }
+
+    // Write all orders in the book.
+    void write_orders(std::ostream & os) const
+    {
+        auto write_level = [this, &os](Level const & level)
+        {
+            level.write_orders(os, orders_);
+            os << '\n';
+        };
+
+        os << "SELL:\n";
+        for_each_level_descending(sell_levels_, write_level);
+
+        os << "BUY:\n";
+        for_each_level_descending(buy_levels_, write_level);
+
+        os << std::endl;
+    }
+
+    // Call function with each level from the highest price to the lowest price, which is the order the book is written.
+    template <typename Levels_T, typename Function>
+    static void for_each_level_descending(Levels_T const & levels, Function const & function)
+    {
+        if (Levels_T::side() == Side::Buy)
+        {
+            for (auto && level : levels)
+            {
+                function(level);
+            }
+            return;
+        }
+        for (auto iter = levels.rbegin(); iter != levels.rend(); ++iter)
+        {
+            function(*iter);
+        }
+    }
+
+protected:
+    // Levels of each side selected at compile time.
+    template <Side Side_V>
+    Levels<Side_V> & levels() noexcept { return levels(BookSide<Side_V>{}); }
+    template <Side Side_V>
+    Levels<Side_V> const & levels() const noexcept { return const_cast<Book &>(*this).levels(BookSide<Side_V>{}); }
+    Levels<Side::Buy> & levels(BookSide<Side::Buy>) noexcept { return buy_levels_; }
+    Levels<Side::Sell> & levels(BookSide<Side::Sell>) noexcept { return sell_levels_; }
+
+    template <typename Levels_T>
+    void add_order(OrderID const & order_id, Qty qty, Price price, Levels_T & levels, Qty display_qty,
+        OwnerOrders * owner_orders)
+    {
+        if (orders_by_id_.count(order_id))
+        {
+            IF_DEBUG(
+                std::cerr << "Unable to add duplicate order: " << order_id << std::endl;
+                //assert(false);
+            )
+            ++stats_.rejects;
+            return;
+        }
+
+        // Search for level with given price, inserting it if it does not exist.
+        bool is_created = false;
+        Level & level = levels.insert(price, is_created);
+        if (is_created)
+        {
+            ++stats_.levels_created;
+        }
+
+        // Add order to the level and map, which refers to the order ID in the order's cold info.
+        auto && order = orders_.allocate(order_id, display_qty);
+        level.add(order, qty, display_qty);
+        if (owner_orders)
+        {
+            owner_orders->link(orders_, order);
+        }
+        orders_by_id_.emplace(orders_.info(order).order_id, &order);
+        stats_.peak_orders = std::max<std::uint64_t>(stats_.peak_orders, orders_by_id_.size());
+        update(level);
+    }
+
+    template <typename Levels_T>
+    void modify_order(Order & order, Qty qty, Price price, Levels_T & levels)
+    {
+        // Get the level the order is contained within.
+        // Note: A Level holds the side of the levels it is within, so if it differs from the side of levels,
+        // then the side was modified.
+        assert(order.level_);
+        auto && level = *order.level_;
+        if (level.side_ == Levels_T::side() and level.price() == price)
+        {
+            if (qty == order.total_qty())
+            {
+                return; // No change.
+            }
+
+            // Modify qty such that order loses queue position.
+            // Should order lose position if new qty is less than original qty?
+            level.modify(order, qty, orders_.info(order).display_qty);
+            level.compact();
+            update(level);
+        }
+        else // New side or price
+        {
+//#define USE_CANCEL_ADD_FOR_MODIFY
+#ifdef USE_CANCEL_ADD_FOR_MODIFY
+            // If modifying the side or price, we effectively have a new order,
+            // so cancel old order and add new order.
+            auto && info = orders_.info(order);
+            OrderID const order_id = info.order_id;
+            Qty const display_qty = info.display_qty;
+            OwnerOrders * const owner_orders = info.owner;
+            cancel(order_id);
+            add_order(order_id, qty, price, levels, display_qty, owner_orders);
+#else
+            // Transfer order to new price level by moving only its handle.
+            // This should be more efficient than cancel-add since the order is not reallocated.
+            // Search for level with given price on the new side, inserting it if it does not exist.
+            bool is_created = false;
+            Level & new_level = levels.insert(price, is_created);
+            if (is_created)
+            {
+                ++stats_.levels_created;
+            }
+
+            // Remove order from old level, removing the level if empty.
+            // Finally, set new order qty and transfer order to end of new level.
+            level.remove(order);
+            update(level);
+            if (level.empty())
+            {
+                erase(level);
+            }
+            else
+            {
+                level.compact();
+            }
+            order.total_qty(qty, orders_.info(order).display_qty);
+            new_level.push_back(order);
+            update(new_level);
+#endif // USE_CANCEL_ADD_FOR_MODIFY
+        }
+    }
+
+    // Match and fill order with orders in the level range of the passive side using the book's allocation policy.
+    // Selects the allocation once per order, so the level-matching loop of each policy is compiled separately.
+    template <Side Side_V, typename Iterator, typename MatchPredicate>
+    Qty match_with_allocation(
+          OrderID const & order_id
+        , Qty qty
+        , Price price
+        , Iterator levels_begin
+        , Iterator levels_end
+        , Trades & trades
+        , MatchPredicate const & match_predicate
+        )
+    {
+        switch (allocation_)
+        {
+            case Allocation::Fifo:
+            {
+                return match_levels<FifoAllocation, Side_V>(order_id, qty, price, levels_begin, levels_end, trades,
+                    match_predicate);
+            }
+
+            case Allocation::ProRata:
+            {
+                return match_levels<ProRataAllocation, Side_V>(order_id, qty, price, levels_begin, levels_end, trades,
+                    match_predicate);
+            }
+
+            case Allocation::TopOrderProRata:
+            {
+                return match_levels<TopOrderProRataAllocation, Side_V>(order_id, qty, price, levels_begin, levels_end, trades,
+                    match_predicate);
+            }
+
+            case Allocation::Invalid:
+            {
+                break;
+            }
+        }
+        return qty;
+    }
+
+    // Match order with orders in this level set using the allocation policy for each level.
+    // Fills each level right after matching it while its orders are still in cache (fused match and fill).
+    // Emptied levels are erased after all matching so the level iterators stay valid.
+    // The comparison function returns true if the order price matches the level price.
+    // A zero price is a market order, which trades at the passive price.
+    template <typename Allocation_T, Side Side_V, typename Iterator, typename MatchPredicate>
+    Qty match_levels(
+          OrderID const & order_id
+        , Qty qty
+        , Price price
+        , Iterator levels_begin
+        , Iterator levels_end
+        , Trades & trades
+        , MatchPredicate const & match_predicate
+        )
+    {
+        // Find the order itself if it rests in the book to exclude its qty from the level qty.
+        Order const * excluded_order = nullptr;
+        if (Allocation_T::uses_level_qty)
+        {
+            auto iter = orders_by_id_.find(order_id);
+            if (iter != orders_by_id_.end())
+            {
+                excluded_order = iter->second;
+            }
+        }
+
+        Qty leaves_qty = qty;
+        for (Iterator iter = levels_begin; iter != levels_end; ++iter)
+        {
+            auto && level = *iter;
+            if (not match_predicate(price, level.price()))
+            {
+                break;
+            }
+
+            Price const aggressive_price = price.is_zero() ? level.price() : price;
+
+            // Match the level again while icebergs replenish since their new displayed qty is queued at the level tail
+            // after all other orders, which must then have fully filled.
+            bool is_replenished = true;
+            while (is_replenished and not leaves_qty.is_zero())
+            {
+                auto const first_trade = trades.size();
+                leaves_qty = Allocation_T::match_level(level, orders_, excluded_order, order_id, aggressive_price,
+                    leaves_qty, trades);
+
+                TRACE_EVENT(FillBegin, trades.size() - first_trade);
+                is_replenished = fill_orders(level, trades, first_trade);
+                TRACE_EVENT(FillEnd, trades.size() - first_trade);
+            }
+            if (leaves_qty.is_zero())
+            {
+                break;
+            }
+        }
+
+        for (auto && level : emptied_levels_)
+        {
+            erase<Side_V>(*level);
+        }
+        emptied_levels_.clear();
+        return leaves_qty;
+    }
+
+    // Cancel fully filled orders and modify qty of partially filled orders of the trades in the level from first_trade.
+    // Fully filled iceberg orders with hidden qty are replenished instead of cancelled, without looking up the order ID.
+    // An emptied level is saved to erase later. Returns true if any iceberg order was replenished.
+    bool fill_orders(Level & level, Trades & trades, std::size_t first_trade)
+    {
+        bool is_replenished = false;
+        for (auto index = first_trade; index != trades.size(); ++index)
+        {
+            // Note: const_cast is safe since the passive order is in this book.
+            auto && trade = trades[index];
+            auto && order = const_cast<Order &>(*trade.passive_order.order());
+            auto leaves_qty = trade.passive_order.qty() - trade.aggressive_order.qty();
+            if (leaves_qty.is_zero() and not order.hidden_qty().is_zero())
+            {
+                level.replenish(order, orders_.info(order).display_qty);
+                is_replenished = true;
+            }
+            else if (leaves_qty.is_zero())
+            {
+                orders_by_id_.erase(trade.passive_order.order_id());
+                level.remove(order);
+                release(order);
+            }
+            else
+            {
+                level.modify_qty(order, leaves_qty);
+
+                // Require the passive order's qty to always be equal to the aggressive order's qty for output.
+                trade.passive_order.qty(trade.aggressive_order.qty());
+            }
+            update(level);
+        }
+
+        if (level.empty())
+        {
+            emptied_levels_.push_back(&level);
+        }
+        return is_replenished;
+    }
+
+    // Fill qty from the orders with the highest priority on the side, including the hidden qty of iceberg orders,
+    // cancelling fully filled orders and modifying the qty of the last order if partially filled.
+    template <typename Levels_T>
+    void fill_front(Levels_T & levels, Qty qty)
+    {
+        while (not qty.is_zero())
+        {
+            auto && level = *levels.begin();
+            auto && order = *level.order_at(level.head());
+            if (order.total_qty() <= qty)
+            {
+                qty -= order.total_qty();
+                cancel(orders_.info(order).order_id);
+            }
+            else
+            {
+                level.modify_total_qty(order, order.total_qty() - qty, orders_.info(order).display_qty);
+                update(level);
+                qty = Qty{};
+            }
+        }
+    }
+
+    // True if the ID's storage is on the heap instead of in std::string's inline buffer.
+    static bool is_heap_id(OrderID const & id)
+    {
+        static std::size_t const inline_capacity = std::string{}.capacity();
+        return id.value().size() > inline_capacity;
+    }
+
+    // Save the level's current qty as a level update.
+    // Must be called before erasing an empty level, which is then reported with zero qty.
+    void update(Level const & level)
+    {
+        level_updates_.emplace_back(LevelUpdate{level.side_, level.price(), level.qty()});
+    }
+
+    // Destroy an order removed from its level.
+    void release(Order & order)
+    {
+        auto && info = orders_.info(order);
+        if (info.owner)
+        {
+            info.owner->unlink(orders_, order);
+        }
+        orders_.release(order);
+    }
+
+    // Erase an empty level from the levels it resides in.
+    template <Side Side_V>
+    void erase(Level & level)
+    {
+        levels<Side_V>().erase(level);
+        ++stats_.levels_erased;
+    }
+
+    void erase(Level & level)
+    {
+        switch (level.side_)
+        {
+            case Side::Buy:
+            {
+                erase<Side::Buy>(level);
+                break;
+            }
+
+            case Side::Sell:
+            {
+                erase<Side::Sell>(level);
+                break;
+            }
+
+            case Side::Invalid:
+            {
+                assert(false);
+                break;
+            }
+        }
+    }
+
+private:
+    // Pool for the nodes of all containers (declared first so it is destroyed after them).
+    NodePool pool_;
+
+    // Hot order records and their cold info, indexed by handle.
+    OrderTable orders_;
+
+    Allocation allocation_;
+
+    Levels<Side::Buy> buy_levels_;
+    Levels<Side::Sell> sell_levels_;
+
+    // Maps order ID directly to its location in a level.
+    // Keys refer to the order IDs in the order table, which outlive the entries, so adding an order never copies its ID.
+    using OrderIDRef = std::reference_wrapper<OrderID const>;
+    using OrdersByID = std::unordered_map<OrderIDRef, Order *, std::hash<OrderID>, std::equal_to<OrderID>,
+        PoolAllocator<std::pair<OrderIDRef const, Order *>>>;
+    OrdersByID orders_by_id_;
+
+    // Maps owner to its orders. Kept after the owner's orders are all removed since the owner likely adds more.
+    using Owners = std::unordered_map<OrderID, OwnerOrders, std::hash<OrderID>, std::equal_to<OrderID>,
+        PoolAllocator<std::pair<OrderID const, OwnerOrders>>>;
+    Owners owners_;
+
+    bool has_heap_owner_ids_ = false; // Any owner ID in the book has ever been stored on the heap.
+
+    LevelUpdates level_updates_;
+    std::vector<std::size_t> update_indexes_; // Scratch space to coalesce level updates.
+    std::vector<Level *> emptied_levels_;
+    BookStats stats_;
+};
+
+std::ostream & operator<<(std::ostream & os, Book const & book)
+{
+    auto write_level = [&os](Level const & level)
+    {
+        os << level << '\n';
+    };
+
+    os << "SELL:\n";
+    Book::for_each_level_descending(book.sell_levels(), write_level);
+
+    os << "BUY:\n";
+    Book::for_each_level_descending(book.buy_levels(), write_level);
+
+    return os.flush();
+}
+
+using BookPtr = std::shared_ptr<Book>;
+
+
+// Pending stop orders indexed by stop price for each side, so finding the triggered stops does not scan all stops.
+// Buy stops trigger when the last trade price rises to or above their stop price,
+// and sell stops trigger when the last trade price falls to or below their stop price.
+class TriggerBook
+{
+public:
+    struct Stop
+    {
+        Side side;
+        Price stop_price;
+        Qty qty;
+        OrderID order_id;
+        Price limit_price; // Zero for a market order when triggered.
+    };
+
+    TriggerBook()
+        : buy_stops_{ComparePrice{false}, Stops::allocator_type{pool_}}
+        , sell_stops_{ComparePrice{true}, Stops::allocator_type{pool_}}
+        , stops_by_id_{0, StopsByID::hasher{}, StopsByID::key_equal{}, StopsByID::allocator_type{pool_}}
+    {
+    }
+
+    bool empty() const noexcept { return stops_by_id_.empty(); }
+    std::size_t size() const noexcept { return stops_by_id_.size(); }
+
+    // Returns false if the order ID is a duplicate.
+    bool add(Stop stop)
+    {
+        if (stops_by_id_.count(stop.order_id))
+        {
+            return false;
+        }
+
+        auto && stops = stop.side == Side::Buy ? buy_stops_ : sell_stops_;
+        auto const order_id = stop.order_id;
+        auto iter = stops.emplace(stop.stop_price, std::move(stop));
+        stops_by_id_.emplace(order_id, iter);
+        return true;
+    }
+
+    // True if a stop with the order ID is waiting to trigger.
+    bool contains(OrderID const & order_id) const
+    {
+        return not stops_by_id_.empty() and stops_by_id_.count(order_id) != 0;
+    }
+
+    // Returns false if there is no stop with the order ID.
+    bool cancel(OrderID const & order_id)
+    {
+        auto iter = stops_by_id_.find(order_id);
+        if (iter == stops_by_id_.end())
+        {
+            return false;
+        }
+
+        auto && stop_iter = iter->second;
+        auto && stops = stop_iter->second.side == Side::Buy ? buy_stops_ : sell_stops_;
+        stops.erase(stop_iter);
+        stops_by_id_.erase(iter);
+        return true;
+    }
+
+    // Remove the next stop triggered by the last trade price, returning false if none are triggered.
+    // Stops trigger in a deterministic order: buy stops by increasing stop price, then sell stops by decreasing
+    // stop price, each in time priority. Only the first stop of each side is checked, which is O(1),
+    // and removing it is amortized O(1).
+    bool pop_triggered(Price last_price, Stop & stop)
+    {
+        if (last_price.is_zero())
+        {
+            return false; // No trades yet.
+        }
+
+        if (not buy_stops_.empty() and buy_stops_.cbegin()->first <= last_price)
+        {
+            pop_front(buy_stops_, stop);
+            return true;
+        }
+        if (not sell_stops_.empty() and sell_stops_.cbegin()->first >= last_price)
+        {
+            pop_front(sell_stops_, stop);
+            return true;
+        }
+        return false;
+    }
+
+    void clear()
+    {
+        buy_stops_.clear();
+        sell_stops_.clear();
+        stops_by_id_.clear();
+    }
+
+private:
+    // Orders stop prices in increasing or decreasing order, so both sides have the same type.
+    struct ComparePrice
+    {
+        bool is_decreasing;
+
+        bool operator()(Price lhs, Price rhs) const
+        {
+            return is_decreasing ? rhs < lhs : lhs < rhs;
+        }
+    };
+
+    // Stops with the same stop price stay in insertion order.
+    using Stops = std::multimap<Price, Stop, ComparePrice, PoolAllocator<std::pair<Price const, Stop>>>;
+    using StopsByID = std::unordered_map<OrderID, Stops::iterator, std::hash<OrderID>, std::equal_to<OrderID>,
+        PoolAllocator<std::pair<OrderID const, Stops::iterator>>>;
+
+    void pop_front(Stops & stops, Stop & stop)
+    {
+        auto iter = stops.begin();
+        stop = std::move(iter->second);
+        stops_by_id_.erase(stop.order_id);
+        stops.erase(iter);
+    }
+
+    // Pool for the nodes of all containers (declared first so it is destroyed after them).
+    NodePool pool_;
+
+    Stops buy_stops_;
+    Stops sell_stops_;
+    StopsByID stops_by_id_;
+};
+
+
+/*
+ * 5. Market Data - Publishes top of book, level updates, and trades to a shared-memory ring buffer for co-located consumers.
+ * The ring buffer has a single writer (the matching engine) and any number of readers.
+ * Each reader keeps its own cursor, so readers never block the writer or each other,
+ * but a reader that falls more than the capacity behind the writer detects the overrun and skips the lost events.
+ */
+
+struct MarketDataEvent
+{
+    enum class Type : char
+    {
+        TopOfBook = 'T',
+        Level = 'L',
+        Trade = 'X',
+        Clear = 'C',
+    };
+
+    std::uint64_t timestamp_ns; // Time of publication to measure end-to-end latency.
+    Type type;
+    Side side; // Level: side of the level. Trade: side of the aggressive order.
+    Price price; // TopOfBook: best buy price. Level: level price. Trade: passive order price.
+    Qty qty; // TopOfBook: best buy qty. Level: level qty (zero if erased). Trade: traded qty.
+    Price sell_price; // TopOfBook: best sell price.
+    Qty sell_qty; // TopOfBook: best sell qty.
+};
+
+std::ostream & operator<<(std::ostream & os, MarketDataEvent const & event)
+{
+    switch (event.type)
+    {
+        case MarketDataEvent::Type::TopOfBook:
+        {
+            os << "TOP " << event.price << ' ' << event.qty << ' ' << event.sell_price << ' ' << event.sell_qty;
+            break;
+        }
+
+        case MarketDataEvent::Type::Level:
+        {
+            os << "LEVEL " << event.side << ' ' << event.price << ' ' << event.qty;
+            break;
+        }
+
+        case MarketDataEvent::Type::Trade:
+        {
+            os << "TRADE " << event.side << ' ' << event.price << ' ' << event.qty;
+            break;
+        }
+
+        case MarketDataEvent::Type::Clear:
+        {
+            os << "CLEAR";
+            break;
+        }
+    }
+    return os;
+}
+
+
+// Layout of the ring buffer in shared memory: a header followed by a power-of-2 number of slots.
+// Events are numbered by a sequence number that the writer increments for each event, so the slot for an event is
+// seq % capacity, and a slot holds seq + 1 while it holds the event (0 while the writer is overwriting it).
+// Readers check the slot's seq before and after copying the event to detect that it was overwritten mid-read.
+struct MarketDataRing
+{
+    static constexpr std::uint64_t magic_value = 0x444d2d686374616d; // "match-MD"
+
+    struct Header
+    {
+        std::uint64_t magic;
+        std::uint64_t capacity;
+        alignas(64) std::atomic<std::uint64_t> write_seq; // Seq of the next event to write (number of events written).
+        std::atomic<bool> closed; // Set when the writer is done.
+    };
+
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> seq;
+        MarketDataEvent event;
+    };
+
+    static std::size_t size(std::uint64_t capacity)
+    {
+        return sizeof(Header) + capacity * sizeof(Slot);
+    }
+};
+
+
+// POSIX shared memory object mapped into this process.
+class SharedMemory
+{
+public:
+    // Create (replacing any existing object with the same name) and map with read-write access,
+    // or open an existing object and map with read-only access.
+    SharedMemory(std::string const & name, std::size_t size, bool create)
+    {
+        int fd = -1;
+        if (create)
+        {
+            ::shm_unlink(name.c_str());
+            fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+            if (fd != -1 and ::ftruncate(fd, size) == -1)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        else
+        {
+            fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+            struct stat st{};
+            if (fd != -1 and ::fstat(fd, &st) == 0)
+            {
+                size = st.st_size;
+            }
+        }
+        if (fd == -1)
+        {
+            throw std::runtime_error{"Unable to open shared memory " + name + ": " + std::strerror(errno)};
+        }
+
+        auto const prot = create ? PROT_READ | PROT_WRITE : PROT_READ;
+        void * addr = ::mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+        ::close(fd); // Mapping remains valid after closing.
+        if (addr == MAP_FAILED)
+        {
+            throw std::runtime_error{"Unable to map shared memory " + name + ": " + std::strerror(errno)};
+        }
+        addr_ = addr;
+        size_ = size;
+    }
+
+    ~SharedMemory()
+    {
+        ::munmap(addr_, size_);
+    }
+
+    SharedMemory(SharedMemory const &) = delete;
+    SharedMemory & operator=(SharedMemory const &) = delete;
+
+    void * data() const noexcept { return addr_; }
+    std::size_t size() const noexcept { return size_; }
+
+private:
+    void * addr_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+
+// Single writer of the ring buffer.
+// The shared memory object is left after the publisher is destroyed, so readers can still drain it, and is replaced
+// by the next publisher with the same name.
+class MarketDataPublisher
+{
+public:
+    // Capacity must be a power of 2.
+    explicit MarketDataPublisher(std::string const & name, std::uint64_t capacity = 1 << 16)
+        : shm_{name, MarketDataRing::size(capacity), true}
+        , capacity_{capacity}
+    {
+        assert(capacity != 0 and (capacity & (capacity - 1)) == 0);
+        header_ = new (shm_.data()) MarketDataRing::Header{};
+        header_->capacity = capacity;
+        slots_ = reinterpret_cast<MarketDataRing::Slot *>(header_ + 1);
+        for (std::uint64_t i = 0; i != capacity; ++i)
+        {
+            new (&slots_[i]) MarketDataRing::Slot{};
+        }
+
+        // Set magic last so readers only attach to an initialized ring.
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->magic = MarketDataRing::magic_value;
+    }
+
+    ~MarketDataPublisher()
+    {
+        header_->closed.store(true, std::memory_order_release);
+    }
+
+    void publish(MarketDataEvent const & event)
+    {
+        auto && slot = slots_[write_seq_ & (capacity_ - 1)];
+        slot.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.event = event;
+        slot.seq.store(write_seq_ + 1, std::memory_order_release);
+        header_->write_seq.store(++write_seq_, std::memory_order_release);
+    }
+
+private:
+    SharedMemory shm_;
+    std::uint64_t const capacity_;
+    std::uint64_t write_seq_ = 0; // Local copy of header_->write_seq since this is the only writer.
+    MarketDataRing::Header * header_ = nullptr;
+    MarketDataRing::Slot * slots_ = nullptr;
+};
+
+using MarketDataPublisherPtr = std::shared_ptr<MarketDataPublisher>;
+
+
+// One of any number of readers of the ring buffer.
+// Starts with the oldest event still in the ring buffer.
+class MarketDataReader
+{
+public:
+    explicit MarketDataReader(std::string const & name)
+        : shm_{name, 0, false}
+    {
+        if (shm_.size() < sizeof(MarketDataRing::Header))
+        {
+            throw std::runtime_error{"Shared memory is too small for market data: " + name};
+        }
+        header_ = static_cast<MarketDataRing::Header const *>(shm_.data());
+        if (header_->magic != MarketDataRing::magic_value
+            or shm_.size() < MarketDataRing::size(header_->capacity))
+        {
+            throw std::runtime_error{"Shared memory is not initialized for market data: " + name};
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        capacity_ = header_->capacity;
+        slots_ = reinterpret_cast<MarketDataRing::Slot const *>(header_ + 1);
+
+        auto const write_seq = header_->write_seq.load(std::memory_order_acquire);
+        read_seq_ = write_seq > capacity_ ? write_seq - capacity_ : 0;
+    }
+
+    // Read the next event if available.
+    // If the writer has overwritten unread events, then they are counted as lost and skipped.
+    bool try_read(MarketDataEvent & event)
+    {
+        while (true)
+        {
+            auto const write_seq = header_->write_seq.load(std::memory_order_acquire);
+            if (read_seq_ == write_seq)
+            {
+                return false;
+            }
+
+            if (write_seq - read_seq_ > capacity_)
+            {
+                // Overrun: skip to the oldest event that is still in the ring buffer.
+                lost_ += write_seq - capacity_ - read_seq_;
+                ++overruns_;
+                read_seq_ = write_seq - capacity_;
+            }
+
+            auto && slot = slots_[read_seq_ & (capacity_ - 1)];
+            auto const seq = slot.seq.load(std::memory_order_acquire);
+            event = slot.event;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq == read_seq_ + 1 and slot.seq.load(std::memory_order_relaxed) == seq)
+            {
+                ++read_seq_;
+                return true;
+            }
+
+            // Slot was overwritten before or while copying the event, so check for overrun again.
+        }
+    }
+
+    // True if the writer is done, though events may still be left to read.
+    bool closed() const
+    {
+        return header_->closed.load(std::memory_order_acquire);
+    }
+
+    std::uint64_t lost() const noexcept { return lost_; }
+    std::uint64_t overruns() const noexcept { return overruns_; }
+
+private:
+    SharedMemory shm_;
+    MarketDataRing::Header const * header_ = nullptr;
+    MarketDataRing::Slot const * slots_ = nullptr;
+    std::uint64_t capacity_ = 0;
+    std::uint64_t read_seq_ = 0; // This reader's cursor.
+    std::uint64_t lost_ = 0;
+    std::uint64_t overruns_ = 0;
+};
+
+
+/*
+ * 6. Matching Engine - Matchine engine dispatches events to the order book and handles trade events.
+ */
+
+// Latency and heap allocations of handling each message type and counters of the results.
+// Latencies are recorded in TSC ticks and converted to nanoseconds when written.
+class EngineStats
+{
+public:
+    enum class Type : std::size_t
+    {
+        Buy,
+        Sell,
+        Cancel,
+        Modify,
+        Clear,
+        Uncross,
+        Quote,
+        MassQuote,
+        Market,
+        Stop,
+        CancelAll,
+        Expire,
+        Count,
+    };
+
+    void record(Type type, std::uint64_t ticks, AllocCount const & allocs) noexcept
+    {
+        latencies_[static_cast<std::size_t>(type)].record(ticks);
+        auto && total_allocs = allocs_[static_cast<std::size_t>(type)];
+        total_allocs.allocs += allocs.allocs;
+        total_allocs.frees += allocs.frees;
+        total_allocs.bytes += allocs.bytes;
+    }
+
+    LatencyHistogram const & latency(Type type) const noexcept
+    {
+        return latencies_[static_cast<std::size_t>(type)];
+    }
+
+    AllocCount const & allocs(Type type) const noexcept
+    {
+        return allocs_[static_cast<std::size_t>(type)];
+    }
+
+    void write(std::ostream & os, BookStats const & book_stats, std::size_t book_size) const
+    {
+        os << "STATS"
+            << " adds " << latency(Type::Buy).count() + latency(Type::Sell).count()
+            << " cancels " << latency(Type::Cancel).count()
+            << " modifies " << latency(Type::Modify).count()
+            << " clears " << latency(Type::Clear).count()
+            << " trades " << trades
+            << " rejects " << rejects + book_stats.rejects
+            << " levels_created " << book_stats.levels_created
+            << " levels_erased " << book_stats.levels_erased
+            << " orders " << book_size
+            << " peak_orders " << book_stats.peak_orders
+            << '\n';
+
+        static char const * const names[] = {"BUY", "SELL", "CANCEL", "MODIFY", "CLEAR", "UNCROSS", "QUOTE", "MASS_QUOTE",
+            "MARKET", "STOP", "CANCEL_ALL", "EXPIRE"};
+        static_assert(sizeof(names) / sizeof(names[0]) == static_cast<std::size_t>(Type::Count), "Name every type");
+        double const ns_per_tick = clock_.ns_per_tick();
+        auto to_ns = [ns_per_tick](double ticks)
+        {
+            return static_cast<std::uint64_t>(ticks * ns_per_tick + 0.5);
+        };
+        for (std::size_t i = 0; i != static_cast<std::size_t>(Type::Count); ++i)
+        {
+            auto && latency = latencies_[i];
+            os << "LATENCY " << names[i]
+                << " count " << latency.count()
+                << " mean_ns " << to_ns(latency.mean())
+                << " p50_ns " << to_ns(latency.percentile(50.0))
+                << " p99_ns " << to_ns(latency.percentile(99.0))
+                << " p999_ns " << to_ns(latency.percentile(99.9))
+                << " max_ns " << to_ns(latency.max())
+                << '\n';
+        }
+#ifdef COUNT_ALLOCS
+        for (std::size_t i = 0; i != static_cast<std::size_t>(Type::Count); ++i)
+        {
+            auto && allocs = allocs_[i];
+            os << "ALLOCS " << names[i]
+                << " allocs " << allocs.allocs
+                << " frees " << allocs.frees
+                << " bytes " << allocs.bytes
+                << '\n';
+        }
+#endif
+        os.flush();
+    }
+
+    std::uint64_t trades = 0;
+    std::uint64_t rejects = 0; // Invalid messages.
+
+private:
+    LatencyHistogram latencies_[static_cast<std::size_t>(Type::Count)];
+    AllocCount allocs_[static_cast<std::size_t>(Type::Count)];
+    TscClock clock_;
+};
+
+
+class MatchingEngine
+{
+public:
+    // Publishes market data after handling each message if publisher is set.
+    MatchingEngine(BookPtr book, MarketDataPublisherPtr publisher = nullptr)
+        : book_{std::move(book)}
+        , publisher_{std::move(publisher)}
+    {
+        trades_.reserve(1024);
+    }
+
+    BookPtr const & book() { return book_; }
+    Trades const & trades() const { return trades_; }
+    bool in_auction() const noexcept { return in_auction_; }
+    EngineStats const & stats() const { return stats_; }
+
+    void write_stats(std::ostream & os) const
+    {
+        stats_.write(os, book_->stats(), book_->size());
+    }
+
+    // Count a message rejected before reaching the engine, such as an invalid message.
+    void reject()
+    {
+        ++stats_.rejects;
+    }
+
+    void handle(BuyOrder const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Buy);
+        handle_add<Side::Buy>(msg);
+        trigger_stops();
+        handled(EngineStats::Type::Buy, Side::Buy, start_tsc);
+    }
+
+    void handle(SellOrder const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Sell);
+        handle_add<Side::Sell>(msg);
+        trigger_stops();
+        handled(EngineStats::Type::Sell, Side::Sell, start_tsc);
+    }
+
+    // Handle buys and sells the same with the side as a compile-time parameter, so the book operations of the
+    // message are specialized for its side.
+    template <Side Side_V, typename AddOrder_T>
+    void handle_add(AddOrder_T const & msg)
+    {
+        trades_.clear();
+        if (is_leg_id(msg.order_id) or triggers_.contains(msg.order_id))
+        {
+            // Order IDs are unique across the book and the pending stops, so a cancel finds one order.
+            ++stats_.rejects;
+            return;
+        }
+
+        if (in_auction_)
+        {
+            // Orders rest without matching until uncrossed, so an order that must trade immediately could never execute.
+            if (msg.tif != TIF::GFD or not msg.min_qty.is_zero())
+            {
+                ++stats_.rejects;
+                return;
+            }
+            book_->add<Side_V>(msg.order_id, msg.qty, msg.price, msg.display_qty, msg.owner);
+            return;
+        }
+
+        // Kill the order before touching the book if less than its min qty can trade.
+        Qty const min_qty = msg.tif == TIF::FOK ? msg.qty : msg.min_qty;
+        if (not min_qty.is_zero() and book_->executable_qty<Side_V>(msg.price, min_qty) < min_qty)
+        {
+            return;
+        }
+
+        Qty const leaves_qty = book_->match<Side_V>(msg.order_id, msg.qty, msg.price, trades_);
+        if (leaves_qty.is_zero())
+        {
+            // Aggressive order is fully filled, so done.
+            return;
+        }
+
+        switch (msg.tif)
+        {
+            case TIF::GFD:
+            {
+                book_->add<Side_V>(msg.order_id, leaves_qty, msg.price, msg.display_qty, msg.owner);
+                break;
+            }
+
+            case TIF::IOC:
+            case TIF::FOK:
+            {
+                // Do not add order to the book regardless of leaves_qty.
+                break;
+            }
+
+            case TIF::Invalid:
+            {
+                break;
+            }
+        }
+    }
+
+    void handle(MarketOrder const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Market);
+        trades_.clear();
+        if (in_auction_ or is_leg_id(msg.order_id))
+        {
+            // Could never execute since orders do not match until uncrossed.
+            ++stats_.rejects;
+        }
+        else
+        {
+            book_->match_market(msg.side, msg.order_id, msg.qty, msg.band_ticks, trades_);
+        }
+        trigger_stops();
+        handled(EngineStats::Type::Market, msg.side, start_tsc);
+    }
+
+    void handle(StopOrder const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Stop);
+        trades_.clear();
+        if (is_leg_id(msg.order_id) or book_->find(msg.order_id)
+            or not triggers_.add(TriggerBook::Stop{msg.side, msg.stop_price, msg.qty, msg.order_id, msg.limit_price}))
+        {
+            // A duplicate of an order in the book or a pending stop.
+            ++stats_.rejects;
+        }
+
+        // A stop already triggered by the last trade price activates immediately.
+        trigger_stops();
+        handled(EngineStats::Type::Stop, msg.side, start_tsc);
+    }
+
+    void handle(CancelOrder const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Cancel);
+        trades_.clear();
+        if (triggers_.empty() or not triggers_.cancel(msg.order_id))
+        {
+            book_->cancel(msg.order_id);
+        }
+        handled(EngineStats::Type::Cancel, Side::Invalid, start_tsc);
+    }
+
+    // Requote both legs in one call, reusing the nodes of legs already in the book.
+    // Each leg matches first if it crosses like a modify, and the updates of each level are coalesced into one.
+    void handle(Quote const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Quote);
+        trades_.clear();
+        auto const first_update = book_->level_updates().size();
+        Side const aggressive_side = requote(msg.quote_id, msg.bid_price, msg.bid_qty, msg.ask_price, msg.ask_qty);
+        coalesce_level_updates(first_update);
+        trigger_stops();
+        handled(EngineStats::Type::Quote, aggressive_side, start_tsc);
+    }
+
+    // Requote all entries after validating them together, skipping (and counting) invalid entries.
+    // The batch is handled like one message: stops trigger and market data is published once after all entries.
+    // Pulls and legs that do not cross the book are applied first, also pulling the old leg of each crossing leg,
+    // and only then do the crossing legs match, so no leg trades with a quote that the same batch moves away.
+    void handle(MassQuote const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::MassQuote);
+        trades_.clear();
+        auto const first_update = book_->level_updates().size();
+        msg.validate(valid_entries_);
+
+        crossing_legs_.clear();
+        for (std::size_t index = 0; index != msg.size(); ++index)
+        {
+            if (not valid_entries_[index])
+            {
+                ++stats_.rejects;
+                continue;
+            }
+
+            set_leg_ids(msg.quote_ids[index]);
+            requote_passive<Side::Buy>(bid_id_, msg.bid_qtys[index], msg.bid_prices[index], index);
+            requote_passive<Side::Sell>(ask_id_, msg.ask_qtys[index], msg.ask_prices[index], index);
+        }
+
+        Side aggressive_side = Side::Invalid;
+        bool is_mixed_side = false;
+        for (auto && leg : crossing_legs_)
+        {
+            // Find the leg again in case a duplicate entry of the same quote added it.
+            set_leg_ids(msg.quote_ids[leg.index]);
+            Side side = Side::Invalid;
+            if (leg.side == Side::Buy)
+            {
+                requote<Side::Buy>(bid_id_, book_->find(bid_id_), msg.bid_qtys[leg.index], msg.bid_prices[leg.index],
+                    side);
+            }
+            else
+            {
+                requote<Side::Sell>(ask_id_, book_->find(ask_id_), msg.ask_qtys[leg.index], msg.ask_prices[leg.index],
+                    side);
+            }
+            if (side != Side::Invalid)
+            {
+                is_mixed_side = is_mixed_side or (aggressive_side != Side::Invalid and side != aggressive_side);
+                aggressive_side = side;
+            }
+        }
+        coalesce_level_updates(first_update);
+        trigger_stops();
+        handled(EngineStats::Type::MassQuote, is_mixed_side ? Side::Invalid : aggressive_side, start_tsc);
+    }
+
+    void handle(CancelAll const & msg)
+    {
+        auto const start_tsc = begin(EngineStats::Type::CancelAll);
+        trades_.clear();
+        book_->cancel_all(msg.owner,
+            [&msg](Side side, Price price) -> bool
+            {
+                return msg.matches(side, price);
+            });
+        handled(EngineStats::Type::CancelAll, Side::Invalid, start_tsc);
+    }
+
+    void handle(ModifyOrder const & msg)
+    {
+        // A modify may match if its price or side changed.
+        auto const start_tsc = begin(EngineStats::Type::Modify);
+        trades_.clear();
+        switch (msg.side)
+        {
+            case Side::Buy:
+            {
+                handle_modify<Side::Buy>(msg);
+                break;
+            }
+
+            case Side::Sell:
+            {
+                handle_modify<Side::Sell>(msg);
+                break;
+            }
+
+            case Side::Invalid:
+            {
+                break;
+            }
+        }
+        handled(EngineStats::Type::Modify, msg.side, start_tsc);
+    }
+
+    template <Side Side_V>
+    void handle_modify(ModifyOrder const & msg)
+    {
+        if (in_auction_)
+        {
+            book_->modify<Side_V>(msg.order_id, msg.qty, msg.price);
+            return;
+        }
+
+        Qty const leaves_qty = book_->match<Side_V>(msg.order_id, msg.qty, msg.price, trades_);
+        if (leaves_qty.is_zero())
+        {
+            // Order is fully filled, but we must still cancel the original order since this is a modify.
+            book_->cancel(msg.order_id);
+        }
+        else
+        {
+            // Modify the book (use leaves_qty in case of matching).
+            book_->modify<Side_V>(msg.order_id, leaves_qty, msg.price);
+        }
+        trigger_stops();
+    }
+
+    void handle(ClearBook const &)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Clear);
+        clear_book();
+        handled(EngineStats::Type::Clear, Side::Invalid, start_tsc);
+    }
+
+    // All resting orders are GFD, so expiring them clears the book, including pending stop orders.
+    void handle(ExpireOrders const &)
+    {
+        auto const start_tsc = begin(EngineStats::Type::Expire);
+        clear_book();
+        handled(EngineStats::Type::Expire, Side::Invalid, start_tsc);
+    }
+
+    void handle(StartAuction const &)
+    {
+        trades_.clear();
+        in_auction_ = true;
+    }
+
+    void handle(UncrossBook const & msg)
+    {
+        // Trades have no aggressive side since all orders rested in the book.
+        auto const start_tsc = begin(EngineStats::Type::Uncross);
+        trades_.clear();
+        book_->uncross(msg.reference_price.is_zero() ? last_price_ : msg.reference_price, trades_);
+        in_auction_ = false;
+        trigger_stops();
+        handled(EngineStats::Type::Uncross, Side::Invalid, start_tsc);
+    }
+
+private:
+    // Remove all orders and pending stops.
+    void clear_book()
+    {
+        trades_.clear();
+        book_->clear();
+        triggers_.clear();
+        if (publisher_)
+        {
+            publisher_->publish(MarketDataEvent{now_ns(), MarketDataEvent::Type::Clear, Side::Invalid, {}, {}, {}, {}});
+        }
+    }
+
+    // Coalesce the level updates of a quote message from first_update on.
+    // Skipped without a publisher since the level updates are then not used.
+    void coalesce_level_updates(std::size_t first_update)
+    {
+        if (publisher_)
+        {
+            book_->coalesce_level_updates(first_update);
+        }
+    }
+
+    // True if an order ID has the form of a quote leg ID (see set_leg_ids), which orders other than quotes may not
+    // use, so a quote never requotes another order and cancelling all orders of an owner never pulls a quote leg.
+    static bool is_leg_id(OrderID const & order_id) noexcept
+    {
+        auto && id = order_id.value();
+        return id.size() >= 2 and id[id.size() - 2] == '.' and (id.back() == 'B' or id.back() == 'S');
+    }
+
+    // Set the order IDs of the legs of a quote.
+    void set_leg_ids(OrderID const & quote_id)
+    {
+        bid_id_.value().assign(quote_id.value()).append(".B");
+        ask_id_.value().assign(quote_id.value()).append(".S");
+    }
+
+    // Replace both legs of a quote, returning the side of the leg that traded, if any.
+    Side requote(OrderID const & quote_id, Price bid_price, Qty bid_qty, Price ask_price, Qty ask_qty)
+    {
+        set_leg_ids(quote_id);
+        auto const bid = book_->find(bid_id_);
+        auto const ask = book_->find(ask_id_);
+
+        // Move the ask first if the new bid reaches the old ask, so the quote never trades with itself.
+        // Both cannot cross the old legs since the new bid is below the new ask and the old bid was below the old ask.
+        // Only one leg can trade since the book is not crossed, so its side is the aggressive side.
+        Side aggressive_side = Side::Invalid;
+        if (ask and not bid_qty.is_zero() and bid_price >= ask->level()->price())
+        {
+            requote<Side::Sell>(ask_id_, ask, ask_qty, ask_price, aggressive_side);
+            requote<Side::Buy>(bid_id_, bid, bid_qty, bid_price, aggressive_side);
+        }
+        else
+        {
+            requote<Side::Buy>(bid_id_, bid, bid_qty, bid_price, aggressive_side);
+            requote<Side::Sell>(ask_id_, ask, ask_qty, ask_price, aggressive_side);
+        }
+        return aggressive_side;
+    }
+
+    // Replace a quote leg, given the leg if it is already in the book, pulling it if qty is zero.
+    // Sets aggressive_side to side if the leg trades.
+    template <Side Side_V>
+    void requote(OrderID const & order_id, Order const * order, Qty qty, Price price, Side & aggressive_side)
+    {
+        if (not qty.is_zero() and not in_auction_)
+        {
+            auto const trade_count = trades_.size();
+            qty = book_->match<Side_V>(order_id, qty, price, trades_);
+            if (trades_.size() != trade_count)
+            {
+                aggressive_side = Side_V;
+            }
+        }
+
+        if (qty.is_zero())
+        {
+            if (order)
+            {
+                book_->cancel(order_id);
+            }
+        }
+        else if (order)
+        {
+            book_->modify<Side_V>(*order, qty, price);
+        }
+        else
+        {
+            book_->add<Side_V>(order_id, qty, price);
+        }
+    }
+
+    // Replace a mass quote leg now if it does not cross the book. Otherwise, pull its old leg and save the leg
+    // of entry index to match after the other legs of the batch.
+    template <Side Side_V>
+    void requote_passive(OrderID const & order_id, Qty qty, Price price, std::size_t index)
+    {
+        auto const order = book_->find(order_id);
+        auto const best = Side_V == Side::Buy ? book_->best_sell() : book_->best_buy();
+        if (not qty.is_zero() and not in_auction_ and best and BookSide<Side_V>::crosses(price, best->price()))
+        {
+            if (order)
+            {
+                book_->cancel(order_id);
+            }
+            crossing_legs_.push_back(CrossingLeg{index, Side_V});
+            return;
+        }
+
+        Side aggressive_side = Side::Invalid;
+        requote<Side_V>(order_id, order, qty, price, aggressive_side);
+        assert(aggressive_side == Side::Invalid);
+    }
+
+    // Activate the stop orders triggered by the last trade price, adding their trades to the trades of the message.
+    // Their trades may in turn trigger more stops, which activate one at a time in the trigger book's order.
+    // Each activation is O(log n) at most, so the cost is O(triggered + log n) after the trades of a message.
+    void trigger_stops()
+    {
+        if (in_auction_)
+        {
+            return;
+        }
+
+        if (not trades_.empty())
+        {
+            last_price_ = trades_.back().passive_price;
+        }
+
+        TriggerBook::Stop stop{};
+        while (triggers_.pop_triggered(last_price_, stop))
+        {
+            auto const trade_count = trades_.size();
+            if (publisher_)
+            {
+                stop_trades_.push_back(StopTrades{trade_count, stop.side});
+            }
+            switch (stop.side)
+            {
+                case Side::Buy:
+                {
+                    activate<Side::Buy>(stop);
+                    break;
+                }
+
+                case Side::Sell:
+                {
+                    activate<Side::Sell>(stop);
+                    break;
+                }
+
+                case Side::Invalid:
+                {
+                    break;
+                }
+            }
+
+            if (trades_.size() != trade_count)
+            {
+                last_price_ = trades_.back().passive_price;
+            }
+        }
+    }
+
+    // Activate a triggered stop order as a market order or, if it has a limit price, a GFD limit order.
+    template <Side Side_V>
+    void activate(TriggerBook::Stop const & stop)
+    {
+        if (stop.limit_price.is_zero())
+        {
+            book_->match_market<Side_V>(stop.order_id, stop.qty, 0, trades_);
+        }
+        else
+        {
+            Qty const leaves_qty = book_->match<Side_V>(stop.order_id, stop.qty, stop.limit_price, trades_);
+            if (not leaves_qty.is_zero())
+            {
+                book_->add<Side_V>(stop.order_id, leaves_qty, stop.limit_price);
+            }
+        }
+    }
+
+    // Start handling a message, returning the start time.
+    std::uint64_t begin(EngineStats::Type type)
+    {
+        TRACE_EVENT(EngineBegin, static_cast<std::uint64_t>(type));
+        start_allocs_ = AllocCounter::count();
+        return rdtsc();
+    }
+
+    // Publish market data and update stats after handling a message.
+    void handled(EngineStats::Type type, Side aggressive_side, std::uint64_t start_tsc)
+    {
+        stats_.trades += trades_.size();
+        if (not trades_.empty())
+        {
+            last_price_ = trades_.back().passive_price;
+        }
+        publish(aggressive_side);
+        auto const end_tsc = rdtsc();
+        stats_.record(type, end_tsc - start_tsc, AllocCounter::count() - start_allocs_);
+        TRACE_EVENT(EngineEnd, static_cast<std::uint64_t>(type));
+    }
+
+    // Publish the trades and level updates from handling a message and the top of book if it changed.
+    // Trades of the message are tagged with aggressive_side and those of each stop it triggered with the stop's side.
+    void publish(Side aggressive_side)
+    {
+        if (publisher_)
+        {
+            TRACE_EVENT(PublishBegin, 0);
+            auto const timestamp_ns = now_ns();
+            auto stop_trades = stop_trades_.cbegin();
+            for (std::size_t index = 0; index != trades_.size(); ++index)
+            {
+                for (; stop_trades != stop_trades_.cend() and stop_trades->first_trade == index; ++stop_trades)
+                {
+                    aggressive_side = stop_trades->side;
+                }
+                auto && trade = trades_[index];
+                publisher_->publish(MarketDataEvent{timestamp_ns, MarketDataEvent::Type::Trade, aggressive_side,
+                    trade.passive_price, trade.aggressive_order.qty(), {}, {}});
+            }
+            stop_trades_.clear();
+
+            for (auto && update : book_->level_updates())
+            {
+                publisher_->publish(MarketDataEvent{timestamp_ns, MarketDataEvent::Type::Level, update.side,
+                    update.price, update.qty, {}, {}});
+            }
+
+            auto top = MarketDataEvent{timestamp_ns, MarketDataEvent::Type::TopOfBook, Side::Invalid, {}, {}, {}, {}};
+            if (auto level = book_->best_buy())
+            {
+                top.price = level->price();
+                top.qty = level->qty();
+            }
+            if (auto level = book_->best_sell())
+            {
+                top.sell_price = level->price();
+                top.sell_qty = level->qty();
+            }
+            if (top.price != top_.price or top.qty != top_.qty
+                or top.sell_price != top_.sell_price or top.sell_qty != top_.sell_qty)
+            {
+                publisher_->publish(top);
+                top_ = top;
+            }
+            TRACE_EVENT(PublishEnd, 0);
+        }
+        book_->clear_level_updates();
+    }
+
+    BookPtr book_;
+    Trades trades_;
+    bool in_auction_ = false;
+    Price last_price_ = {}; // Triggers stop orders and is the reference price for uncrossing.
+    TriggerBook triggers_;
+    OrderID bid_id_; // Order IDs of the quote legs, kept to reuse their storage.
+    OrderID ask_id_;
+    std::vector<std::uint8_t> valid_entries_; // Validation result of each mass quote entry.
+
+    // Trades from first_trade on are those of a triggered stop on side (only kept with a publisher).
+    struct StopTrades
+    {
+        std::size_t first_trade;
+        Side side;
+    };
+    std::vector<StopTrades> stop_trades_;
+
+    // Leg of a mass quote entry that crosses the book, so it matches after the rest of the batch.
+    struct CrossingLeg
+    {
+        std::size_t index;
+        Side side;
+    };
+    std::vector<CrossingLeg> crossing_legs_;
+
+    MarketDataPublisherPtr publisher_;
+    MarketDataEvent top_ = {}; // Last published top of book.
+
+    EngineStats stats_;
+    AllocCount start_allocs_ = {};
+};
+
+using MatchingEnginePtr = std::shared_ptr<MatchingEngine>;
+
+
+/*
+ * 7. Command Processor - Reads and dispatches commands to the matching engine.
+ * The command processor handles I/O by reading and parsing commands from an input stream,
+ * normalizing and converting the lines into messages acceptable by the matching engine,
+ * handling the messages with the matching engine,
+ * and writing any results to an output stream.
+ */
+
+// CommandProcessor_T handles all input processing and uses CRTP to statically handle messages in derived class.
+// Derived_T must implement handlers for each message type:
+// void handle(BuyOrder)
+// void handle(SellOrder)
+// void handle(MarketOrder)
+// void handle(StopOrder)
+// void handle(CancelOrder)
+// void handle(CancelAll)
+// void handle(Quote)
+// void handle(MassQuote)
+// void handle(ModifyOrder)
+// void handle(PrintBook)
+// void handle(ClearBook)
+// void handle(ExpireOrders)
+// void handle(StartAuction)
+// void handle(UncrossBook)
+// void handle(PrintStats)
+// void handle(DumpTrace)
+// Derived_T may also implement void handle_error(std::exception const &) to handle invalid commands.
+
+template <typename Derived_T>
+class CommandProcessor_T
+{
+public:
+    CommandProcessor_T()
+    {
+        init_cmd_handlers();
+    }
+
+    void run(std::istream & is)
+    {
+        std::string cmd{};
+        while (is >> cmd)
+        {
+            try
+            {
+                handle(cmd, is);
+            }
+            catch (std::exception const & error)
+            {
+                IF_DEBUG(std::cerr << error.what() << std::endl;)
+                static_cast<Derived_T *>(this)->Derived_T::handle_error(error);
+            }
+        }
+    }
+
+protected:
+    void init_cmd_handlers()
+    {
+        // Initialize mapping from command to handler function.
+        using std::placeholders::_1;
+        cmd_to_handler_["BUY"] = std::bind(&CommandProcessor_T::handle<BuyOrder>, this, _1);
+        cmd_to_handler_["SELL"] = std::bind(&CommandProcessor_T::handle<SellOrder>, this, _1);
+        cmd_to_handler_["MARKET"] = std::bind(&CommandProcessor_T::handle<MarketOrder>, this, _1);
+        cmd_to_handler_["STOP"] = std::bind(&CommandProcessor_T::handle<StopOrder>, this, _1);
+        cmd_to_handler_["CANCEL"] = std::bind(&CommandProcessor_T::handle<CancelOrder>, this, _1);
+        cmd_to_handler_["CANCEL_ALL"] = std::bind(&CommandProcessor_T::handle<CancelAll>, this, _1);
+        cmd_to_handler_["QUOTE"] = std::bind(&CommandProcessor_T::handle<Quote>, this, _1);
+        cmd_to_handler_["MASS_QUOTE"] = std::bind(&CommandProcessor_T::handle<MassQuote>, this, _1);
+        cmd_to_handler_["MODIFY"] = std::bind(&CommandProcessor_T::handle<ModifyOrder>, this, _1);
+        cmd_to_handler_["PRINT"] = std::bind(&CommandProcessor_T::handle<PrintBook>, this, _1);
+        cmd_to_handler_["CLEAR"] = std::bind(&CommandProcessor_T::handle<ClearBook>, this, _1);
+        cmd_to_handler_["EXPIRE"] = std::bind(&CommandProcessor_T::handle<ExpireOrders>, this, _1);
+        cmd_to_handler_["AUCTION"] = std::bind(&CommandProcessor_T::handle<StartAuction>, this, _1);
+        cmd_to_handler_["UNCROSS"] = std::bind(&CommandProcessor_T::handle<UncrossBook>, this, _1);
+        cmd_to_handler_["STATS"] = std::bind(&CommandProcessor_T::handle<PrintStats>, this, _1);
+#ifdef TRACE
+        cmd_to_handler_["TRACE"] = std::bind(&CommandProcessor_T::handle<DumpTrace>, this, _1);
+#endif
+    }
+
+    // Default is to ignore errors.
+    void handle_error(std::exception const &)
+    {
+    }
+
+    void handle(std::string const & cmd, std::istream & is)
+    {
+        // Lookup and call handler for the command.
+        assert(not cmd.empty());
+        TRACE_EVENT(DispatchBegin, cmd_count_++);
+        auto iter = cmd_to_handler_.find(cmd);
+        if (iter == cmd_to_handler_.end())
+        {
+            // Skip the arguments too, so they are not handled as commands.
+            is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            throw std::invalid_argument{"Unknown command " + cmd};
+        }
+        auto && handler = iter->second;
+        handler(is);
+        TRACE_EVENT(DispatchEnd, 0);
+    }
+
+    template <typename Msg_T>
+    void handle(std::istream & is)
+    {
+        // Load each message type with input stream and dispatch it statically.
+        TRACE_EVENT(ParseBegin, 0);
+        Msg_T msg{};
+        is >> msg;
+        TRACE_EVENT(ParseEnd, 0);
+        if (is.fail())
+        {
+            // Reject only this message: resync the stream at the next line, so later commands are still handled.
+            is.clear();
+            is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            throw std::invalid_argument{"Skipping malformed message"};
+        }
+        if (msg.is_invalid())
+        {
+            throw std::invalid_argument{"Skipping invalid message"};
+        }
+        static_cast<Derived_T *>(this)->Derived_T::handle(msg);
+    }
+
+private:
+    using Handler = std::function<void (std::istream &)>;
+    using CmdToHandler = std::unordered_map<std::string, Handler>;
+    CmdToHandler cmd_to_handler_;
+    std::uint64_t cmd_count_ = 0;
+};
+
+
+// Write trades, tracing the time spent on output.
+void write_trades(std::ostream & os, Trades const & trades)
+{
+    TRACE_EVENT(OutputBegin, trades.size());
+    os << trades;
+    TRACE_EVENT(OutputEnd, trades.size());
+}
+
+
+class CommandProcessor
+    : public CommandProcessor_T<CommandProcessor>
+{
+public:
+    CommandProcessor(MatchingEnginePtr matching_engine, std::ostream & os)
+        : CommandProcessor_T<CommandProcessor>()
+        , matching_engine_{std::move(matching_engine)}
+        , os_{os}
+    {
+    }
+
+    void handle(BuyOrder const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(SellOrder const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(MarketOrder const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(StopOrder const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(CancelOrder const & msg)
+    {
+        matching_engine_->handle(msg);
+    }
+
+    void handle(CancelAll const & msg)
+    {
+        matching_engine_->handle(msg);
+    }
+
+    void handle(Quote const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(MassQuote const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(ModifyOrder const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(PrintBook const &)
+    {
+        os_ << *matching_engine_->book();
+    }
+
+    void handle(ClearBook const & msg)
+    {
+        matching_engine_->handle(msg);
+    }
+
+    void handle(ExpireOrders const & msg)
+    {
+        matching_engine_->book()->write_expired(os_);
+        matching_engine_->handle(msg);
+    }
+
+    void handle(StartAuction const & msg)
+    {
+        matching_engine_->handle(msg);
+    }
+
+    void handle(UncrossBook const & msg)
+    {
+        matching_engine_->handle(msg);
+        write_trades(os_, matching_engine_->trades());
+    }
+
+    void handle(PrintStats const &)
+    {
+        matching_engine_->write_stats(os_);
+    }
+
+    void handle(DumpTrace const & msg)
+    {
+        Tracer::instance().dump(msg.file_name);
+    }
+
+    void handle_error(std::exception const &)
+    {
+        matching_engine_->reject();
+    }
+
+private:
+    MatchingEnginePtr matching_engine_;
+    std::ostream & os_;
+};
+
+
+// Command processor that simply writes normalized messages.
+class CommandWriter
+    : public CommandProcessor_T<CommandWriter>
+{
+public:
+    CommandWriter(std::ostream & os)
+        : CommandProcessor_T<CommandWriter>()
+        , os_{os}
+    {
+    }
+
+    // Handle any message type (BuyOrder, CancelOrder, etc.) the same,
+    // just write to output stream.
+    template <typename Msg_T>
+    void handle(Msg_T const & msg)
+    {
+        os_ << msg << std::endl;
+    }
+
+private:
+    std::ostream & os_;
+};
+
+
+// How a consumer waits for a queue to become non-empty:
+// Block sleeps on a condition variable, which burns no CPU, but each wake-up costs microseconds of futex and
+// scheduler latency. Spin polls with pause, which is fastest to react but burns the whole core, so it needs a core
+// of its own. SpinYield spins for a while and then yields the core between polls, which still reacts quickly to a
+// busy producer but lets other threads run when the producer is idle.
+enum class WaitStrategy : std::uint8_t
+{
+    Block,
+    Spin,
+    SpinYield,
+    Invalid,
+};
+
+std::ostream & operator<<(std::ostream & os, WaitStrategy strategy)
+{
+    switch (strategy)
+    {
+        case WaitStrategy::Block:
+        {
+            os << "block";
+            break;
+        }
+
+        case WaitStrategy::Spin:
+        {
+            os << "spin";
+            break;
+        }
+
+        case WaitStrategy::SpinYield:
+        {
+            os << "spin_yield";
+            break;
+        }
+
+        case WaitStrategy::Invalid:
+        {
+            os << "invalid";
+            break;
+        }
+    }
+    return os;
+}
+
+std::istream & operator>>(std::istream & is, WaitStrategy & strategy)
+{
+    std::string str{};
+    is >> str;
+    if (str == "block")
+    {
+        strategy = WaitStrategy::Block;
+    }
+    else if (str == "spin")
+    {
+        strategy = WaitStrategy::Spin;
+    }
+    else if (str == "spin_yield")
+    {
+        strategy = WaitStrategy::SpinYield;
+    }
+    else
+    {
+        strategy = WaitStrategy::Invalid;
+    }
+    return is;
+}
+
+// Hint to the CPU that this is a spin-wait loop, which saves power and frees execution resources
+// for a sibling hyperthread.
+inline void cpu_pause()
+{
+#if defined(__x86_64__) or defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+template <typename T>
+class ThreadsafeQueue
+{
+public:
+    using container_type = std::deque<T>;
+    static constexpr int spins_before_yield = 1000; // Polls before SpinYield starts yielding (~10-40 us of pauses).
+
+    ThreadsafeQueue() = default;
+
+    void push(T value)
+    {
+        std::unique_lock<decltype(mutex_)> lock{mutex_};
+        queue_.push_back(std::move(value));
+        size_.store(queue_.size(), std::memory_order_release);
+        lock.unlock();
+        cond_var_.notify_one();
+    }
+
+    // Close the queue after the last push, so consumers stop waiting once it is drained.
+    void close()
+    {
+        std::unique_lock<decltype(mutex_)> lock{mutex_};
+        done_.store(true, std::memory_order_release);
+        lock.unlock();
+        cond_var_.notify_all();
+    }
+
+    // Wait for a value with the strategy and pop it, or return false if the queue is closed and drained.
+    // Spinning polls the size without taking the lock, so it does not contend with the producer.
+    bool wait_and_pop(T & value, WaitStrategy strategy = WaitStrategy::Block)
+    {
+        if (strategy == WaitStrategy::Block)
+        {
+            std::unique_lock<decltype(mutex_)> lock{mutex_};
+            cond_var_.wait(lock,
+                [this]()
+                {
+                    return not queue_.empty() or done_.load(std::memory_order_relaxed);
+                });
+            return pop_front(value);
+        }
+
+        for (int spins = 0; ; ++spins)
+        {
+            // Read done first: nothing is pushed after closing, so if the queue is empty after that, it is drained.
+            bool const done = done_.load(std::memory_order_acquire);
+            if (size_.load(std::memory_order_acquire) != 0)
+            {
+                if (try_pop(value))
+                {
+                    return true;
+                }
+                continue;
+            }
+            if (done)
+            {
+                return false;
+            }
+
+            if (strategy == WaitStrategy::SpinYield and spins >= spins_before_yield)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                cpu_pause();
+            }
+        }
+    }
+
+    bool try_pop(T & value)
+    {
+        std::lock_guard<decltype(mutex_)> lock{mutex_};
+        return pop_front(value);
+    }
+
+    bool empty() const
+    {
+        std::lock_guard<decltype(mutex_)> lock{mutex_};
+        return queue_.empty();
+    }
+
+private:
+    // Pop the front value, if any, with the lock held.
+    bool pop_front(T & value)
+    {
+        if (queue_.empty())
+        {
+            return false;
+        }
+        value = std::move(queue_.front());
+        queue_.pop_front();
+        size_.store(queue_.size(), std::memory_order_release);
+        return true;
+    }
+
+    container_type queue_;
+    mutable std::mutex mutex_;
+    std::condition_variable cond_var_;
+    std::atomic<std::size_t> size_{0}; // Size of queue_ for spinning consumers to poll without the lock.
+    std::atomic<bool> done_{false};
+};
+
+using Task = std::function<void ()>;
+using TaskQueue = ThreadsafeQueue<Task>;
+using TaskQueuePtr = std::shared_ptr<TaskQueue>;
+
+// Queues commands in a task queue.
+class QueueingCommandProcessor
+    : public CommandProcessor_T<QueueingCommandProcessor>
+{
+public:
+    QueueingCommandProcessor(TaskQueuePtr task_queue, MatchingEnginePtr matching_engine, std::ostream & os)
+        : CommandProcessor_T<QueueingCommandProcessor>()
+        , task_queue_{std::move(task_queue)}
+        , matching_engine_{std::move(matching_engine)}
+        , os_{os}
+    {
+    }
+
+    void handle(BuyOrder const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(SellOrder const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(MarketOrder const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(StopOrder const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(CancelOrder const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+            });
+    }
+
+    void handle(CancelAll const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+            });
+    }
+
+    void handle(Quote const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(MassQuote const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(ModifyOrder const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(PrintBook const &)
+    {
+        task_queue_->push(
+            [this]()
+            {
+                os_ << *matching_engine_->book();
+            });
+    }
+
+    void handle(ClearBook const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+            });
+    }
+
+    void handle(ExpireOrders const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->book()->write_expired(os_);
+                matching_engine_->handle(msg);
+            });
+    }
+
+    void handle(StartAuction const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+            });
+    }
+
+    void handle(UncrossBook const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                matching_engine_->handle(msg);
+                write_trades(os_, matching_engine_->trades());
+            });
+    }
+
+    void handle(PrintStats const &)
+    {
+        task_queue_->push(
+            [this]()
+            {
+                matching_engine_->write_stats(os_);
+            });
+    }
+
+    void handle(DumpTrace const & msg)
+    {
+        task_queue_->push(
+            [this, msg=std::move(msg)]()
+            {
+                // Errors are raised on the engine thread, so handle them here rather than in run().
+                try
+                {
+                    Tracer::instance().dump(msg.file_name);
+                }
+                catch (std::exception const & error)
+                {
+                    IF_DEBUG(std::cerr << error.what() << std::endl;)
+                    matching_engine_->reject();
+                }
+            });
+    }
+
+    void handle_error(std::exception const &)
+    {
+        task_queue_->push(
+            [this]()
+            {
+                matching_engine_->reject();
+            });
+    }
+
+private:
+    TaskQueuePtr task_queue_;
+    MatchingEnginePtr matching_engine_;
+    std::ostream & os_;
+};
+
+
+/*
+ * 8. Main - Make and run the command processor with a matching engine using stdin and stdout streams.
+ */
+
+// Disable synchronization between the C and C++ standard streams for faster I/O.
+static const int __ = []() {
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+    std::cout.tie(nullptr);
+    return 0;
+}();
+
+namespace {
+void run_test(MatchingEnginePtr const & matching_engine) __attribute__((unused));
+bool run_all_tests();
+void run_all_benchmarks(std::size_t max_depth);
+}
+
+namespace {
+
+// Core and scheduling policy of a thread.
+struct ThreadPlacement
+{
+    int cpu = -1; // Pin to this core if not negative.
+    int fifo_priority = 0; // Run with SCHED_FIFO at this priority if positive and permitted.
+};
+
+struct Options
+{
+    bool run_tests = false;
+    bool run_threads = false;
+    bool run_bench = false;
+    Allocation allocation = Allocation::Fifo;
+    std::size_t bench_max_depth = 1000000; // Max number of resting orders in the book to benchmark.
+    std::string md_shm_name = {}; // Publish market data to this shared memory object if set.
+    std::string md_consumer_name = {}; // Run the sample market data consumer reading this shared memory object if set.
+    std::string trace_file_name = "mini-match.trace"; // Dump trace events to this file at exit if TRACE is defined.
+    std::string decode_trace_file_name = {}; // Decode this trace file if set.
+    PriceFormat price_format = {}; // Decimal format of prices in commands and output if has_price_format.
+    bool has_price_format = false;
+    MemoryOptions memory = {}; // Huge pages, pre-faulting, and locking of the memory of books.
+    std::size_t reserve_orders = 0; // Allocate memory for this many resting orders at startup.
+    ThreadPlacement parser_placement = {}; // Placement of the thread reading commands if run_threads.
+    ThreadPlacement engine_placement = {}; // Placement of the thread running the matching engine and writing output.
+    WaitStrategy wait_strategy = WaitStrategy::Block; // How the engine thread waits for commands if run_threads.
+};
+
+char const * const usage = R"raw(Usage: mini-match [options] < commands
+Options:
+  --run-tests              Run unit tests
+  --run-threads            Run with separate threads to parse commands and run the matching engine
+  --allocation POLICY      Allocate fills within a level by FIFO, PRO_RATA, or TOP_PRO_RATA (default: FIFO)
+  --run-bench              Run microbenchmarks of each book operation across book depths and level densities
+  --bench-max-depth N      Max number of resting orders in the book to benchmark (default: 1000000)
+  --md-shm NAME            Publish market data to shared memory object NAME (e.g., /mini-match-md)
+  --run-md-consumer NAME   Read market data from shared memory object NAME and report latency
+  --trace-file FILE        Dump trace events to FILE at exit if built with TRACE (default: mini-match.trace)
+  --decode-trace FILE      Write the timeline and latency percentiles of each stage from trace FILE
+  --price-scale N          Read and write prices as decimals with up to N decimal places (default: integer ticks)
+  --tick-size PRICE        Reject prices that are not a multiple of the decimal PRICE, such as 0.25 (default: 1 unit)
+  --huge-pages MODE        Back the book's memory with none, thp (transparent), or explicit huge pages (default: none)
+  --prefault               Touch the book's memory when allocated, so page faults do not occur while matching
+  --mlock                  Lock the book's memory in RAM
+  --reserve-orders N       Allocate (and prefault or lock) memory for N resting orders at startup (default: 0)
+  --wait-strategy WAIT     Wait for commands on the engine thread with block, spin (needs a core of its own),
+                           or spin_yield with --run-threads (default: block)
+  --cpu-parser N           Pin the thread reading commands to core N with --run-threads
+  --cpu-engine N           Pin the thread running the matching engine and writing output (or benchmarks) to core N,
+                           allocating memory on its NUMA node
+  --sched-fifo PRIORITY    Run the parser and engine threads with the SCHED_FIFO real-time policy at PRIORITY if permitted
+)raw";
+
+Options parse_options(int argc, char * argv[])
+{
+    Options options{};
+    std::string tick_size{}; // Read after the loop since it depends on the price scale.
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string const arg{argv[i]};
+        auto next_arg = [&]() -> std::string
+        {
+            if (i + 1 == argc)
+            {
+                throw std::invalid_argument{"Missing value for option " + arg};
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--run-tests")
+        {
+            options.run_tests = true;
+        }
+        else if (arg == "--run-threads")
+        {
+            options.run_threads = true;
+        }
+        else if (arg == "--allocation")
+        {
+            std::istringstream{next_arg()} >> options.allocation;
+            if (options.allocation == Allocation::Invalid)
+            {
+                throw std::invalid_argument{"Invalid allocation for option " + arg};
+            }
+        }
+        else if (arg == "--run-bench")
+        {
+            options.run_bench = true;
+        }
+        else if (arg == "--bench-max-depth")
+        {
+            options.bench_max_depth = std::stoul(next_arg());
+        }
+        else if (arg == "--md-shm")
+        {
+            options.md_shm_name = next_arg();
+        }
+        else if (arg == "--run-md-consumer")
+        {
+            options.md_consumer_name = next_arg();
+        }
+        else if (arg == "--trace-file")
+        {
+            options.trace_file_name = next_arg();
+        }
+        else if (arg == "--decode-trace")
+        {
+            options.decode_trace_file_name = next_arg();
+        }
+        else if (arg == "--price-scale")
+        {
+            auto const scale = std::stoul(next_arg());
+            if (scale > PriceFormat::max_scale)
+            {
+                throw std::invalid_argument{"Invalid scale for option " + arg};
+            }
+            options.price_format.scale = static_cast<unsigned>(scale);
+            options.has_price_format = true;
+        }
+        else if (arg == "--tick-size")
+        {
+            tick_size = next_arg();
+            options.has_price_format = true;
+        }
+        else if (arg == "--huge-pages")
+        {
+            std::istringstream{next_arg()} >> options.memory.huge_pages;
+            if (options.memory.huge_pages == HugePages::Invalid)
+            {
+                throw std::invalid_argument{"Invalid huge pages for option " + arg};
+            }
+        }
+        else if (arg == "--prefault")
+        {
+            options.memory.prefault = true;
+        }
+        else if (arg == "--mlock")
+        {
+            options.memory.lock = true;
+        }
+        else if (arg == "--reserve-orders")
+        {
+            options.reserve_orders = std::stoul(next_arg());
+        }
+        else if (arg == "--wait-strategy")
+        {
+            std::istringstream{next_arg()} >> options.wait_strategy;
+            if (options.wait_strategy == WaitStrategy::Invalid)
+            {
+                throw std::invalid_argument{"Invalid wait strategy for option " + arg};
+            }
+        }
+        else if (arg == "--cpu-parser" or arg == "--cpu-engine")
+        {
+            auto const cpu = std::stoi(next_arg());
+            cpu_set_t cpus{};
+            if (cpu < 0 or cpu >= CPU_SETSIZE or ::sched_getaffinity(0, sizeof(cpus), &cpus) != 0
+                or not CPU_ISSET(cpu, &cpus))
+            {
+                throw std::invalid_argument{"Unavailable core for option " + arg};
+            }
+            (arg == "--cpu-parser" ? options.parser_placement : options.engine_placement).cpu = cpu;
+        }
+        else if (arg == "--sched-fifo")
+        {
+            auto const priority = std::stoi(next_arg());
+            if (priority < ::sched_get_priority_min(SCHED_FIFO) or priority > ::sched_get_priority_max(SCHED_FIFO))
+            {
+                throw std::invalid_argument{"Invalid priority for option " + arg};
+            }
+            options.parser_placement.fifo_priority = priority;
+            options.engine_placement.fifo_priority = priority;
+        }
+        else
+        {
+            throw std::invalid_argument{"Unknown option " + arg};
+        }
+    }
+
+    if (not tick_size.empty())
+    {
+        std::istringstream is{tick_size};
+        read_decimal(is, options.price_format.scale, options.price_format.tick_size);
+        if (not is or options.price_format.tick_size == 0)
+        {
+            throw std::invalid_argument{"Invalid tick size for option --tick-size"};
+        }
+    }
+    return options;
+}
+
+// NUMA node of a core or -1 if unknown, such as on a system without NUMA.
+int numa_node(int cpu)
+{
+    std::string const nodes_dir = "/sys/devices/system/node/node";
+    for (int node = 0; ::access((nodes_dir + std::to_string(node)).c_str(), F_OK) == 0; ++node)
+    {
+        auto const cpu_link = nodes_dir + std::to_string(node) + "/cpu" + std::to_string(cpu);
+        if (::access(cpu_link.c_str(), F_OK) == 0)
+        {
+            return node;
+        }
+    }
+    return -1;
+}
+
+// Prefer allocating the memory of the calling thread, and of threads it creates later, on the NUMA node of the
+// placement's core, writing the node used as one line to os.
+// Call before making the book, so its memory (and any memory reserved at startup) is local to the engine.
+void place_memory(ThreadPlacement const & placement, std::ostream & os)
+{
+    if (placement.cpu < 0)
+    {
+        return;
+    }
+
+    std::ostringstream line{};
+    line << "PLACEMENT memory";
+    auto const node = numa_node(placement.cpu);
+    if (node < 0 or node >= std::numeric_limits<unsigned long>::digits)
+    {
+        line << " node unknown";
+    }
+    else
+    {
+        line << " node " << node;
+#ifdef __linux__
+        // The kernel reads one bit less than the max node given.
+        unsigned long const nodes = 1UL << node;
+        if (::syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodes, std::numeric_limits<unsigned long>::digits + 1) != 0)
+        {
+            line << " (set_mempolicy: " << std::strerror(errno) << ')';
+        }
+#endif
+    }
+    line << '\n';
+    os << line.str() << std::flush;
+}
+
+// Pin the calling thread to the placement's core and set its scheduling policy, writing where the thread runs
+// as one line to os, so the placement of a run is recorded and can be reproduced.
+// A policy that is not permitted, such as SCHED_FIFO without CAP_SYS_NICE, is reported and left as is.
+void place_thread(char const * name, ThreadPlacement const & placement, std::ostream & os)
+{
+    if (placement.cpu < 0 and placement.fifo_priority == 0)
+    {
+        return;
+    }
+
+    std::string errors{};
+    if (placement.cpu >= 0)
+    {
+        cpu_set_t cpus{};
+        CPU_SET(placement.cpu, &cpus);
+        auto const error = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+        if (error != 0)
+        {
+            errors += std::string{" (pin: "} + std::strerror(error) + ')';
+        }
+    }
+    if (placement.fifo_priority > 0)
+    {
+        sched_param param{};
+        param.sched_priority = placement.fifo_priority;
+        auto const error = ::pthread_setschedparam(::pthread_self(), SCHED_FIFO, &param);
+        if (error != 0)
+        {
+            errors += std::string{" (SCHED_FIFO: "} + std::strerror(error) + ')';
+        }
+    }
+
+    auto const cpu = ::sched_getcpu();
+    int policy = 0;
+    sched_param param{};
+    ::pthread_getschedparam(::pthread_self(), &policy, &param);
+    std::ostringstream line{};
+    line << "PLACEMENT thread " << name
+        << " cpu " << cpu
+        << " node " << numa_node(cpu)
+        << " sched " << (policy == SCHED_FIFO ? "FIFO" : "OTHER")
+        << " priority " << param.sched_priority
+        << errors
+        << '\n';
+    os << line.str() << std::flush;
+}
+
+// Sample market data consumer that reads all events until the publisher is done and reports the latency
+// from publication to reading each event.
+void run_md_consumer(std::string const & name)
+{
+    // Wait for the publisher to create the shared memory object.
+    std::unique_ptr<MarketDataReader> reader{};
+    while (not reader)
+    {
+        try
+        {
+            reader = std::make_unique<MarketDataReader>(name);
+        }
+        catch (std::exception const & error)
+        {
+            IF_DEBUG(std::cerr << error.what() << std::endl;)
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        }
+    }
+
+    std::vector<std::uint64_t> latencies_ns{};
+    latencies_ns.reserve(1 << 20);
+    MarketDataEvent event{};
+    while (true)
+    {
+        if (reader->try_read(event))
+        {
+            latencies_ns.push_back(now_ns() - event.timestamp_ns);
+            IF_DEBUG(std::cout << event << '\n';)
+        }
+        else if (reader->closed())
+        {
+            // Drain events published before closing.
+            while (reader->try_read(event))
+            {
+                latencies_ns.push_back(now_ns() - event.timestamp_ns);
+            }
+            break;
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    std::cout << "events: " << latencies_ns.size()
+        << " lost: " << reader->lost()
+        << " overruns: " << reader->overruns()
+        << std::endl;
+    if (latencies_ns.empty())
+    {
+        return;
+    }
+
+    std::sort(latencies_ns.begin(), latencies_ns.end());
+    auto percentile = [&](double p)
+    {
+        return latencies_ns[static_cast<std::size_t>(p * (latencies_ns.size() - 1))];
+    };
+    std::cout << "latency_ns:"
+        << " min " << latencies_ns.front()
+        << " p50 " << percentile(0.50)
+        << " p99 " << percentile(0.99)
+        << " p99.9 " << percentile(0.999)
+        << " max " << latencies_ns.back()
+        << std::endl;
+}
+
+}
+
+int
+main(int argc, char * argv[])
+try
+{
+    auto const options = parse_options(argc, argv);
+    PageMapper::instance().options(options.memory);
+    if (options.run_tests)
+    {
+        return run_all_tests() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Allocate memory on the engine core's NUMA node from here on, including the book's.
+    place_memory(options.engine_placement, std::cerr);
+
+    if (options.run_bench)
+    {
+        place_thread("bench", options.engine_placement, std::cerr);
+        run_all_benchmarks(options.bench_max_depth);
+        return EXIT_SUCCESS;
+    }
+
+    if (not options.md_consumer_name.empty())
+    {
+        run_md_consumer(options.md_consumer_name);
+        return EXIT_SUCCESS;
+    }
+
+    if (not options.decode_trace_file_name.empty())
+    {
+        std::ifstream is{options.decode_trace_file_name, std::ios::binary};
+        if (not is)
+        {
+            throw std::runtime_error{"Unable to open trace file " + options.decode_trace_file_name};
+        }
+        decode_trace(is, std::cout);
+        return EXIT_SUCCESS;
+    }
+
+    MarketDataPublisherPtr publisher{};
+    if (not options.md_shm_name.empty())
+    {
+        publisher = std::make_shared<MarketDataPublisher>(options.md_shm_name);
+    }
+
+    if (options.has_price_format)
+    {
+        price_format(std::cin, &options.price_format);
+        price_format(std::cout, &options.price_format);
+    }
+
+    auto book = std::make_shared<Book>(options.allocation);
+    book->reserve(options.reserve_orders);
+    auto matching_engine = std::make_shared<MatchingEngine>(book, publisher);
+    if (options.run_threads)
+    {
+        // Run with multiple threads.
+        auto task_queue = std::make_shared<TaskQueue>();
+        QueueingCommandProcessor cmd_processor{task_queue, matching_engine, std::cout};
+        std::thread producer{
+            [&cmd_processor, task_queue, &options]()
+            {
+                place_thread("parser", options.parser_placement, std::cerr);
+                cmd_processor.run(std::cin);
+                task_queue->close();
+            }};
+
+        std::thread consumer{
+            [task_queue, &options]()
+            {
+                place_thread("engine", options.engine_placement, std::cerr);
+
+                // Execute tasks until the producer is done and all of its tasks are executed.
+                Task task{};
+                while (task_queue->wait_and_pop(task, options.wait_strategy))
+                {
+                    task();
+                }
+            }};
+
+        producer.join();
+        consumer.join();
+    }
+    else
+    {
+        // Single threaded.
+        place_thread("engine", options.engine_placement, std::cerr);
+        CommandProcessor cmd_processor{matching_engine, std::cout};
+        //CommandWriter cmd_processor{std::cout};
+        cmd_processor.run(std::cin);
+        //run_test(matching_engine);
+    }
+
+    // Dump stats at exit separately from the command output.
+    matching_engine->write_stats(std::cerr);
+    auto && memory = options.memory;
+    if (memory.huge_pages != HugePages::None or memory.prefault or memory.lock)
+    {
+        PageMapper::instance().write_stats(std::cerr);
+    }
+#ifdef TRACE
+    Tracer::instance().dump(options.trace_file_name);
+#endif
+    return EXIT_SUCCESS;
+}
+catch (std::exception const & error)
+{
+    std::cerr << error.what() << '\n' << usage;
+    return EXIT_FAILURE;
+}
+
+
+/*
+ * 9. Unit Tests - Tests matching engine with various inputs.
+ */
+
+namespace {
+
+void run_test(MatchingEnginePtr const & matching_engine)
+{
+    // Auto-generate orders to test the matching engine.
+    std::uint64_t order_id = 0;
+    for (std::uint64_t i = 0; i != 10; ++i)
+    {
+        auto msg = BuyOrder{TIF::GFD, Price{static_cast<Price::value_type>(100 * i + 100)}, Qty{static_cast<Qty::value_type>(i + 1)}, OrderID{"order_" + std::to_string(order_id++)}};
+        std::cout << msg << std::endl;
+        matching_engine->handle(msg);
+        std::cout << matching_engine->trades();
+    }
+    std::cout << *matching_engine->book() << std::endl;
+
+    for (std::uint64_t i = 0; i != 10; ++i)
+    {
+        auto msg = SellOrder{TIF::GFD, Price{static_cast<Price::value_type>(100 * i + 100)}, Qty{static_cast<Qty::value_type>(i + 1)}, OrderID{"order_" + std::to_string(order_id++)}};
+        std::cout << msg << std::endl;
+        matching_engine->handle(msg);
+        std::cout << matching_engine->trades();
+    }
+    std::cout << *matching_engine->book() << std::endl;
+
+    {
+        auto msg = ModifyOrder{OrderID{"order_19"}, Side::Buy, Price{700}, Qty{18}};
+        std::cout << msg << std::endl;
+        matching_engine->handle(msg);
+        std::cout << *matching_engine->book() << std::endl;
+        std::cout << matching_engine->trades();
+    }
+    {
+        //auto msg = ModifyOrder{OrderID{"order_19"}, Side::Sell, Price{100}, Qty{37}};
+        //auto msg = ModifyOrder{OrderID{"order_19"}, Side::Buy, Price{1000}, Qty{18}};
+        auto msg = ModifyOrder{OrderID{"order_19"}, Side::Sell, Price{100}, Qty{18}};
+        std::cout << msg << std::endl;
+        matching_engine->handle(msg);
+        std::cout << *matching_engine->book() << std::endl;
+        std::cout << matching_engine->trades();
+    }
+}
+
+bool run_test_1();
+bool run_test_2();
+bool run_test_3();
+bool run_test_4();
+bool run_test_5();
 bool run_test_6();
 bool run_test_7();
 bool run_test_8();
@@ -1647,411 +7271,2076 @@ bool run_test_19();
 bool run_test_20();
 bool run_test_21();
 bool run_test_22();
+bool run_test_23();
+bool run_test_24();
+bool run_test_25();
+bool run_test_26();
+bool run_test_27();
+bool run_test_28();
+bool run_test_29();
+bool run_test_30();
+bool run_test_31();
+bool run_test_32();
+bool run_test_33();
+bool run_test_34();
+bool run_test_35();
+bool run_test_36();
+bool run_test_37();
+bool run_test_38();
+bool run_test_39();
+bool run_test_40();
+bool run_test_41();
+bool run_test_42();
+bool run_test_43();
+bool run_test_44();
+bool run_test_45();
+bool run_test_46();
+bool run_test_47();
+bool run_test_48();
+
+bool run_all_tests()
+{
+    bool ok = true;
+    ok = run_test_1() and ok;
+    ok = run_test_2() and ok;
+    ok = run_test_3() and ok;
+    ok = run_test_4() and ok;
+    ok = run_test_5() and ok;
+    ok = run_test_6() and ok;
+    ok = run_test_7() and ok;
+    ok = run_test_8() and ok;
+    ok = run_test_9() and ok;
+    ok = run_test_10() and ok;
+    ok = run_test_11() and ok;
+    ok = run_test_12() and ok;
+    ok = run_test_13() and ok;
+    ok = run_test_14() and ok;
+    ok = run_test_15() and ok;
+    ok = run_test_16() and ok;
+    ok = run_test_17() and ok;
+    ok = run_test_18() and ok;
+    ok = run_test_19() and ok;
+    ok = run_test_20() and ok;
+    ok = run_test_21() and ok;
+    ok = run_test_22() and ok;
+    ok = run_test_23() and ok;
+    ok = run_test_24() and ok;
+    ok = run_test_25() and ok;
+    ok = run_test_26() and ok;
+    ok = run_test_27() and ok;
+    ok = run_test_28() and ok;
+    ok = run_test_29() and ok;
+    ok = run_test_30() and ok;
+    ok = run_test_31() and ok;
+    ok = run_test_32() and ok;
+    ok = run_test_33() and ok;
+    ok = run_test_34() and ok;
+    ok = run_test_35() and ok;
+    ok = run_test_36() and ok;
+    ok = run_test_37() and ok;
+    ok = run_test_38() and ok;
+    ok = run_test_39() and ok;
+    ok = run_test_40() and ok;
+    ok = run_test_41() and ok;
+    ok = run_test_42() and ok;
+    ok = run_test_43() and ok;
+    ok = run_test_44() and ok;
+    ok = run_test_45() and ok;
+    ok = run_test_46() and ok;
+    ok = run_test_47() and ok;
+    ok = run_test_48() and ok;
+    return ok;
+}
+
+bool check_test(std::string const & test_name, std::string const & input, std::string const & expected_output,
+    std::string const & output)
+{
+    if (output == expected_output)
+    {
+        std::cout << "OK: " << test_name << std::endl;
+        return true;
+    }
+
+    std::cout << "FAIL: " << test_name << std::endl;
+    std::cout << "Input:" << std::endl;
+    std::cout << input << std::endl;
+    std::cout << "Expected:" << std::endl;
+    std::cout << expected_output << std::endl;
+    std::cout << "Actual:" << std::endl;
+    std::cout << output << std::endl;
+    return false;
+}
+
+bool run_test(std::string const & test_name, std::string const & input, std::string const & expected_output)
+{
+    std::stringstream is{};
+    is << input;
+
+    std::stringstream os{};
+    auto book = std::make_shared<Book>();
+    auto matching_engine = std::make_shared<MatchingEngine>(book);
+    CommandProcessor cmd_processor{matching_engine, os};
+    cmd_processor.run(is);
+
+    return check_test(test_name, input, expected_output, os.str());
+}
+
+// Test only the output lines starting with prefix, such as to skip lines with timings.
+bool run_test(std::string const & test_name, std::string const & input, std::string const & expected_output,
+    std::string const & prefix)
+{
+    std::stringstream is{};
+    is << input;
+
+    std::stringstream os{};
+    auto book = std::make_shared<Book>();
+    auto matching_engine = std::make_shared<MatchingEngine>(book);
+    CommandProcessor cmd_processor{matching_engine, os};
+    cmd_processor.run(is);
+
+    std::string output{};
+    std::string line{};
+    while (std::getline(os, line))
+    {
+        if (line.compare(0, prefix.size(), prefix) == 0)
+        {
+            output += line + '\n';
+        }
+    }
+    return check_test(test_name, input, expected_output, output);
+}
+
+// Test with commands and output using the decimal price format.
+bool run_test(std::string const & test_name, std::string const & input, std::string const & expected_output,
+    PriceFormat const & format)
+{
+    std::stringstream is{};
+    is << input;
+    price_format(is, &format);
+
+    std::stringstream os{};
+    price_format(os, &format);
+    auto book = std::make_shared<Book>();
+    auto matching_engine = std::make_shared<MatchingEngine>(book);
+    CommandProcessor cmd_processor{matching_engine, os};
+    cmd_processor.run(is);
+
+    return check_test(test_name, input, expected_output, os.str());
+}
+
+// Test with a book using the allocation policy.
+bool run_test(std::string const & test_name, std::string const & input, std::string const & expected_output,
+    Allocation allocation)
+{
+    std::stringstream is{};
+    is << input;
+
+    std::stringstream os{};
+    auto book = std::make_shared<Book>(allocation);
+    auto matching_engine = std::make_shared<MatchingEngine>(book);
+    CommandProcessor cmd_processor{matching_engine, os};
+    cmd_processor.run(is);
+
+    return check_test(test_name, input, expected_output, os.str());
+}
+
+// Test with a book whose memory is reserved for orders with the memory options, restoring the options after.
+bool run_test(std::string const & test_name, std::string const & input, std::string const & expected_output,
+    MemoryOptions const & memory, std::size_t reserve_orders)
+{
+    std::stringstream is{};
+    is << input;
+
+    std::stringstream os{};
+    auto const previous_memory = PageMapper::instance().options();
+    PageMapper::instance().options(memory);
+    {
+        auto book = std::make_shared<Book>();
+        book->reserve(reserve_orders);
+        auto matching_engine = std::make_shared<MatchingEngine>(book);
+        CommandProcessor cmd_processor{matching_engine, os};
+        cmd_processor.run(is);
+    }
+    PageMapper::instance().options(previous_memory);
+
+    return check_test(test_name, input, expected_output, os.str());
+}
+
+// Test with commands read on a parser thread and executed on an engine thread that waits with the strategy.
+bool run_test(std::string const & test_name, std::string const & input, std::string const & expected_output,
+    WaitStrategy strategy)
+{
+    std::stringstream is{};
+    is << input;
+
+    std::stringstream os{};
+    auto book = std::make_shared<Book>();
+    auto matching_engine = std::make_shared<MatchingEngine>(book);
+    auto task_queue = std::make_shared<TaskQueue>();
+    QueueingCommandProcessor cmd_processor{task_queue, matching_engine, os};
+    std::thread producer{
+        [&cmd_processor, &is, task_queue]()
+        {
+            cmd_processor.run(is);
+            task_queue->close();
+        }};
+    Task task{};
+    while (task_queue->wait_and_pop(task, strategy))
+    {
+        task();
+    }
+    producer.join();
+
+    std::ostringstream name{};
+    name << test_name << " (" << strategy << ')';
+    return check_test(name.str(), input, expected_output, os.str());
+}
+
+// Test the market data published to shared memory instead of the command output.
+bool run_market_data_test(std::string const & test_name, std::string const & input, std::string const & expected_output)
+{
+    std::stringstream is{};
+    is << input;
+
+    std::stringstream os{};
+    {
+        std::string const shm_name = "/mini-match-test-" + std::to_string(::getpid());
+        auto publisher = std::make_shared<MarketDataPublisher>(shm_name, 64);
+        MarketDataReader reader{shm_name};
+        ::shm_unlink(shm_name.c_str()); // Remove name now that both are mapped.
+
+        std::stringstream cmd_os{};
+        auto book = std::make_shared<Book>();
+        auto matching_engine = std::make_shared<MatchingEngine>(book, publisher);
+        CommandProcessor cmd_processor{matching_engine, cmd_os};
+        cmd_processor.run(is);
+
+        MarketDataEvent event{};
+        while (reader.try_read(event))
+        {
+            os << event << '\n';
+        }
+    }
+
+    return check_test(test_name, input, expected_output, os.str());
+}
+
+bool run_test_1()
+{
+    return run_test("Example 1",
+R"raw(BUY GFD 1000 10 order1
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+1000 10
+)raw");
+}
+
+bool run_test_2()
+{
+    return run_test("Example 2",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 20 order2
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+1000 30
+)raw");
+}
+
+bool run_test_3()
+{
+    return run_test("Example 3",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1001 20 order2
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+1001 20
+1000 10
+)raw");
+}
+
+bool run_test_4()
+{
+    return run_test("Example 4",
+R"raw(BUY GFD 1000 10 order1
+SELL GFD 900 20 order2
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order2 900 10
+SELL:
+900 10
+BUY:
+)raw");
+}
+
+bool run_test_5()
+{
+    return run_test("Example 5",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1010 10 order2
+SELL GFD 1000 15 order3
+)raw",
+R"raw(TRADE order2 1010 10 order3 1000 10
+TRADE order1 1000 5 order3 1000 5
+)raw");
+}
+
+bool run_test_6()
+{
+    return run_test("Modify",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 10 order2
+MODIFY order1 BUY 1000 20
+SELL GFD 900 20 order3
+)raw",
+R"raw(TRADE order2 1000 10 order3 900 10
+TRADE order1 1000 10 order3 900 10
+)raw");
+}
+
+
+bool run_test_7()
+{
+    return run_test("Multiple orders",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 15 order2
+BUY GFD 900 20 order3
+BUY GFD 800 15 order4
+SELL GFD 1100 30 order5
+SELL GFD 1200 50 order6
+SELL GFD 1200 70 order7
+SELL GFD 1300 60 order8
+PRINT
+BUY GFD 1200 160 order9
+PRINT
+)raw",
+R"raw(SELL:
+1300 60
+1200 120
+1100 30
+BUY:
+1000 25
+900 20
+800 15
+TRADE order5 1100 30 order9 1200 30
+TRADE order6 1200 50 order9 1200 50
+TRADE order7 1200 70 order9 1200 70
+SELL:
+1300 60
+BUY:
+1200 10
+1000 25
+900 20
+800 15
+)raw");
+}
+
+bool run_test_8()
+{
+    return run_test("Trade 1 - 2 orders at same price, full fill",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 10 order2
+MODIFY order1 BUY 1000 20
+SELL GFD 900 20 order3
+BUY GFD 1000 10 order1
+PRINT
+BUY GFD 1000 10 order2
+PRINT
+SELL GFD 900 20 order3
+PRINT
+)raw",
+R"raw(TRADE order2 1000 10 order3 900 10
+TRADE order1 1000 10 order3 900 10
+SELL:
+BUY:
+1000 10
+SELL:
+BUY:
+1000 20
+TRADE order1 1000 10 order3 900 10
+TRADE order2 1000 10 order3 900 10
+SELL:
+BUY:
+)raw");
+}
+
+bool run_test_9()
+{
+    return run_test("Trade 2 - 2 orders at different prices, partial fill",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1010 10 order2
+SELL GFD 1000 15 order3
+PRINT
+)raw",
+R"raw(TRADE order2 1010 10 order3 1000 10
+TRADE order1 1000 5 order3 1000 5
+SELL:
+BUY:
+1000 5
+)raw");
+}
+
+
+bool run_test_10()
+{
+    return run_test("Self-match prevention test - should fully fill order2 and cancel original order1",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 10 order2
+MODIFY order1 SELL 1000 10
+PRINT
+)raw",
+R"raw(TRADE order2 1000 10 order1 1000 10
+SELL:
+BUY:
+)raw");
+}
+
+
+bool run_test_11()
+{
+    return run_test("Self-match prevention test - should partially fill order2 and modify original order1",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 5 order2
+MODIFY order1 SELL 900 10
+PRINT
+)raw",
+R"raw(TRADE order2 1000 5 order1 900 5
+SELL:
+900 5
+BUY:
+)raw");
+}
+
+
+bool run_test_12()
+{
+    return run_test("IOC - book is empty so no matching and orders are not added to book",
+R"raw(BUY IOC 1000 10 order1
+SELL IOC 1000 10 order2
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+)raw");
+}
+
+
+bool run_test_13()
+{
+    return run_test("IOC - full fill, no orders left",
+R"raw(BUY GFD 1000 10 order1
+SELL IOC 1000 10 order2
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order2 1000 10
+SELL:
+BUY:
+)raw");
+}
+
+bool run_test_14()
+{
+    return run_test("IOC - full fill, order left",
+R"raw(BUY GFD 1000 15 order1
+SELL IOC 1000 10 order2
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order2 1000 10
+SELL:
+BUY:
+1000 5
+)raw");
+}
+
+bool run_test_15()
+{
+    return run_test("IOC - partial fill, non-IOC order is left",
+R"raw(BUY GFD 900 5 order1
+BUY GFD 1000 5 order2
+SELL IOC 1000 10 order3
+PRINT
+)raw",
+R"raw(TRADE order2 1000 5 order3 1000 5
+SELL:
+BUY:
+900 5
+)raw");
+}
+
+bool run_test_16()
+{
+    return run_test("IOC - full fill over multiple orders, non-IOC order is left",
+R"raw(BUY GFD 900 5 order1
+BUY GFD 1000 5 order2
+BUY GFD 1100 5 order3
+SELL IOC 1000 10 order4
+PRINT
+)raw",
+R"raw(TRADE order3 1100 5 order4 1000 5
+TRADE order2 1000 5 order4 1000 5
+SELL:
+BUY:
+900 5
+)raw");
+}
+
+bool run_test_17()
+{
+    return run_test("Duplicate order id when adding",
+R"raw(BUY GFD 900 5 order1
+BUY GFD 900 5 order1
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+900 5
+)raw");
+}
+
+
+bool run_test_18()
+{
+    return run_test("Unknown order id when cancelling",
+R"raw(CANCEL unknown
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+)raw");
+}
 
-void run_all_tests()
-{
-    run_test_1();
-    run_test_2();
-    run_test_3();
-    run_test_4();
-    run_test_5();
-    run_test_6();
-    run_test_7();
-    run_test_8();
-    run_test_9();
-    run_test_10();
-    run_test_11();
-    run_test_12();
-    run_test_13();
-    run_test_14();
-    run_test_15();
-    run_test_16();
-    run_test_17();
-    run_test_18();
-    run_test_19();
-    run_test_20();
-    run_test_21();
-    run_test_22();
+bool run_test_19()
+{
+    return run_test("Unknown order id when modifying",
+R"raw(MODIFY unknown BUY 1000 20
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+)raw");
 }
 
-bool run_test(std::string const & test_name, std::string const & input, std::string const & expected_output)
+
+bool run_test_20()
 {
-    std::stringstream is{};
-    is << input;
+    return run_test("Invalid price and qty",
+R"raw(BUY GFD a 5 order1
+BUY GFD 900 b order1
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+)raw");
+}
+
+
+bool run_test_21()
+{
+    return run_test("Trade - 2 sell orders at same price, full fill",
+R"raw(SELL GFD 1000 10 order1
+PRINT
+SELL GFD 1000 10 order2
+PRINT
+BUY GFD 1100 20 order3
+PRINT
+)raw",
+R"raw(SELL:
+1000 10
+BUY:
+SELL:
+1000 20
+BUY:
+TRADE order1 1000 10 order3 1100 10
+TRADE order2 1000 10 order3 1100 10
+SELL:
+BUY:
+)raw");
+}
+
+bool run_test_22()
+{
+    return run_test("Modify queue position - should partially fill order1 since back of the queue after modify",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 10 order2
+MODIFY order1 BUY 1000 10
+SELL GFD 1000 15 order3
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order3 1000 10
+TRADE order2 1000 5 order3 1000 5
+SELL:
+BUY:
+1000 5
+)raw");
+}
+
+bool run_test_23()
+{
+    return run_market_data_test("Market data - level updates, trades, and top of book",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 20 order2
+SELL GFD 1100 5 order3
+MODIFY order3 SELL 1200 5
+SELL IOC 1000 15 order4
+CANCEL order2
+CLEAR
+)raw",
+R"raw(LEVEL BUY 1000 10
+TOP 1000 10 0 0
+LEVEL BUY 1000 30
+TOP 1000 30 0 0
+LEVEL SELL 1100 5
+TOP 1000 30 1100 5
+LEVEL SELL 1100 0
+LEVEL SELL 1200 5
+TOP 1000 30 1200 5
+TRADE SELL 1000 10
+TRADE SELL 1000 5
+LEVEL BUY 1000 20
+LEVEL BUY 1000 15
+TOP 1000 15 1200 5
+LEVEL BUY 1000 0
+TOP 0 0 1200 5
+CLEAR
+TOP 0 0 0 0
+)raw");
+}
+
+bool run_test_24()
+{
+    return run_test("Stats - counters",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 20 order2
+BUY GFD 900 5 order3
+BUY GFD 900 5 order3
+SELL GFD 1100 5 order4
+MODIFY order4 SELL 1200 5
+SELL IOC 1000 15 order5
+CANCEL order2
+CANCEL order2
+BUY GFD 0 5 order6
+UNKNOWN
+STATS
+CLEAR
+STATS
+)raw",
+R"raw(STATS adds 6 cancels 2 modifies 1 clears 0 trades 2 rejects 4 levels_created 4 levels_erased 2 orders 2 peak_orders 4
+STATS adds 6 cancels 2 modifies 1 clears 1 trades 2 rejects 4 levels_created 4 levels_erased 4 orders 0 peak_orders 4
+)raw",
+    "STATS");
+}
+
+bool run_test_25()
+{
+    // Check that every value is recorded in a bucket whose range includes it.
+    for (std::uint64_t value : {0ull, 1ull, 15ull, 16ull, 31ull, 32ull, 33ull, 1000ull, 123456789ull, ~0ull})
+    {
+        auto const index = LatencyHistogram::index(value);
+        if (value < LatencyHistogram::lowest_value(index)
+            or (index + 1 < LatencyHistogram::bucket_count and value >= LatencyHistogram::lowest_value(index + 1)))
+        {
+            std::cout << "FAIL: Latency histogram buckets - value " << value << " index " << index << std::endl;
+            return false;
+        }
+    }
+
+    LatencyHistogram histogram{};
+    for (std::uint64_t value = 1; value <= 1000; ++value)
+    {
+        histogram.record(value);
+    }
+    auto const p50 = histogram.percentile(50.0);
+    auto const p99 = histogram.percentile(99.0);
+    if (histogram.count() != 1000 or histogram.max() != 1000 or histogram.mean() != 500.5
+        or p50 < 500 or p50 > 500 + 500 / LatencyHistogram::sub_bucket_count
+        or p99 < 990 or p99 > 1000
+        or histogram.percentile(100.0) != 1000)
+    {
+        std::cout << "FAIL: Latency histogram percentiles - p50 " << p50 << " p99 " << p99 << std::endl;
+        return false;
+    }
+
+    std::cout << "OK: Latency histogram" << std::endl;
+    return true;
+}
+
+bool run_test_26()
+{
+    // Decode a trace with 2 ticks per ns of 2 commands (one matching) on one thread and an output stage on another.
+    std::stringstream trace{};
+    TraceFileHeader const header{TraceFileHeader::magic_value, 0.5, 12};
+    trace.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    for (auto && record : std::vector<TraceRecord>{
+          {1000, 0, TraceEvent::DispatchBegin, 0, 0}
+        , {1020, 0, TraceEvent::ParseBegin, 0, 0}
+        , {1060, 0, TraceEvent::ParseEnd, 0, 0}
+        , {1100, 0, TraceEvent::EngineBegin, 0, 0}
+        , {1120, 10, TraceEvent::MatchBegin, 0, 0}
+        , {1200, 1, TraceEvent::MatchEnd, 0, 0}
+        , {1300, 0, TraceEvent::EngineEnd, 0, 0}
+        , {1310, 1, TraceEvent::OutputBegin, 1, 0}
+        , {1400, 0, TraceEvent::DispatchEnd, 0, 0}
+        , {1410, 1, TraceEvent::OutputEnd, 1, 0}
+        , {2000, 1, TraceEvent::DispatchBegin, 0, 0}
+        , {2200, 0, TraceEvent::DispatchEnd, 0, 0}
+        })
+    {
+        trace.write(reinterpret_cast<char const *>(&record), sizeof(record));
+    }
 
     std::stringstream os{};
+    decode_trace(trace, os);
+    return check_test("Trace decoder", "", R"raw(0 T0 DISPATCH_BEGIN 0
+10 T0 PARSE_BEGIN 0
+30 T0 PARSE_END 0
+50 T0 ENGINE_BEGIN 0
+60 T0 MATCH_BEGIN 10
+100 T0 MATCH_END 1
+150 T0 ENGINE_END 0
+155 T1 OUTPUT_BEGIN 1
+200 T0 DISPATCH_END 0
+205 T1 OUTPUT_END 1
+500 T0 DISPATCH_BEGIN 1
+600 T0 DISPATCH_END 0
+STAGE DISPATCH count 2 mean_ns 150 p50_ns 104 p99_ns 200 p999_ns 200 max_ns 200
+STAGE PARSE count 1 mean_ns 20 p50_ns 20 p99_ns 20 p999_ns 20 max_ns 20
+STAGE ENGINE count 1 mean_ns 100 p50_ns 100 p99_ns 100 p999_ns 100 max_ns 100
+STAGE MATCH count 1 mean_ns 40 p50_ns 40 p99_ns 40 p999_ns 40 max_ns 40
+STAGE FILL count 0 mean_ns 0 p50_ns 0 p99_ns 0 p999_ns 0 max_ns 0
+STAGE PUBLISH count 0 mean_ns 0 p50_ns 0 p99_ns 0 p999_ns 0 max_ns 0
+STAGE OUTPUT count 1 mean_ns 50 p50_ns 50 p99_ns 50 p999_ns 50 max_ns 50
+)raw", os.str());
+}
+
+bool run_test_27()
+{
+    // Messages for one round of adding, modifying, matching, and cancelling orders.
+    // Order IDs are too long to fit in a string's inline buffer, so copying them would allocate.
+    std::vector<BuyOrder> buys{};
+    std::vector<SellOrder> sells{};
+    std::vector<ModifyOrder> modifies{};
+    std::vector<CancelOrder> cancels{};
+    std::vector<CancelOrder> cancel_rests{};
+    for (std::uint64_t i = 0; i != 100; ++i)
+    {
+        buys.push_back(BuyOrder{TIF::GFD, Price{static_cast<Price::value_type>(1000 - i % 10)}, Qty{10}, OrderID{"client-order-buy-" + std::to_string(1000000 + i)}});
+        sells.push_back(SellOrder{TIF::GFD, Price{static_cast<Price::value_type>(1001 + i % 10)}, Qty{10}, OrderID{"client-order-sell-" + std::to_string(1000000 + i)}});
+        if (i % 4 == 0)
+        {
+            modifies.push_back(ModifyOrder{OrderID{"client-order-buy-" + std::to_string(1000000 + i)}, Side::Buy, Price{static_cast<Price::value_type>(990 - i % 10)}, Qty{5}});
+        }
+        if (i % 4 == 1)
+        {
+            cancels.push_back(CancelOrder{OrderID{"client-order-sell-" + std::to_string(1000000 + i)}});
+        }
+    }
+    for (auto && msg : buys) { cancel_rests.push_back(CancelOrder{msg.order_id}); }
+    for (auto && msg : sells) { cancel_rests.push_back(CancelOrder{msg.order_id}); }
+    auto const aggressive_buy = BuyOrder{TIF::IOC, Price{1005}, Qty{255}, OrderID{"client-order-aggressive-buy"}};
+    auto const aggressive_sell = SellOrder{TIF::GFD, Price{995}, Qty{305}, OrderID{"client-order-aggressive-sell"}};
+
     auto book = std::make_shared<Book>();
     auto matching_engine = std::make_shared<MatchingEngine>(book);
-    CommandProcessor cmd_processor{matching_engine, os};
-    cmd_processor.run(is);
+    auto run_round = [&]()
+    {
+        for (auto && msg : buys) { matching_engine->handle(msg); }
+        for (auto && msg : sells) { matching_engine->handle(msg); }
+        for (auto && msg : modifies) { matching_engine->handle(msg); }
+        for (auto && msg : cancels) { matching_engine->handle(msg); }
+        matching_engine->handle(aggressive_buy);
+        matching_engine->handle(aggressive_sell);
+        for (auto && msg : cancel_rests) { matching_engine->handle(msg); }
+        matching_engine->handle(ClearBook{});
+    };
+
+#ifndef COUNT_ALLOCS
+    std::cout << "SKIP: Zero allocations in steady state (requires building with -DCOUNT_ALLOCS)" << std::endl;
+    return true;
+#endif
 
-    if (os.str() == expected_output)
+    // Warm up the node pool, containers, etc., then check that another round does not allocate.
+    run_round();
+    run_round();
+    auto const start_trades = matching_engine->stats().trades;
+    auto const start_allocs = AllocCounter::count();
+    run_round();
+    auto const allocs = AllocCounter::count() - start_allocs;
+    auto const trades = matching_engine->stats().trades - start_trades;
+
+    if (allocs.allocs != 0 or allocs.frees != 0 or trades == 0)
     {
-        std::cout << "OK: " << test_name << std::endl;
-        return true;
+        std::cout << "FAIL: Zero allocations in steady state - allocs " << allocs.allocs
+            << " frees " << allocs.frees
+            << " bytes " << allocs.bytes
+            << " trades " << trades
+            << std::endl;
+        return false;
     }
+    std::cout << "OK: Zero allocations in steady state" << std::endl;
+    return true;
+}
 
-    std::cout << "FAIL: " << test_name << std::endl;
-    std::cout << "Input:" << std::endl;
-    std::cout << is.str() << std::endl;
-    std::cout << "Expected:" << std::endl;
-    std::cout << expected_output << std::endl;
-    std::cout << "Actual:" << std::endl;
-    std::cout << os.str() << std::endl;
-    return false;
+bool run_test_28()
+{
+    return run_test("Auction - orders rest without matching until uncrossed at the max executable qty",
+R"raw(AUCTION
+BUY GFD 1010 10 order1
+BUY GFD 1005 5 order2
+SELL GFD 1000 8 order3
+SELL GFD 1005 6 order4
+SELL IOC 1000 5 order5
+PRINT
+UNCROSS
+PRINT
+SELL GFD 1005 1 order6
+AUCTION
+BUY GFD 1010 5 order7
+SELL GFD 1000 5 order8
+UNCROSS 1006
+AUCTION
+BUY GFD 1010 5 order9
+SELL GFD 1000 5 order10
+UNCROSS
+)raw",
+R"raw(SELL:
+1005 6
+1000 8
+BUY:
+1010 10
+1005 5
+TRADE order3 1005 8 order1 1005 8
+TRADE order4 1005 2 order1 1005 2
+TRADE order4 1005 4 order2 1005 4
+SELL:
+BUY:
+1005 1
+TRADE order2 1005 1 order6 1005 1
+TRADE order8 1010 5 order7 1010 5
+TRADE order10 1010 5 order9 1010 5
+)raw");
 }
 
-bool run_test_1()
+bool run_test_29()
+{
+    bool ok = run_test("Pro-rata allocation - shares rounded down with remaining lots in time priority",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 20 order2
+BUY GFD 1000 30 order3
+BUY GFD 999 10 order4
+SELL IOC 1000 31 order5
+PRINT
+MODIFY order3 SELL 999 20
+PRINT
+)raw",
+R"raw(TRADE order1 1000 6 order5 1000 6
+TRADE order2 1000 10 order5 1000 10
+TRADE order3 1000 15 order5 1000 15
+SELL:
+BUY:
+1000 29
+999 10
+TRADE order1 1000 4 order3 999 4
+TRADE order2 1000 10 order3 999 10
+TRADE order4 999 6 order3 999 6
+SELL:
+BUY:
+999 4
+)raw",
+        Allocation::ProRata);
+
+    ok = run_test("Top order pro-rata allocation - first order fills first, then the rest pro-rata",
+R"raw(BUY GFD 1000 10 order1
+BUY GFD 1000 20 order2
+BUY GFD 1000 30 order3
+SELL GFD 1000 31 order4
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order4 1000 10
+TRADE order2 1000 9 order4 1000 9
+TRADE order3 1000 12 order4 1000 12
+SELL:
+BUY:
+1000 29
+)raw",
+        Allocation::TopOrderProRata) and ok;
+    return ok;
+}
+
+bool run_test_30()
+{
+    return run_test("FOK and min qty - kill without trading unless enough qty can trade immediately",
+R"raw(SELL GFD 1000 10 order1
+SELL GFD 1001 10 order2
+SELL GFD 1003 10 order3
+BUY FOK 1001 21 order4
+BUY GFD 1001 21 order5 MIN 21
+BUY FOK 1001 15 order6
+BUY GFD 1001 10 order7 MIN 3
+BUY IOC 1003 20 order8 MIN 40
+BUY GFD 1003 5 order9 MIN 6
+BUY GFD 1003 5 order10 BAD 6
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order6 1001 10
+TRADE order2 1001 5 order6 1001 5
+TRADE order2 1001 5 order7 1001 5
+SELL:
+1003 10
+BUY:
+1001 5
+)raw");
+}
+
+bool run_test_31()
+{
+    return run_test("Market order - sweeps from the best price, within the band if set, and never rests, rejecting a negative band",
+R"raw(SELL GFD 1000 10 order1
+SELL GFD 1001 10 order2
+SELL GFD 1005 10 order3
+BUY GFD 990 10 order4
+BUY GFD 980 10 order5
+MARKET BUY 15 order6
+MARKET BUY 20 order7 2
+MARKET SELL 25 order8
+MARKET SELL 5 order9
+MARKET BUY 7 m1 -1
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order6 1000 10
+TRADE order2 1001 5 order6 1001 5
+TRADE order2 1001 5 order7 1001 5
+TRADE order4 990 10 order8 990 10
+TRADE order5 980 10 order8 980 10
+SELL:
+1005 10
+BUY:
+)raw");
+}
+
+bool run_test_32()
+{
+    return run_test("Iceberg order - displays only its display qty and replenishes at the level tail",
+R"raw(BUY GFD 1000 30 order1 DISPLAY 10
+BUY GFD 1000 5 order2
+PRINT
+SELL GFD 1000 12 order3
+PRINT
+SELL GFD 1000 25 order4
+PRINT
+SELL GFD 1001 20 order5 DISPLAY 5
+BUY FOK 1001 22 order6
+BUY GFD 999 20 order7 DISPLAY 5
+MODIFY order7 BUY 998 12
+PRINT
+)raw",
+R"raw(SELL:
+BUY:
+1000 15
+TRADE order1 1000 10 order3 1000 10
+TRADE order2 1000 2 order3 1000 2
+SELL:
+BUY:
+1000 13
+TRADE order2 1000 3 order4 1000 3
+TRADE order1 1000 10 order4 1000 10
+TRADE order1 1000 10 order4 1000 10
+SELL:
+1000 2
+BUY:
+TRADE order4 1000 2 order6 1001 2
+TRADE order5 1001 5 order6 1001 5
+TRADE order5 1001 5 order6 1001 5
+TRADE order5 1001 5 order6 1001 5
+TRADE order5 1001 5 order6 1001 5
+SELL:
+BUY:
+998 5
+)raw");
+}
+
+bool run_test_33()
+{
+    return run_test("Stop orders - trigger on the last trade price and cascade in order",
+R"raw(SELL GFD 1000 10 order1
+SELL GFD 1001 10 order2
+SELL GFD 1002 10 order3
+STOP BUY 1001 5 order4
+STOP BUY 1002 5 order5 1002
+STOP SELL 990 5 order6
+CANCEL order6
+BUY GFD 1000 10 order7
+BUY GFD 1001 5 order8
+BUY GFD 1002 5 order9
+PRINT
+BUY GFD 990 5 order10
+BUY GFD 985 5 order11
+STOP SELL 995 5 order12
+STOP SELL 988 5 order13
+SELL GFD 990 1 order14
+PRINT
+)raw",
+R"raw(TRADE order1 1000 10 order7 1000 10
+TRADE order2 1001 5 order8 1001 5
+TRADE order2 1001 5 order4 1001 5
+TRADE order3 1002 5 order9 1002 5
+TRADE order3 1002 5 order5 1002 5
+SELL:
+BUY:
+TRADE order10 990 1 order14 990 1
+TRADE order10 990 4 order12 990 4
+TRADE order11 985 1 order12 985 1
+TRADE order11 985 4 order13 985 4
+SELL:
+BUY:
+)raw");
+}
+
+bool run_test_34()
+{
+    return run_test("Cancel all - cancel the orders of an owner by side and price range",
+R"raw(BUY GFD 100 10 order1 OWNER A
+BUY GFD 99 10 order2 OWNER A
+SELL GFD 105 10 order3 OWNER A
+SELL GFD 106 10 order4 OWNER B
+BUY GFD 100 5 order5 OWNER B
+BUY GFD 98 5 order6 OWNER B
+SELL GFD 110 5 order7
+MODIFY order2 SELL 107 10
+CANCEL order1
+CANCEL_ALL A SELL
+PRINT
+SELL GFD 98 5 order8
+CANCEL_ALL B 97 99
+CANCEL_ALL C
+CANCEL_ALL B SIDE
+CANCEL_ALL B 99
+PRINT
+CANCEL_ALL B
+PRINT
+)raw",
+R"raw(SELL:
+110 5
+106 10
+BUY:
+100 5
+98 5
+TRADE order5 100 5 order8 98 5
+SELL:
+110 5
+106 10
+BUY:
+SELL:
+110 5
+BUY:
+)raw");
+}
+
+bool run_test_35()
+{
+    return run_test("Expire - report and clear all orders, reusing the book's memory",
+R"raw(BUY GFD 100 10 order1 OWNER A
+BUY GFD 99 10 order2 DISPLAY 4
+SELL GFD 105 10 order3 OWNER A
+EXPIRE
+PRINT
+BUY GFD 100 10 order1 OWNER A
+SELL GFD 100 4 order4
+CANCEL_ALL A
+BUY GFD 100 10 order_with_an_id_too_long_to_store_inline
+CLEAR
+CANCEL order_with_an_id_too_long_to_store_inline
+BUY GFD 101 1 order5
+PRINT
+)raw",
+R"raw(EXPIRED order3 SELL 105 10
+EXPIRED order1 BUY 100 10
+EXPIRED order2 BUY 99 10
+SELL:
+BUY:
+TRADE order1 100 4 order4 100 4
+SELL:
+BUY:
+101 1
+)raw");
+}
+
+bool run_test_36()
+{
+    bool ok = run_test("Quote - replace both legs, matching first if crossing, without trading with itself",
+R"raw(SELL GFD 105 5 order1
+BUY GFD 95 5 order2
+QUOTE mm 99 10 101 10
+QUOTE mm 100 10 102 10
+PRINT
+BUY GFD 102 3 order3
+QUOTE mm 103 5 105 7
+PRINT
+QUOTE mm 0 0 106 2
+QUOTE mm 100 5 99 5
+QUOTE mm 106 6 107 1
+PRINT
+)raw",
+R"raw(SELL:
+105 5
+102 10
+BUY:
+100 10
+95 5
+TRADE mm.S 102 3 order3 102 3
+SELL:
+105 12
+BUY:
+103 5
+95 5
+TRADE order1 105 5 mm.B 106 5
+SELL:
+107 1
+BUY:
+106 1
+95 5
+)raw");
+
+    ok = run_market_data_test("Quote - one level update per level touched",
+R"raw(SELL GFD 105 2 order1
+SELL GFD 105 3 order2
+QUOTE mm 99 10 101 10
+QUOTE mm 106 6 107 1
+)raw",
+R"raw(LEVEL SELL 105 2
+TOP 0 0 105 2
+LEVEL SELL 105 5
+TOP 0 0 105 5
+LEVEL BUY 99 10
+LEVEL SELL 101 10
+TOP 99 10 101 10
+TRADE BUY 105 2
+TRADE BUY 105 3
+LEVEL SELL 101 0
+LEVEL SELL 107 1
+LEVEL SELL 105 0
+LEVEL BUY 99 0
+LEVEL BUY 106 1
+TOP 106 1 107 1
+)raw") and ok;
+    return ok;
+}
+
+bool run_test_37()
+{
+    return run_test("Mass quote - requote many quotes at once, skipping invalid entries, without trading with a quote the batch pulls",
+R"raw(SELL GFD 105 5 order1
+MASS_QUOTE 3
+mm1 99 10 101 10
+mm2 98 5 102 5
+mm3 100 0 100 5
+PRINT
+MASS_QUOTE 3 mm3 0 0 0 0 mm1 100 10 104 10 mm2 105 5 104 5
+PRINT
+MASS_QUOTE 2 mm1 106 8 107 8 mm2 97 5 0 0
+PRINT
+)raw",
+R"raw(SELL:
+105 5
+102 5
+101 10
+100 5
+BUY:
+99 10
+98 5
+SELL:
+105 5
+104 10
+102 5
+BUY:
+100 10
+98 5
+TRADE order1 105 5 mm1.B 106 5
+SELL:
+107 8
+BUY:
+106 3
+97 5
+)raw");
+}
+
+bool run_test_38()
 {
-    return run_test("Example 1",
-R"raw(BUY GFD 1000 10 order1
+    return run_test("Sparse levels - far apart prices are found, matched, and erased in price order",
+R"raw(BUY GFD 100 10 order1
+BUY GFD 200000 10 order2
+BUY GFD 70000 10 order3
+SELL GFD 250000 10 order4
+SELL GFD 260000 10 order5
+CANCEL order3
+MODIFY order1 BUY 150 10
+MARKET SELL 15 order6
+MARKET BUY 15 order7 9999
 PRINT
 )raw",
-R"raw(SELL:
+R"raw(TRADE order2 200000 10 order6 200000 10
+TRADE order1 150 5 order6 150 5
+TRADE order4 250000 10 order7 250000 10
+SELL:
+260000 10
 BUY:
-1000 10
+150 5
 )raw");
 }
 
-bool run_test_2()
+bool run_test_39()
 {
-    return run_test("Example 2",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1000 20 order2
+    return run_test("Negative price - only the negative order is rejected",
+R"raw(BUY GFD 100 10 order1
+PRINT
+SELL GFD -100 10 order2
+PRINT
+SELL GFD 100 5 order3
 PRINT
 )raw",
 R"raw(SELL:
 BUY:
-1000 30
+100 10
+SELL:
+BUY:
+100 10
+TRADE order1 100 5 order3 100 5
+SELL:
+BUY:
+100 5
 )raw");
 }
 
-bool run_test_3()
+bool run_test_40()
 {
-    return run_test("Example 3",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1001 20 order2
+    PriceFormat format{};
+    format.scale = 2;
+    format.tick_size = 25;
+    return run_test("Decimal prices - only the order with an off-tick price is rejected",
+R"raw(BUY GFD 101.25 10 order1
+SELL GFD 101.5 5 order2
+SELL GFD 101.250 5 order3
+PRINT
+BUY GFD 99 10 order4
+MODIFY order4 BUY 100.75 10
+PRINT
+BUY GFD 101.30 10 order5
+BUY GFD 100.50 10 order6
 PRINT
 )raw",
-R"raw(SELL:
+R"raw(TRADE order1 101.25 5 order3 101.25 5
+SELL:
+101.50 5
 BUY:
-1001 20
-1000 10
-)raw");
+101.25 5
+SELL:
+101.50 5
+BUY:
+101.25 5
+100.75 10
+SELL:
+101.50 5
+BUY:
+101.25 5
+100.75 10
+100.50 10
+)raw",
+        format);
 }
 
-bool run_test_4()
+bool run_test_41()
 {
-    return run_test("Example 4",
-R"raw(BUY GFD 1000 10 order1
-SELL GFD 900 20 order2
+    MemoryOptions memory{};
+    memory.huge_pages = HugePages::Explicit;
+    memory.prefault = true;
+    return run_test("Huge pages - book on huge pages or the fallback pages matches as on the heap",
+R"raw(BUY GFD 100 10 order1
+BUY GFD 101 10 order2
+SELL GFD 102 10 order3
+SELL GFD 101 15 order_with_an_id_too_long_to_store_inline
+PRINT
+CLEAR
+SELL GFD 103 10 order4
 PRINT
 )raw",
-R"raw(TRADE order1 1000 10 order2 900 10
+R"raw(TRADE order2 101 10 order_with_an_id_too_long_to_store_inline 101 10
 SELL:
-900 10
+102 10
+101 5
 BUY:
-)raw");
+100 10
+SELL:
+103 10
+BUY:
+)raw",
+        memory, 2 * OrderTable::chunk_size);
 }
 
-bool run_test_5()
+bool run_test_42()
 {
-    return run_test("Example 5",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1010 10 order2
-SELL GFD 1000 15 order3
+    bool ok = true;
+    for (auto strategy : {WaitStrategy::Block, WaitStrategy::Spin, WaitStrategy::SpinYield})
+    {
+        ok = run_test("Threads - engine thread executes every command and stops after the parser is done",
+R"raw(BUY GFD 100 10 order1
+SELL GFD 101 10 order2
+SELL GFD 100 5 order3
+MODIFY order2 SELL 100 10
+CANCEL order1
+PRINT
 )raw",
-R"raw(TRADE order2 1010 10 order3 1000 10
-TRADE order1 1000 5 order3 1000 5
-)raw");
+R"raw(TRADE order1 100 5 order3 100 5
+TRADE order1 100 5 order2 100 5
+SELL:
+100 5
+BUY:
+)raw",
+            strategy) and ok;
+    }
+    return ok;
 }
 
-bool run_test_6()
+bool run_test_43()
 {
-    return run_test("Modify",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1000 10 order2
-MODIFY order1 BUY 1000 20
-SELL GFD 900 20 order3
+    return run_test("Mass quote - a malformed batch is rejected whole without handling its fields as commands",
+R"raw(MASS_QUOTE 5000 q BUY GFD 100 10 x
+MASS_QUOTE 2 mm1 99 10 101 10 mm2 98 x 102 5
+MASS_QUOTE 2
+mm1 99 10 x 10
+mm2 98 5 102 5
+BUY GFD 90 1 order1
+STATS
 )raw",
-R"raw(TRADE order2 1000 10 order3 900 10
-TRADE order1 1000 10 order3 900 10
-)raw");
+R"raw(STATS adds 1 cancels 0 modifies 0 clears 0 trades 0 rejects 3 levels_created 1 levels_erased 0 orders 1 peak_orders 1
+)raw",
+        "STATS");
 }
 
-
-bool run_test_7()
+bool run_test_44()
 {
-    return run_test("Multiple orders",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1000 15 order2
-BUY GFD 900 20 order3
-BUY GFD 800 15 order4
-SELL GFD 1100 30 order5
-SELL GFD 1200 50 order6
-SELL GFD 1200 70 order7
-SELL GFD 1300 60 order8
+    bool ok = run_test("Stop orders - order IDs are unique across the book and pending stops",
+R"raw(BUY GFD 90 10 x
+STOP BUY 101 10 x 102
+SELL GFD 102 3 s2
+SELL GFD 101 1 s1
+BUY GFD 101 1 b1
 PRINT
-BUY GFD 1200 160 order9
+STOP SELL 80 5 st
+BUY GFD 95 1 st
+CANCEL x
 PRINT
 )raw",
-R"raw(SELL:
-1300 60
-1200 120
-1100 30
+R"raw(TRADE s1 101 1 b1 101 1
+SELL:
+102 3
 BUY:
-1000 25
-900 20
-800 15
-TRADE order5 1100 30 order9 1200 30
-TRADE order6 1200 50 order9 1200 50
-TRADE order7 1200 70 order9 1200 70
+90 10
 SELL:
-1300 60
+102 3
 BUY:
-1200 10
-1000 25
-900 20
-800 15
 )raw");
+
+    ok = run_market_data_test("Stop orders - trades of a triggered stop have the stop's side",
+R"raw(SELL GFD 106 5 s1
+BUY GFD 105 5 b1
+STOP BUY 105 5 st1
+SELL GFD 105 5 s2
+)raw",
+R"raw(LEVEL SELL 106 5
+TOP 0 0 106 5
+LEVEL BUY 105 5
+TOP 105 5 106 5
+TRADE SELL 105 5
+TRADE BUY 106 5
+LEVEL BUY 105 0
+LEVEL SELL 106 0
+TOP 0 0 0 0
+)raw") and ok;
+    return ok;
 }
 
-bool run_test_8()
+bool run_test_45()
 {
-    return run_test("Trade 1 - 2 orders at same price, full fill",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1000 10 order2
-MODIFY order1 BUY 1000 20
-SELL GFD 900 20 order3
-BUY GFD 1000 10 order1
-PRINT
-BUY GFD 1000 10 order2
-PRINT
-SELL GFD 900 20 order3
+    return run_test("Quote - orders may not use quote leg IDs, so a quote never requotes another order",
+R"raw(BUY GFD 100 10 q.B OWNER alice
+STOP SELL 90 5 q.S
+MARKET SELL 5 q.S
+BUY GFD 100 10 order1 OWNER alice
+QUOTE q 101 5 103 5
+CANCEL_ALL alice
 PRINT
 )raw",
-R"raw(TRADE order2 1000 10 order3 900 10
-TRADE order1 1000 10 order3 900 10
-SELL:
-BUY:
-1000 10
-SELL:
+R"raw(SELL:
+103 5
 BUY:
-1000 20
-TRADE order1 1000 10 order3 900 10
-TRADE order2 1000 10 order3 900 10
-SELL:
+101 5
+)raw");
+}
+
+bool run_test_46()
+{
+    return run_test("Unknown command - its arguments are skipped rather than handled as commands",
+R"raw(FOO BUY GFD 100 5 order1
+SELL GFD 101 5 order2
+PRINT
+)raw",
+R"raw(SELL:
+101 5
 BUY:
 )raw");
 }
 
-bool run_test_9()
-{
-    return run_test("Trade 2 - 2 orders at different prices, partial fill",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1010 10 order2
-SELL GFD 1000 15 order3
-PRINT
-)raw",
-R"raw(TRADE order2 1010 10 order3 1000 10
-TRADE order1 1000 5 order3 1000 5
-SELL:
-BUY:
-1000 5
-)raw");
-}
+bool run_test_47()
+{
+    // Rejected duplicate orders, each tagged with a new owner, must not add the owners.
+    Book book{};
+    book.add<Side::Buy>(OrderID{"order1"}, Qty{10}, Price{100}, Qty{}, OrderID{"A"});
+    for (std::uint64_t i = 0; i != 100; ++i)
+    {
+        book.add<Side::Sell>(OrderID{"order1"}, Qty{10}, Price{105}, Qty{}, OrderID{"B" + std::to_string(i)});
+    }
+
+    if (book.owner_count() != 1 or book.size() != 1 or book.stats().rejects != 100)
+    {
+        std::cout << "FAIL: Cancel all - rejected duplicate orders add no owners - owners " << book.owner_count()
+            << " orders " << book.size()
+            << " rejects " << book.stats().rejects
+            << std::endl;
+        return false;
+    }
+    std::cout << "OK: Cancel all - rejected duplicate orders add no owners" << std::endl;
+    return true;
+}
+
+bool run_test_48()
+{
+    // Each message type has its own latency histogram, so orders that do not rest are not counted as adds.
+    auto book = std::make_shared<Book>();
+    auto matching_engine = std::make_shared<MatchingEngine>(book);
+    matching_engine->handle(SellOrder{TIF::GFD, Price{100}, Qty{10}, OrderID{"order1"}});
+    matching_engine->handle(MarketOrder{Side::Buy, Qty{5}, OrderID{"order2"}, 0});
+    matching_engine->handle(StopOrder{Side::Buy, Price{110}, Qty{5}, OrderID{"order3"}, Price{}});
+    matching_engine->handle(CancelAll{OrderID{"owner1"}, Side::Invalid, false, Price{}, Price{}});
+    matching_engine->handle(ExpireOrders{});
+
+    auto && stats = matching_engine->stats();
+    auto count = [&stats](EngineStats::Type type) { return stats.latency(type).count(); };
+    if (count(EngineStats::Type::Buy) != 0 or count(EngineStats::Type::Sell) != 1
+        or count(EngineStats::Type::Market) != 1 or count(EngineStats::Type::Stop) != 1
+        or count(EngineStats::Type::Cancel) != 0 or count(EngineStats::Type::CancelAll) != 1
+        or count(EngineStats::Type::Clear) != 0 or count(EngineStats::Type::Expire) != 1)
+    {
+        std::cout << "FAIL: Stats - each message type is timed separately - buys " << count(EngineStats::Type::Buy)
+            << " sells " << count(EngineStats::Type::Sell)
+            << " markets " << count(EngineStats::Type::Market)
+            << " stops " << count(EngineStats::Type::Stop)
+            << " cancels " << count(EngineStats::Type::Cancel)
+            << " cancel_alls " << count(EngineStats::Type::CancelAll)
+            << " clears " << count(EngineStats::Type::Clear)
+            << " expires " << count(EngineStats::Type::Expire)
+            << std::endl;
+        return false;
+    }
+    std::cout << "OK: Stats - each message type is timed separately" << std::endl;
+    return true;
+}
+
+}
+
+
+/*
+ * 10. Benchmarks - Microbenchmarks of each book operation across book depths, level densities, and book backends.
+ */
+
+namespace {
+
+// Counts hardware cache misses of the calling thread with perf_event_open, if available (e.g., not in some containers).
+class CacheMissCounter
+{
+public:
+    CacheMissCounter()
+    {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~CacheMissCounter()
+    {
+        if (available())
+        {
+            ::close(fd_);
+        }
+    }
+
+    CacheMissCounter(CacheMissCounter const &) = delete;
+    CacheMissCounter & operator=(CacheMissCounter const &) = delete;
+
+    bool available() const noexcept { return fd_ != -1; }
+
+    void start()
+    {
+#ifdef __linux__
+        if (available())
+        {
+            ::ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ::ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Stop counting and return the number of cache misses since start().
+    std::uint64_t stop()
+    {
+        std::uint64_t count = 0;
+#ifdef __linux__
+        if (available())
+        {
+            ::ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (::read(fd_, &count, sizeof(count)) != sizeof(count))
+            {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+
+// Totals of a timed operation.
+struct BenchResult
+{
+    std::uint64_t ops = 0;
+    std::uint64_t ns = 0;
+    std::uint64_t cache_misses = 0;
+    std::uint64_t allocs = 0;
+};
+
+// Book filled with depth resting orders split between buys and sells with orders_per_level orders per level,
+// where buys are priced below sells so they do not match.
+// Tracks each resting order so operations can pick random orders and levels without querying the book.
+template <typename Book_T>
+class BookBench
+{
+public:
+    static constexpr std::size_t batch_size = 1000;
+
+    BookBench(std::size_t depth, std::size_t orders_per_level)
+        : levels_per_side_{std::max<std::size_t>(1, depth / 2 / orders_per_level)}
+    {
+        orders_.reserve(depth);
+        for (std::size_t i = 0; i != depth; ++i)
+        {
+            Side const side = i % 2 == 0 ? Side::Buy : Side::Sell;
+            auto const level = (i / 2) % levels_per_side_;
+            orders_.push_back(Resting{OrderID{"r" + std::to_string(i)}, side, price(side, level), Qty{10}});
+            auto && order = orders_.back();
+            book_.add(order.side, order.order_id, order.qty, order.price);
+        }
+        for (std::size_t i = 0; i != batch_size; ++i)
+        {
+            new_order_ids_.push_back(OrderID{"n" + std::to_string(i)});
+        }
+        trades_.reserve(depth + batch_size);
+    }
+
+    // Add batch of orders to random existing levels, then cancel them (untimed).
+    BenchResult add(std::size_t ops)
+    {
+        return run(ops,
+            [this](std::size_t batch)
+            {
+                return prepare(batch);
+            },
+            [this](std::size_t batch)
+            {
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    auto && order = orders_[picks_[i]];
+                    book_.add(order.side, new_order_ids_[i], order.qty, order.price);
+                }
+            },
+            [this](std::size_t batch)
+            {
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    book_.cancel(new_order_ids_[i]);
+                }
+            });
+    }
+
+    // Cancel batch of random orders, then add them back (untimed).
+    BenchResult cancel(std::size_t ops)
+    {
+        return run(ops,
+            [this](std::size_t batch)
+            {
+                return prepare_unique(batch);
+            },
+            [this](std::size_t batch)
+            {
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    book_.cancel(orders_[picks_[i]].order_id);
+                }
+            },
+            [this](std::size_t batch)
+            {
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    auto && order = orders_[picks_[i]];
+                    book_.add(order.side, order.order_id, order.qty, order.price);
+                }
+            });
+    }
+
+    // Modify qty of random orders, keeping their levels, so they lose queue position.
+    BenchResult modify_same_level(std::size_t ops)
+    {
+        return run(ops,
+            [this](std::size_t batch)
+            {
+                prepare(batch);
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    auto && order = orders_[picks_[i]];
+                    order.qty = Qty{order.qty.value() % 20 + 1};
+                }
+                return batch;
+            },
+            [this](std::size_t batch)
+            {
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    auto && order = orders_[picks_[i]];
+                    book_.modify(order.side, order.order_id, order.qty, order.price);
+                }
+            },
+            [](std::size_t) {});
+    }
+
+    // Move random orders to other random levels on the same side.
+    BenchResult modify_new_level(std::size_t ops)
+    {
+        return run(ops,
+            [this](std::size_t batch)
+            {
+                prepare(batch);
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    auto && order = orders_[picks_[i]];
+                    order.price = price(order.side, random_() % levels_per_side_);
+                }
+                return batch;
+            },
+            [this](std::size_t batch)
+            {
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    auto && order = orders_[picks_[i]];
+                    book_.modify(order.side, order.order_id, order.qty, order.price);
+                }
+            },
+            [](std::size_t) {});
+    }
+
+    // Move random orders to the same level on the other side, then move them back (untimed).
+    BenchResult modify_side(std::size_t ops)
+    {
+        auto modify_all = [this](std::size_t batch)
+        {
+            for (std::size_t i = 0; i != batch; ++i)
+            {
+                auto && order = orders_[picks_[i]];
+                order.side = order.side == Side::Buy ? Side::Sell : Side::Buy;
+                order.price = price(order.side, level(order.price));
+                book_.modify(order.side, order.order_id, order.qty, order.price);
+            }
+        };
+        return run(ops,
+            [this](std::size_t batch)
+            {
+                return prepare_unique(batch);
+            },
+            modify_all,
+            modify_all);
+    }
+
+    // Match an aggressive order with exactly the first order of the best level, then add it back (untimed).
+    BenchResult match_one(std::size_t ops)
+    {
+        return match(ops, 1, false);
+    }
+
+    // Match an aggressive order with all orders of the best levels_to_sweep levels, then add them back (untimed).
+    BenchResult sweep(std::size_t ops, std::size_t levels_to_sweep)
+    {
+        return match(ops, levels_to_sweep, false);
+    }
+
+    // Sweep the best levels_to_sweep levels with a market order protected by a band of the same number of ticks.
+    BenchResult market_sweep(std::size_t ops, std::size_t levels_to_sweep)
+    {
+        return match(ops, levels_to_sweep, true);
+    }
+
+    // Clear the whole book, then add its orders back (untimed), where each op is one cleared order.
+    BenchResult clear(std::size_t rounds)
+    {
+        BenchResult result{};
+        for (std::size_t round = 0; round != rounds; ++round)
+        {
+            timed(result, [this]
+            {
+                book_.clear();
+            });
+            result.ops += orders_.size();
+
+            for (auto && order : orders_)
+            {
+                book_.add(order.side, order.order_id, order.qty, order.price);
+            }
+            book_.clear_level_updates();
+        }
+        return result;
+    }
+
+    std::size_t levels_per_side() const noexcept { return levels_per_side_; }
 
+private:
+    struct Resting
+    {
+        OrderID order_id;
+        Side side;
+        Price price;
+        Qty qty;
+    };
 
-bool run_test_10()
-{
-    return run_test("Self-match prevention test - should fully fill order2 and cancel original order1",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1000 10 order2
-MODIFY order1 SELL 1000 10
-PRINT
-)raw",
-R"raw(TRADE order2 1000 10 order1 1000 10
-SELL:
-BUY:
-)raw");
-}
+    static constexpr std::uint64_t mid_price = 1000000000;
 
+    // Price of the nth level from the best (the 0th level) on the side.
+    static Price price(Side side, std::size_t level)
+    {
+        return Price{static_cast<Price::value_type>(side == Side::Buy ? mid_price - level : mid_price + 1 + level)};
+    }
 
-bool run_test_11()
-{
-    return run_test("Self-match prevention test - should partially fill order2 and modify original order1",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1000 5 order2
-MODIFY order1 SELL 900 10
-PRINT
-)raw",
-R"raw(TRADE order2 1000 5 order1 900 5
-SELL:
-900 5
-BUY:
-)raw");
-}
+    static std::size_t level(Price price)
+    {
+        return price.value() < mid_price + 1 ? mid_price - price.value() : price.value() - mid_price - 1;
+    }
 
+    // Pick random resting orders for the batch.
+    std::size_t prepare(std::size_t batch)
+    {
+        picks_.clear();
+        for (std::size_t i = 0; i != batch; ++i)
+        {
+            picks_.push_back(random_() % orders_.size());
+        }
+        return picks_.size();
+    }
 
-bool run_test_12()
-{
-    return run_test("IOC - book is empty so no matching and orders are not added to book",
-R"raw(BUY IOC 1000 10 order1
-SELL IOC 1000 10 order2
-PRINT
-)raw",
-R"raw(SELL:
-BUY:
-)raw");
-}
+    // Pick random distinct resting orders for the batch, so the batch may be smaller than requested.
+    std::size_t prepare_unique(std::size_t batch)
+    {
+        prepare(batch);
+        std::sort(picks_.begin(), picks_.end());
+        picks_.erase(std::unique(picks_.begin(), picks_.end()), picks_.end());
+        std::shuffle(picks_.begin(), picks_.end(), random_);
+        return picks_.size();
+    }
 
+    // Alternate selling into the buys and buying from the sells.
+    BenchResult match(std::size_t ops, std::size_t levels_to_sweep, bool is_market)
+    {
+        Side aggressive_side = Side::Sell;
+        OrderID const aggressive_order_id{"aggressive"};
+        return run(ops,
+            [&](std::size_t batch)
+            {
+                aggressive_side = aggressive_side == Side::Buy ? Side::Sell : Side::Buy;
+                return batch;
+            },
+            [&](BenchResult & result, std::size_t batch)
+            {
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    // Book must be restored after each match to match the same orders, so time each match.
+                    Qty qty{};
+                    Price price{};
+                    auto sum_levels = [&](auto const & levels)
+                    {
+                        std::size_t level_count = 0;
+                        for (auto iter = levels.cbegin(); iter != levels.cend() and level_count != levels_to_sweep;
+                            ++iter, ++level_count)
+                        {
+                            price = iter->price();
+                            qty += levels_to_sweep == 1 ? iter->front().qty() : iter->qty();
+                        }
+                    };
+                    if (aggressive_side == Side::Buy)
+                    {
+                        sum_levels(book_.sell_levels());
+                    }
+                    else
+                    {
+                        sum_levels(book_.buy_levels());
+                    }
 
-bool run_test_13()
-{
-    return run_test("IOC - full fill, no orders left",
-R"raw(BUY GFD 1000 10 order1
-SELL IOC 1000 10 order2
-PRINT
-)raw",
-R"raw(TRADE order1 1000 10 order2 1000 10
-SELL:
-BUY:
-)raw");
-}
+                    trades_.clear();
+                    timed(result, [&]
+                    {
+                        if (is_market)
+                        {
+                            book_.match_market(aggressive_side, aggressive_order_id, qty, levels_to_sweep, trades_);
+                        }
+                        else
+                        {
+                            book_.match(aggressive_side, aggressive_order_id, qty, price, trades_);
+                        }
+                    });
 
-bool run_test_14()
-{
-    return run_test("IOC - full fill, order left",
-R"raw(BUY GFD 1000 15 order1
-SELL IOC 1000 10 order2
-PRINT
-)raw",
-R"raw(TRADE order1 1000 10 order2 1000 10
-SELL:
-BUY:
-1000 5
-)raw");
-}
+                    for (auto && trade : trades_)
+                    {
+                        Side const passive_side = aggressive_side == Side::Buy ? Side::Sell : Side::Buy;
+                        book_.add(passive_side, trade.passive_order.order_id(), trade.passive_order.qty(),
+                            trade.passive_price);
+                    }
+                }
+            },
+            [](std::size_t) {},
+            true);
+    }
 
-bool run_test_15()
-{
-    return run_test("IOC - partial fill, non-IOC order is left",
-R"raw(BUY GFD 900 5 order1
-BUY GFD 1000 5 order2
-SELL IOC 1000 10 order3
-PRINT
-)raw",
-R"raw(TRADE order2 1000 5 order3 1000 5
-SELL:
-BUY:
-900 5
-)raw");
-}
+    // Run ops in batches, timing only the operation and counting its cache misses and allocations.
+    // A self-timed operation instead times the parts it wants with timed().
+    template <typename Prepare, typename Operation, typename Restore>
+    BenchResult run(std::size_t ops, Prepare const & prepare, Operation const & operation, Restore const & restore,
+        bool self_timed = false)
+    {
+        BenchResult result{};
+        while (result.ops < ops)
+        {
+            std::size_t const batch = prepare(std::min(batch_size, ops - result.ops));
+            if (self_timed)
+            {
+                call(operation, result, batch);
+            }
+            else
+            {
+                timed(result, [&]
+                {
+                    call(operation, result, batch);
+                });
+            }
+            result.ops += batch;
+            restore(batch);
+            book_.clear_level_updates();
+        }
+        return result;
+    }
 
-bool run_test_16()
-{
-    return run_test("IOC - full fill over multiple orders, non-IOC order is left",
-R"raw(BUY GFD 900 5 order1
-BUY GFD 1000 5 order2
-BUY GFD 1100 5 order3
-SELL IOC 1000 10 order4
-PRINT
-)raw",
-R"raw(TRADE order3 1100 5 order4 1000 5
-TRADE order2 1000 5 order4 1000 5
-SELL:
-BUY:
-900 5
-)raw");
-}
+    template <typename Function>
+    void timed(BenchResult & result, Function const & function)
+    {
+        auto const start_allocs = AllocCounter::count();
+        cache_misses_.start();
+        auto const start_ns = now_ns();
+        function();
+        auto const end_ns = now_ns();
+        result.cache_misses += cache_misses_.stop();
+        result.allocs += (AllocCounter::count() - start_allocs).allocs;
+        result.ns += end_ns - start_ns;
+    }
 
-bool run_test_17()
-{
-    return run_test("Duplicate order id when adding",
-R"raw(BUY GFD 900 5 order1
-BUY GFD 900 5 order1
-PRINT
-)raw",
-R"raw(SELL:
-BUY:
-900 5
-)raw");
-}
+    template <typename Operation>
+    static auto call(Operation const & operation, BenchResult &, std::size_t batch) -> decltype(operation(batch))
+    {
+        return operation(batch);
+    }
+
+    template <typename Operation>
+    static auto call(Operation const & operation, BenchResult & result, std::size_t batch)
+        -> decltype(operation(result, batch))
+    {
+        return operation(result, batch);
+    }
 
+    std::size_t const levels_per_side_;
+    Book_T book_;
+    std::vector<Resting> orders_;
+    std::vector<OrderID> new_order_ids_;
+    std::vector<std::size_t> picks_;
+    Trades trades_;
+    std::mt19937_64 random_{42};
+    CacheMissCounter cache_misses_;
+};
 
-bool run_test_18()
+template <typename Book_T>
+constexpr std::size_t BookBench<Book_T>::batch_size;
+
+template <typename Book_T>
+constexpr std::uint64_t BookBench<Book_T>::mid_price;
+
+void write_bench_result(char const * backend, char const * op, std::size_t depth, std::size_t orders_per_level,
+    BenchResult const & result, bool has_cache_misses)
 {
-    return run_test("Unknown order id when cancelling",
-R"raw(CANCEL unknown
-PRINT
-)raw",
-R"raw(SELL:
-BUY:
-)raw");
+    auto const ops = static_cast<double>(std::max<std::uint64_t>(result.ops, 1));
+    std::cout << backend
+        << ' ' << op
+        << ' ' << depth
+        << ' ' << orders_per_level
+        << ' ' << static_cast<double>(result.ns) / ops;
+    if (has_cache_misses)
+    {
+        std::cout << ' ' << static_cast<double>(result.cache_misses) / ops;
+    }
+    else
+    {
+        std::cout << " n/a";
+    }
+#ifdef COUNT_ALLOCS
+    std::cout << ' ' << static_cast<double>(result.allocs) / ops << std::endl;
+#else
+    std::cout << " n/a" << std::endl;
+#endif
 }
 
-bool run_test_19()
+template <typename Book_T>
+void run_book_benchmarks(char const * backend, std::size_t max_depth)
 {
-    return run_test("Unknown order id when modifying",
-R"raw(MODIFY unknown BUY 1000 20
-PRINT
-)raw",
-R"raw(SELL:
-BUY:
-)raw");
-}
+    std::size_t const ops = 10000;
+    for (std::size_t depth = 10; depth <= max_depth; depth *= 10)
+    {
+        for (std::size_t orders_per_level : {1, 10, 100})
+        {
+            if (orders_per_level * 2 > depth)
+            {
+                continue;
+            }
 
+            BookBench<Book_T> bench{depth, orders_per_level};
+            bool const has_cache_misses = CacheMissCounter{}.available();
+            auto write = [&](char const * op, BenchResult const & result)
+            {
+                write_bench_result(backend, op, depth, orders_per_level, result, has_cache_misses);
+            };
+            write("add", bench.add(ops));
+            write("cancel", bench.cancel(ops));
+            write("modify_same_level", bench.modify_same_level(ops));
+            write("modify_new_level", bench.modify_new_level(ops));
+            write("modify_side", bench.modify_side(ops));
+            write("match_one", bench.match_one(ops));
+            write("sweep_10_levels", bench.sweep(ops / 10, std::min<std::size_t>(10, bench.levels_per_side())));
+            write("market_sweep_10_levels",
+                bench.market_sweep(ops / 10, std::min<std::size_t>(10, bench.levels_per_side())));
+            write("clear", bench.clear(10));
+        }
+    }
+}
 
-bool run_test_20()
+// CPU time of the calling thread in nanoseconds.
+std::uint64_t thread_cpu_ns()
 {
-    return run_test("Invalid price and qty",
-R"raw(BUY GFD a 5 order1
-BUY GFD 900 b order1
-PRINT
-)raw",
-R"raw()raw");
+    timespec ts{};
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + static_cast<std::uint64_t>(ts.tv_nsec);
 }
 
-
-bool run_test_21()
+// Wake-up latency against CPU burn of the engine thread for each wait strategy, with a producer that pushes a task
+// to the task queue every gap_us, as when commands arrive one at a time.
+// Latency is from pushing a task to the consumer starting it, and CPU is the consumer's CPU time over wall time.
+void run_wait_benchmarks()
 {
-    return run_test("Trade - 2 sell orders at same price, full fill",
-R"raw(SELL GFD 1000 10 order1
-PRINT
-SELL GFD 1000 10 order2
-PRINT
-BUY GFD 1100 20 order3
-PRINT
-)raw",
-R"raw(SELL:
-1000 10
-BUY:
-SELL:
-1000 20
-BUY:
-TRADE order1 1000 10 order3 1100 10
-TRADE order2 1000 10 order3 1100 10
-SELL:
-BUY:
-)raw");
+    std::size_t const tasks = 1000;
+
+    // Run both threads with the normal policy, since a SCHED_FIFO spinner (inherited from --sched-fifo) would
+    // starve a producer sharing its core.
+    auto set_normal_policy = []()
+    {
+        sched_param param{};
+        ::pthread_setschedparam(::pthread_self(), SCHED_OTHER, &param);
+    };
+
+    std::cout << "wait_strategy gap_us p50_ns p99_ns max_ns consumer_cpu_percent" << std::endl;
+    for (auto strategy : {WaitStrategy::Block, WaitStrategy::SpinYield, WaitStrategy::Spin})
+    {
+        for (std::uint64_t gap_us : {10, 100})
+        {
+            TaskQueue task_queue{};
+            std::vector<std::uint64_t> latencies_ns(tasks);
+            std::uint64_t cpu_ns = 0;
+            std::uint64_t wall_ns = 0;
+            std::thread consumer{
+                [&]()
+                {
+                    set_normal_policy();
+                    auto const start_cpu_ns = thread_cpu_ns();
+                    auto const start_ns = now_ns();
+                    Task task{};
+                    while (task_queue.wait_and_pop(task, strategy))
+                    {
+                        task();
+                    }
+                    cpu_ns = thread_cpu_ns() - start_cpu_ns;
+                    wall_ns = now_ns() - start_ns;
+                }};
+
+            std::thread producer{
+                [&]()
+                {
+                    set_normal_policy();
+                    for (std::size_t i = 0; i != tasks; ++i)
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds{gap_us});
+                        task_queue.push(
+                            [&latencies_ns, i, pushed_ns = now_ns()]()
+                            {
+                                latencies_ns[i] = now_ns() - pushed_ns;
+                            });
+                    }
+                    task_queue.close();
+                }};
+            producer.join();
+            consumer.join();
+
+            std::sort(latencies_ns.begin(), latencies_ns.end());
+            auto percentile = [&](double p)
+            {
+                return latencies_ns[static_cast<std::size_t>(p * static_cast<double>(tasks - 1))];
+            };
+            std::cout << strategy
+                << ' ' << gap_us
+                << ' ' << percentile(0.50)
+                << ' ' << percentile(0.99)
+                << ' ' << latencies_ns.back()
+                << ' ' << 100.0 * static_cast<double>(cpu_ns) / static_cast<double>(std::max<std::uint64_t>(wall_ns, 1))
+                << std::endl;
+        }
+    }
 }
 
-bool run_test_22()
+void run_all_benchmarks(std::size_t max_depth)
 {
-    return run_test("Modify queue position - should partially fill order1 since back of the queue after modify",
-R"raw(BUY GFD 1000 10 order1
-BUY GFD 1000 10 order2
-MODIFY order1 BUY 1000 10
-SELL GFD 1000 15 order3
-PRINT
-)raw",
-R"raw(TRADE order1 1000 10 order3 1000 10
-TRADE order2 1000 5 order3 1000 5
-SELL:
-BUY:
-1000 5
-)raw");
+    std::cout << "backend op depth orders_per_level ns_per_op cache_misses_per_op allocs_per_op" << std::endl;
+    run_book_benchmarks<Book>(Levels<Side::Buy>::name(), max_depth);
+    std::cout << std::endl;
+    run_wait_benchmarks();
 }
 
 }
-